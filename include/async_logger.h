@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+namespace vi_ekf
+{
+
+// Receives the records drained by AsyncLogger, only ever called from one thread at a time
+class LogSink
+{
+public:
+  virtual ~LogSink() {}
+  virtual void write(const int stream, const char* data, const size_t bytes) = 0;
+  virtual void flush() = 0;
+};
+
+// Moves log writes off the filter thread.  Records are copied into a preallocated
+// single-producer/single-consumer ring buffer, and a writer thread drains them into the
+// sink.  Only one thread may produce records (begin/append/commit/write/flush).
+class AsyncLogger
+{
+public:
+  typedef enum
+  {
+    DROP, // discard records that don't fit in the buffer
+    BLOCK // wait for the writer to make room
+  } overflow_policy_t;
+
+  AsyncLogger(std::unique_ptr<LogSink> sink, const size_t buffer_bytes=(1 << 23), const overflow_policy_t policy=DROP);
+  ~AsyncLogger();
+
+  // Write one record of exactly `bytes` bytes to `stream` as begin, then appends adding up
+  // to `bytes`, then commit.  If begin returns false the record was dropped and the appends
+  // and commit do nothing.
+  bool begin(const int stream, const size_t bytes);
+  void append(const void* data, const size_t bytes);
+  void commit();
+
+  bool write(const int stream, const void* data, const size_t bytes);
+
+  // Block until everything committed so far has been written out and flushed
+  void flush();
+
+  inline uint64_t dropped_records() const { return dropped_records_.load(std::memory_order_relaxed); }
+  inline uint64_t written_records() const { return written_records_.load(std::memory_order_relaxed); }
+  inline size_t capacity() const { return buf_.size(); }
+
+private:
+  struct record_header_t
+  {
+    uint32_t stream;
+    uint32_t bytes;
+  };
+
+  void copy_in(const size_t pos, const void* data, const size_t bytes);
+  const char* contiguous(const size_t pos, const size_t bytes);
+  bool drain();
+  void work();
+
+  std::vector<char> buf_; // size is a power of two
+  size_t mask_;
+  overflow_policy_t policy_;
+
+  // Absolute (unwrapped) positions, head_ is only written by the producer, tail_ by the writer
+  std::atomic<size_t> head_;
+  std::atomic<size_t> tail_;
+
+  // Producer state for the record being written
+  bool in_record_;
+  size_t record_pos_;
+  size_t record_end_;
+
+  std::atomic<uint64_t> dropped_records_;
+  std::atomic<uint64_t> written_records_;
+
+  std::unique_ptr<LogSink> sink_;
+  std::mutex sink_mtx_;
+  std::vector<char> scratch_; // for records that wrap around the end of the buffer
+
+  std::thread thread_;
+  std::mutex wake_mtx_;
+  std::condition_variable wake_cv_; // the writer waits for records
+  std::condition_variable drained_cv_; // the producer waits for the writer to free space
+  std::atomic<bool> stop_;
+};
+
+}
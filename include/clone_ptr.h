@@ -0,0 +1,73 @@
+#pragma once
+
+#include <utility>
+
+namespace vi_ekf
+{
+
+// Owning pointer for members that copies of their owner must not share.  Copying the
+// pointer copies the object (T's copy constructor decides what that means).  The copy and
+// delete functions are picked up by reset(), so the owner's copy constructor and destructor
+// can be instantiated where T is only forward declared.
+template <typename T>
+class clone_ptr
+{
+public:
+  clone_ptr() : ptr_(nullptr), copy_(nullptr), delete_(nullptr) {}
+  ~clone_ptr() { reset(); }
+
+  clone_ptr(const clone_ptr& other) : ptr_(nullptr), copy_(other.copy_), delete_(other.delete_)
+  {
+    if (other.ptr_)
+      ptr_ = copy_(other.ptr_);
+  }
+
+  clone_ptr& operator=(const clone_ptr& other)
+  {
+    if (this != &other)
+    {
+      clone_ptr tmp(other);
+      swap(tmp);
+    }
+    return *this;
+  }
+
+  clone_ptr(clone_ptr&& other) : clone_ptr() { swap(other); }
+  clone_ptr& operator=(clone_ptr&& other) { swap(other); return *this; }
+
+  // Take ownership of ptr (T must be complete here)
+  void reset(T* ptr)
+  {
+    clone_ptr tmp;
+    tmp.ptr_ = ptr;
+    tmp.copy_ = [](const T* p) { return new T(*p); };
+    tmp.delete_ = [](T* p) { delete p; };
+    swap(tmp);
+  }
+
+  void reset()
+  {
+    if (ptr_)
+      delete_(ptr_);
+    ptr_ = nullptr;
+  }
+
+  void swap(clone_ptr& other)
+  {
+    std::swap(ptr_, other.ptr_);
+    std::swap(copy_, other.copy_);
+    std::swap(delete_, other.delete_);
+  }
+
+  inline T* get() const { return ptr_; }
+  inline T* operator->() const { return ptr_; }
+  inline T& operator*() const { return *ptr_; }
+  inline explicit operator bool() const { return ptr_ != nullptr; }
+
+private:
+  T* ptr_;
+  T* (*copy_)(const T*);
+  void (*delete_)(T*);
+};
+
+}
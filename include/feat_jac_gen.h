@@ -0,0 +1,185 @@
+// Generated by scripts/gen_jacobians.py (make jacobian_codegen), do not edit by hand
+#pragma once
+
+namespace vi_ekf
+{
+namespace gen
+{
+
+// 72 operations
+// Feature state derivative dzeta[2], drho[1]
+template <typename T>
+inline void feat_dynamics(const T* q, const T rho, const T* omega_c, const T* vel_c, T* dzeta, T* drho)
+{
+  const T s0 = T(2)*(q[2]*q[2]);
+  const T s1 = T(2)*(q[3]*q[3]) + T(-1);
+  const T s2 = q[0]*q[3];
+  const T s3 = q[0]*q[2];
+  const T s4 = T(2)*(q[1]*q[1]);
+  const T s5 = q[0]*q[1];
+  const T Rt0 = -s0 - s1;
+  const T Rt1 = T(2)*q[1]*q[2] - T(2)*s2;
+  const T Rt2 = T(2)*q[1]*q[3] + T(2)*s3;
+  const T Rt3 = T(2)*q[1]*q[2] + T(2)*s2;
+  const T Rt4 = -s1 - s4;
+  const T Rt5 = T(2)*q[2]*q[3] - T(2)*s5;
+  const T Rt6 = T(2)*q[1]*q[3] - T(2)*s3;
+  const T Rt7 = T(2)*q[2]*q[3] + T(2)*s5;
+  const T Rt8 = -s0 - s4 + T(1);
+  const T t0 = omega_c[0] + rho*(Rt5*vel_c[2] - Rt8*vel_c[1]);
+  const T t1 = omega_c[2] + rho*(Rt2*vel_c[1] - Rt5*vel_c[0]);
+  const T t2 = omega_c[1] - rho*(Rt2*vel_c[2] - Rt8*vel_c[0]);
+  dzeta[0] = Rt0*t0 + Rt3*t2 + Rt6*t1;
+  dzeta[1] = Rt1*t0 + Rt4*t2 + Rt7*t1;
+  drho[0] = (rho*rho)*(Rt2*vel_c[0] + Rt5*vel_c[1] + Rt8*vel_c[2]);
+}
+
+// 337 operations
+// Feature dynamics Jacobian blocks (row-major).  R_b_c is row-major, and the input
+// Jacobian blocks are the same as the gyro bias blocks
+template <typename T>
+inline void feat_jacobian(const T* q, const T rho, const T* omega_c, const T* vel_c, const T* R_b_c, const T* p_b_c, T* A_zeta_vel, T* A_zeta_bg, T* A_zeta_zeta, T* A_zeta_rho, T* A_rho_vel, T* A_rho_bg, T* A_rho_zeta, T* A_rho_rho)
+{
+  const T s0 = T(2)*(q[2]*q[2]);
+  const T s1 = T(2)*(q[3]*q[3]) + T(-1);
+  const T s2 = q[0]*q[3];
+  const T s3 = q[0]*q[2];
+  const T s4 = T(2)*(q[1]*q[1]);
+  const T s5 = q[0]*q[1];
+  const T Rt0 = -s0 - s1;
+  const T Rt1 = T(2)*q[1]*q[2] - T(2)*s2;
+  const T Rt2 = T(2)*q[1]*q[3] + T(2)*s3;
+  const T Rt3 = T(2)*q[1]*q[2] + T(2)*s2;
+  const T Rt4 = -s1 - s4;
+  const T Rt5 = T(2)*q[2]*q[3] - T(2)*s5;
+  const T Rt6 = T(2)*q[1]*q[3] - T(2)*s3;
+  const T Rt7 = T(2)*q[2]*q[3] + T(2)*s5;
+  const T Rt8 = -s0 - s4 + T(1);
+  const T t0 = Rt3*Rt8 - Rt5*Rt6;
+  const T t1 = Rt0*Rt5 - Rt2*Rt3;
+  const T t2 = Rt0*Rt8 - Rt2*Rt6;
+  const T t3 = Rt4*Rt8 - Rt5*Rt7;
+  const T t4 = Rt1*Rt5 - Rt2*Rt4;
+  const T t5 = Rt1*Rt8 - Rt2*Rt7;
+  const T t6 = -R_b_c[5]*Rt8 + R_b_c[8]*Rt5;
+  const T t7 = p_b_c[1]*rho;
+  const T t8 = -R_b_c[4]*Rt8 + R_b_c[7]*Rt5;
+  const T t9 = p_b_c[2]*rho;
+  const T t10 = R_b_c[0] + t6*t7 - t8*t9;
+  const T t11 = R_b_c[2]*Rt8 - R_b_c[8]*Rt2;
+  const T t12 = R_b_c[1]*Rt8 - R_b_c[7]*Rt2;
+  const T t13 = R_b_c[3] + t11*t7 - t12*t9;
+  const T t14 = -R_b_c[2]*Rt5 + R_b_c[5]*Rt2;
+  const T t15 = -R_b_c[1]*Rt5 + R_b_c[4]*Rt2;
+  const T t16 = R_b_c[6] + t14*t7 - t15*t9;
+  const T t17 = -R_b_c[3]*Rt8 + R_b_c[6]*Rt5;
+  const T t18 = p_b_c[0]*rho;
+  const T t19 = R_b_c[1] + t17*t9 - t18*t6;
+  const T t20 = R_b_c[0]*Rt8 - R_b_c[6]*Rt2;
+  const T t21 = R_b_c[4] - t11*t18 + t20*t9;
+  const T t22 = -R_b_c[0]*Rt5 + R_b_c[3]*Rt2;
+  const T t23 = R_b_c[7] - t14*t18 + t22*t9;
+  const T t24 = R_b_c[2] - t17*t7 + t18*t8;
+  const T t25 = R_b_c[5] + t12*t18 - t20*t7;
+  const T t26 = R_b_c[8] + t15*t18 - t22*t7;
+  const T t27 = Rt5*vel_c[1];
+  const T t28 = Rt8*vel_c[2];
+  const T t29 = t27 + t28;
+  const T t30 = rho*t29;
+  const T t31 = Rt5*vel_c[0];
+  const T t32 = Rt2*vel_c[1] - t31;
+  const T t33 = omega_c[2] + rho*t32;
+  const T t34 = rho*t31 + t33;
+  const T t35 = Rt2*vel_c[2];
+  const T t36 = -Rt8*vel_c[0] + t35;
+  const T t37 = omega_c[1] - rho*t36;
+  const T t38 = Rt8*rho*vel_c[0] - t37;
+  const T t39 = -Rt0*t30 + Rt3*t34 + Rt6*t38;
+  const T t40 = Rt2*vel_c[0];
+  const T t41 = rho*(t28 + t40);
+  const T t42 = Rt8*vel_c[1];
+  const T t43 = Rt5*vel_c[2] - t42;
+  const T t44 = omega_c[0] + rho*t43;
+  const T t45 = rho*t42 + t44;
+  const T t46 = Rt2*rho*vel_c[1] - t33;
+  const T t47 = Rt0*t46 - Rt3*t41 + Rt6*t45;
+  const T t48 = rho*(t27 + t40);
+  const T t49 = rho*t35 + t37;
+  const T t50 = Rt5*rho*vel_c[2] - t44;
+  const T t51 = Rt0*t49 + Rt3*t50 - Rt6*t48;
+  const T t52 = -Rt1*t30 + Rt4*t34 + Rt7*t38;
+  const T t53 = Rt1*t46 - Rt4*t41 + Rt7*t45;
+  const T t54 = Rt1*t49 + Rt4*t50 - Rt7*t48;
+  const T t55 = Rt0*t43 - Rt3*t36 + Rt6*t32;
+  const T t56 = Rt1*t43 - Rt4*t36 + Rt7*t32;
+  const T t57 = (rho*rho);
+  const T t58 = R_b_c[0]*Rt2 + R_b_c[3]*Rt5 + R_b_c[6]*Rt8;
+  const T t59 = R_b_c[1]*Rt2 + R_b_c[4]*Rt5 + R_b_c[7]*Rt8;
+  const T t60 = R_b_c[2]*Rt2 + R_b_c[5]*Rt5 + R_b_c[8]*Rt8;
+  A_zeta_vel[0] = rho*(R_b_c[0]*t0 - R_b_c[3]*t2 + R_b_c[6]*t1);
+  A_zeta_vel[1] = rho*(R_b_c[1]*t0 - R_b_c[4]*t2 + R_b_c[7]*t1);
+  A_zeta_vel[2] = rho*(R_b_c[2]*t0 - R_b_c[5]*t2 + R_b_c[8]*t1);
+  A_zeta_vel[3] = rho*(R_b_c[0]*t3 - R_b_c[3]*t5 + R_b_c[6]*t4);
+  A_zeta_vel[4] = rho*(R_b_c[1]*t3 - R_b_c[4]*t5 + R_b_c[7]*t4);
+  A_zeta_vel[5] = rho*(R_b_c[2]*t3 - R_b_c[5]*t5 + R_b_c[8]*t4);
+  A_zeta_bg[0] = -Rt0*t10 - Rt3*t13 - Rt6*t16;
+  A_zeta_bg[1] = -Rt0*t19 - Rt3*t21 - Rt6*t23;
+  A_zeta_bg[2] = -Rt0*t24 - Rt3*t25 - Rt6*t26;
+  A_zeta_bg[3] = -Rt1*t10 - Rt4*t13 - Rt7*t16;
+  A_zeta_bg[4] = -Rt1*t19 - Rt4*t21 - Rt7*t23;
+  A_zeta_bg[5] = -Rt1*t24 - Rt4*t25 - Rt7*t26;
+  A_zeta_zeta[0] = -Rt0*t39 - Rt3*t47 - Rt6*t51;
+  A_zeta_zeta[1] = -Rt1*t39 - Rt4*t47 - Rt7*t51;
+  A_zeta_zeta[2] = -Rt0*t52 - Rt3*t53 - Rt6*t54;
+  A_zeta_zeta[3] = -Rt1*t52 - Rt4*t53 - Rt7*t54;
+  A_zeta_rho[0] = t55;
+  A_zeta_rho[1] = t56;
+  A_rho_vel[0] = t57*t58;
+  A_rho_vel[1] = t57*t59;
+  A_rho_vel[2] = t57*t60;
+  A_rho_bg[0] = t57*(-p_b_c[1]*t60 + p_b_c[2]*t59);
+  A_rho_bg[1] = t57*(p_b_c[0]*t60 - p_b_c[2]*t58);
+  A_rho_bg[2] = t57*(-p_b_c[0]*t59 + p_b_c[1]*t58);
+  A_rho_zeta[0] = -t55*t57;
+  A_rho_zeta[1] = -t56*t57;
+  A_rho_rho[0] = T(2)*rho*(t29 + t40);
+}
+
+// 81 operations
+// Pixel measurement of a feature h[2] and its Jacobian w.r.t. zeta H[4] (row-major),
+// given the focal length f[2] and image center c[2]
+template <typename T>
+inline void feat_measurement(const T* q, const T* f, const T* c, T* h, T* H)
+{
+  const T s0 = T(2)*(q[2]*q[2]);
+  const T s1 = T(2)*(q[3]*q[3]) + T(-1);
+  const T s2 = q[0]*q[3];
+  const T s3 = q[0]*q[2];
+  const T s4 = T(2)*(q[1]*q[1]);
+  const T s5 = q[0]*q[1];
+  const T Rt0 = -s0 - s1;
+  const T Rt1 = T(2)*q[1]*q[2] - T(2)*s2;
+  const T Rt2 = T(2)*q[1]*q[3] + T(2)*s3;
+  const T Rt3 = T(2)*q[1]*q[2] + T(2)*s2;
+  const T Rt4 = -s1 - s4;
+  const T Rt5 = T(2)*q[2]*q[3] - T(2)*s5;
+  const T Rt6 = T(2)*q[1]*q[3] - T(2)*s3;
+  const T Rt7 = T(2)*q[2]*q[3] + T(2)*s5;
+  const T Rt8 = -s0 - s4 + T(1);
+  const T t0 = (T(1)/(Rt8));
+  const T t1 = Rt2*t0;
+  const T t2 = Rt5*t0;
+  const T t3 = (T(1)/(Rt8*Rt8));
+  const T t4 = Rt2*Rt5*t3;
+  const T t5 = (Rt2*Rt2)*t3 + T(1);
+  const T t6 = (Rt5*Rt5)*t3 + T(1);
+  h[0] = c[0] + f[0]*t1;
+  h[1] = c[1] + f[1]*t2;
+  H[0] = f[0]*(Rt0*t4 - Rt3*t5 + Rt6*t2);
+  H[1] = f[0]*(Rt1*t4 - Rt4*t5 + Rt7*t2);
+  H[2] = f[1]*(Rt0*t6 - Rt3*t4 - Rt6*t1);
+  H[3] = f[1]*(Rt1*t6 - Rt4*t4 - Rt7*t1);
+}
+
+}
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include "Eigen/Core"
+
+// NUM_FEATURES is defined in vi_ekf.h, which includes this file
+
+namespace vi_ekf
+{
+
+// Minimal packed-double type so the feature kernel can be written once and compiled
+// for whatever vector width is available
+#ifdef __AVX__
+struct pd4
+{
+  enum { SIZE = 4 };
+  __m256d v;
+  pd4() {}
+  pd4(const __m256d _v) : v(_v) {}
+  pd4(const double s) : v(_mm256_set1_pd(s)) {}
+  static inline pd4 load(const double* p) { return _mm256_load_pd(p); }
+  inline void store(double* p) const { _mm256_store_pd(p, v); }
+};
+inline pd4 operator+(const pd4 a, const pd4 b) { return _mm256_add_pd(a.v, b.v); }
+inline pd4 operator-(const pd4 a, const pd4 b) { return _mm256_sub_pd(a.v, b.v); }
+inline pd4 operator*(const pd4 a, const pd4 b) { return _mm256_mul_pd(a.v, b.v); }
+inline pd4 operator-(const pd4 a) { return _mm256_xor_pd(a.v, _mm256_set1_pd(-0.0)); }
+typedef pd4 simd_t;
+#else
+struct pd1
+{
+  enum { SIZE = 1 };
+  double v;
+  pd1() {}
+  pd1(const double s) : v(s) {}
+  static inline pd1 load(const double* p) { return *p; }
+  inline void store(double* p) const { *p = v; }
+};
+inline pd1 operator+(const pd1 a, const pd1 b) { return a.v + b.v; }
+inline pd1 operator-(const pd1 a, const pd1 b) { return a.v - b.v; }
+inline pd1 operator*(const pd1 a, const pd1 b) { return a.v * b.v; }
+inline pd1 operator-(const pd1 a) { return -a.v; }
+typedef pd1 simd_t;
+#endif
+
+// Structure-of-arrays mirror of the feature states, and the per-feature blocks of the
+// state derivative and Jacobians.  Each array is padded to a whole number of simd lanes
+// so the kernel never needs a scalar tail.
+class FeatureSoA
+{
+public:
+  enum { CAPACITY = ((NUM_FEATURES + simd_t::SIZE - 1) / simd_t::SIZE) * simd_t::SIZE };
+
+  // Feature States
+  alignas(32) double qw[CAPACITY];
+  alignas(32) double qx[CAPACITY];
+  alignas(32) double qy[CAPACITY];
+  alignas(32) double qz[CAPACITY];
+  alignas(32) double rho[CAPACITY];
+
+  // State Derivative
+  alignas(32) double dzeta[2][CAPACITY];
+  alignas(32) double drho[CAPACITY];
+
+  // State Jacobian (row-major blocks), the input Jacobian blocks
+  // are the same as the gyro bias blocks
+  alignas(32) double A_zeta_vel[6][CAPACITY];
+  alignas(32) double A_zeta_bg[6][CAPACITY];
+  alignas(32) double A_zeta_zeta[4][CAPACITY];
+  alignas(32) double A_zeta_rho[2][CAPACITY];
+  alignas(32) double A_rho_vel[3][CAPACITY];
+  alignas(32) double A_rho_bg[3][CAPACITY];
+  alignas(32) double A_rho_zeta[2][CAPACITY];
+  alignas(32) double A_rho_rho[CAPACITY];
+
+  // Per-feature camera velocities and extrinsics, for when the features don't all belong
+  // to the same camera (filled by load_camera)
+  alignas(32) double cam_omega[3][CAPACITY];
+  alignas(32) double cam_vel[3][CAPACITY];
+  alignas(32) double cam_R[9][CAPACITY];
+  alignas(32) double cam_p[3][CAPACITY];
+
+  // Copy the features out of the state vector (starting at index x0, 5 states per feature)
+  template <typename Derived>
+  void load(const Eigen::MatrixBase<Derived>& x, const int x0, const int len)
+  {
+    len_ = len;
+    for (int i = 0; i < len; i++)
+    {
+      qw[i] = x(x0 + 5*i);
+      qx[i] = x(x0 + 5*i + 1);
+      qy[i] = x(x0 + 5*i + 2);
+      qz[i] = x(x0 + 5*i + 3);
+      rho[i] = x(x0 + 5*i + 4);
+    }
+    // Pad the unused lanes with a valid feature so they don't produce garbage
+    for (int i = len; i < padded_len(); i++)
+    {
+      qw[i] = 1.0;
+      qx[i] = qy[i] = qz[i] = rho[i] = 0.0;
+    }
+  }
+
+  // Set the camera of feature i (for the per-feature version of dynamics)
+  void load_camera(const int i, const Eigen::Vector3d& omega_c, const Eigen::Vector3d& vel_c,
+                   const Eigen::Matrix3d& R_b_c, const Eigen::Vector3d& p_b_c)
+  {
+    for (int k = 0; k < 3; k++)
+    {
+      cam_omega[k][i] = omega_c(k);
+      cam_vel[k][i] = vel_c(k);
+      cam_p[k][i] = p_b_c(k);
+      for (int c = 0; c < 3; c++)
+      {
+        cam_R[3*k+c][i] = R_b_c(k, c);
+      }
+    }
+  }
+
+  inline int len() const { return len_; }
+  inline int padded_len() const { return ((len_ + simd_t::SIZE - 1) / simd_t::SIZE) * simd_t::SIZE; }
+
+  // Compute the feature dynamics for the loaded features in [begin, end).  vel_c and omega_c are
+  // the camera velocities, R_b_c and p_b_c the camera extrinsics.  begin must be a multiple of
+  // simd_t::SIZE, end is clamped to the padded length
+  void dynamics(const Eigen::Vector3d& omega_c, const Eigen::Vector3d& vel_c, const Eigen::Matrix3d& R_b_c,
+                const Eigen::Vector3d& p_b_c, const bool state, const bool jac, const int begin, const int end);
+
+  // The same, but with each feature's own camera from load_camera (every lane up to the
+  // padded length must have been loaded)
+  void dynamics(const bool state, const bool jac, const int begin, const int end);
+
+private:
+  void dynamics_lanes(const int i, const simd_t* om, const simd_t* vc, const simd_t* R, const simd_t* p,
+                      const bool state, const bool jac);
+
+  int len_ = 0;
+};
+
+}
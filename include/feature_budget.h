@@ -0,0 +1,37 @@
+#pragma once
+
+namespace vi_ekf
+{
+
+// Picks how many features to track from the measured per-frame processing time.
+// The time is smoothed, and the feature count only moves when the smoothed time leaves a
+// band around the target, and then waits a few frames for the timing to settle before
+// moving again, so it doesn't oscillate.
+class FeatureBudget
+{
+public:
+  FeatureBudget();
+  FeatureBudget(const int min_features, const int max_features, const double target_ms,
+                const double hysteresis=0.2, const int step=2, const int settle_frames=10);
+
+  // Report how long the last frame took (tracker + filter), returns the feature count for the next frame
+  int update(const double frame_ms);
+
+  inline int num_features() const { return num_features_; }
+  inline double smoothed_ms() const { return smoothed_ms_; }
+  inline bool enabled() const { return target_ms_ > 0.0; }
+
+private:
+  int min_features_;
+  int max_features_;
+  double target_ms_;
+  double hysteresis_;
+  int step_;
+  int settle_frames_;
+
+  int num_features_;
+  double smoothed_ms_;
+  int frames_since_change_;
+};
+
+}
@@ -2,8 +2,13 @@
 #include <opencv2/highgui.hpp>
 
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
-#include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/Dense>
+
+#include "feature_budget.h"
 
 using namespace cv;
 using namespace std;
@@ -11,19 +16,61 @@ using namespace std;
 class KLT_Tracker
 {
 public:
+  typedef enum
+  {
+    GFTT, // goodFeaturesToTrack over the whole image
+    GRID_FAST // FAST in the grid cells that have no track, a few corners per cell
+  } detector_t;
+
   KLT_Tracker();
+  ~KLT_Tracker();
   void init(int _num_features, bool _show_image, int _radius, Size _size);
 
   void set_num_features(int _num_features) {num_features_ = _num_features;}
   void set_radius(int _radius) {feature_nearby_radius_ = _radius;}
   void set_feature_mask(std::string filename);
   void set_show_image(bool _show_image) {plot_matches_= _show_image;}
+  // Pyramid levels above the full image, and the LK search window (in pixels, square)
+  void set_pyramid(int _levels, int _window_size);
+  // How new features are found (cell size in pixels, FAST threshold in intensity levels)
+  void set_detector(detector_t _detector, int _cell_size, int _corners_per_cell, int _fast_threshold);
+  // Pinhole intrinsics, only needed to predict the flow from a rotation
+  void set_camera(const Eigen::Vector2d& _focal_len, const Eigen::Vector2d& _cam_center);
+  // Track on the image downscaled by up to 2^_max_scale_level, then refine each point at full
+  // resolution in a small tile around it.  With a time budget (ms per frame) the scale follows
+  // the tracker's own run time, otherwise it stays at _max_scale_level (0 turns this off).
+  // Features are always reported in full resolution pixels.
+  void set_resolution(int _max_scale_level, double _time_budget_ms=0.0);
+  int get_scale_level() const { return scale_level_; }
+  // Drop the tracks that LK can't follow back to where they started (to within _fb_threshold
+  // pixels), and on frames given a rotation, the tracks more than _ransac_threshold pixels off
+  // the epipolar lines of the translation most of them agree on (a 2-point RANSAC, since the
+  // rotation is known).  A threshold of 0 turns that check off.
+  void set_outlier_rejection(double _fb_threshold, double _ransac_threshold, int _ransac_iterations=100);
+  // Whether the rotation given with a frame also seeds the LK search, or only goes to the RANSAC
+  void set_gyro_prediction(bool _gyro_prediction) {gyro_prediction_ = _gyro_prediction;}
+  // When tracks are missing, look for new corners only every _interval frames (0 never), or
+  // sooner if fewer than _fill_threshold of num_features are left.  With _async the search
+  // runs on a worker thread between frames, and its corners join the next frame's tracking.
+  void set_detection_policy(int _interval, double _fill_threshold, bool _async);
   bool drop_feature(int feature_id);
 
   void load_image(const Mat &img, double t, std::vector<Point2f>& features, std::vector<int>& ids, OutputArray &output = noArray());
+  // R_c2_c1 rotates vectors in the previous frame's camera frame into this frame's, e.g. from
+  // the gyros.  Each feature's search starts where that rotation alone would put it.
+  void load_image(const Mat &img, double t, const Eigen::Matrix3d& R_c2_c1, std::vector<Point2f>& features,
+                  std::vector<int>& ids, OutputArray &output = noArray());
 
 private:
-  Mat prev_image_;
+  void track(const Mat &img, const Eigen::Matrix3d* R_c2_c1, std::vector<Point2f>& features, std::vector<int>& ids, OutputArray &output);
+  
+  Eigen::Matrix3d K_;
+  
+  // Each frame's pyramid (with derivatives) is built once, and kept to track the next frame from
+  vector<Mat> pyramid_;
+  vector<Mat> prev_pyramid_;
+  int pyramid_levels_;
+  Size window_size_;
   bool initialized_;
   bool plot_matches_;
   int num_features_;
@@ -33,11 +80,118 @@ private:
   
   vector<uchar> status_;
   vector<float> err_;
-  deque<int> good_ids_;
+  bool gyro_prediction_;
+  
+  // Outlier rejection, clears status_ for the tracks that fail
+  void check_forward_backward(const vector<Point2f>& prev, const vector<Point2f>& next, int levels, float threshold);
+  void reject_outliers(const Eigen::Matrix3d& R_c2_c1);
+  double fb_threshold_;
+  double ransac_threshold_;
+  int ransac_iterations_;
+  RNG ransac_rng_;
+  vector<Point2f> back_features_;
+  vector<uchar> back_status_;
+  vector<float> back_err_;
+  vector<int> ransac_index_;
+  vector<Eigen::Vector3d> ransac_prev_; // old bearings, rotated into the new frame
+  vector<Eigen::Vector3d> ransac_new_;
+  vector<Eigen::Vector3d> ransac_normals_; // normals of each track's epipolar plane
+  vector<uchar> inliers_;
+  vector<uchar> best_inliers_;
   
+  // Reduced resolution tracking.  Coordinates at scale level s are (p + 0.5) / 2^s - 0.5.
+  static inline Point2f to_full(const Point2f& pt, int level) { float s = 1 << level; return Point2f((pt.x + 0.5f) * s - 0.5f, (pt.y + 0.5f) * s - 0.5f); }
+  static inline Point2f to_scaled(const Point2f& pt, int level) { float s = 1 << level; return Point2f((pt.x + 0.5f) / s - 0.5f, (pt.y + 0.5f) / s - 0.5f); }
+  inline Point2f to_full(const Point2f& pt) const { return to_full(pt, scale_level_); }
+  inline Point2f to_scaled(const Point2f& pt) const { return to_scaled(pt, scale_level_); }
+  int scale_level_;
+  int max_scale_level_;
+  vi_ekf::FeatureBudget resolution_budget_; // its count is max_scale_level_ - scale_level_
+  Mat small_img_;
+  Mat scaled_mask_;
+  vector<Point2f> scaled_prev_features_;
+  vector<Point2f> scaled_features_;
+  
+  // Full resolution tiles around each point, laid out in a grid (a mosaic), for the refinement.
+  // The previous frame's tiles are cut around the points it reported, this frame's around the
+  // coarse estimates, with every point keeping its place in the grid.
+  bool cut_tile(const Mat& img, const Point2f& pt, Mat& tiles, int index, Point2f& origin);
+  inline Point2f tile_offset(int index) const { return Point2f((index % TILE_COLS) * tile_size_, (index / TILE_COLS) * tile_size_); }
+  void refine_features(const Mat& img);
+  void cut_prev_tiles(const Mat& img);
+  enum { TILE_COLS = 8 };
+  int tile_size_;
+  Mat tiles_;
+  Mat prev_tiles_;
+  vector<Point2f> tile_origins_;
+  vector<Point2f> prev_tile_origins_;
+  vector<int> prev_tile_index_;
+  vector<Point2f> tile_prev_pts_;
+  vector<Point2f> tile_pts_;
+  vector<uchar> refine_status_;
+  vector<float> refine_err_;
+  
+  // Spatial hash of the points kept so far this frame, for the proximity checks
+  void grid_clear();
+  void grid_insert(const Point2f& pt);
+  bool grid_near(const Point2f& pt) const;
+  int grid_cell(int col, int row) const;
+  int grid_cell_size_;
+  int grid_cols_;
+  int grid_rows_;
+  vector<int> grid_head_; // first point in each cell, -1 if empty
+  vector<int> grid_next_; // next point in the same cell
+  vector<Point2f> grid_pts_;
+  
+  // Detection, fills up to num_features_ with corners that are far enough from the other points
+  void detect_features(const Mat& grey_img);
+  // Corners, best first and in the pixels of grey_img (scaled down by 2^level), away from the
+  // given points (full resolution).  Uses point_mask_ for GFTT, so update it first.
+  void find_corners(const Mat& grey_img, const vector<Point2f>& points, int level, int radius, int max_corners,
+                    vector<Point2f>& corners);
+  void detect_grid_fast(const Mat& grey_img, const vector<Point2f>& points, int level, vector<Point2f>& new_corners);
+  // Adds the corners that are far enough from the points in the grid to features (and ids_)
+  void add_corners(const vector<Point2f>& corners, int level, vector<Point2f>& features);
+  detector_t detector_;
+  int detect_cell_size_;
+  int corners_per_cell_;
+  int fast_threshold_;
+  vector<uchar> cell_has_track_;
+  vector<int> empty_cells_;
+  vector<vector<KeyPoint>> cell_corners_;
+  vector<KeyPoint> candidates_;
+  
+  // Detection mask: mask_ with the cells holding a point blanked out, kept up to date cell by cell
+  void update_point_mask();
+  vector<uchar> cell_occupied_;
   Mat mask_;
   Mat point_mask_;
   vector<Point2f> new_corners_;
+  
+  // Detection policy, and the worker thread for asynchronous detection.  The worker searches
+  // the frame that was just tracked while the caller goes on with it, and the corners are
+  // added to that frame's points at the start of the next track().  Whatever the worker reads
+  // is either copied into its job or only changed after waiting for it.
+  void start_detection();
+  void wait_for_detection();
+  void finish_detection();
+  void detection_thread();
+  int detect_interval_;
+  double detect_fill_;
+  bool detect_async_;
+  int frames_since_detect_;
+  bool detect_pending_; // corners from the worker that haven't been added yet
+  std::thread detect_thread_;
+  std::mutex detect_mtx_;
+  std::condition_variable detect_cv_;
+  bool detect_busy_; // guarded by detect_mtx_
+  bool detect_stop_; // guarded by detect_mtx_
+  Mat detect_img_;
+  vector<Point2f> detect_points_;
+  int detect_level_;
+  int detect_radius_;
+  int detect_max_corners_;
+  vector<Point2f> detect_corners_;
 
   vector<int> ids_;
   vector<Point2f> prev_features_;
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace vi_ekf
+{
+
+// Lossless compression for a series of fixed-length rows of doubles that change a little
+// between rows (e.g. covariance snapshots).  Each value is XORed with its value in the
+// previous row, so unchanged values become zero and small changes leave the high
+// (sign/exponent) bytes zero.  Each XOR is then stored as a control byte and only its
+// significant bytes, and runs of zeros as a single control byte:
+//
+//   1rrrrrrr             r+1 unchanged values
+//   0lllnnnn <n bytes>   l leading zero bytes, then the n (1-8) significant bytes
+//
+// Every keyframe_interval rows (and whenever the length changes) a keyframe is coded
+// against zero instead, so decoding can pick up again after a lost row.
+class DeltaCodec
+{
+public:
+  DeltaCodec(const int keyframe_interval=20);
+
+  // Append the coded row to out
+  void encode(const double* row, const int n, std::vector<char>& out);
+
+  // Decode one coded row, returns false if it is corrupt or its reference row was lost
+  // (rows are expected in the order they were encoded, gaps are detected by sequence number)
+  bool decode(const char* data, const size_t bytes, std::vector<double>& row);
+
+  void reset();
+
+private:
+  int keyframe_interval_;
+  uint32_t seq_; // sequence number of the next row to encode, or of the last decoded row
+  bool have_ref_;
+  std::vector<uint64_t> prev_;
+};
+
+// Expand the row-major upper triangle of a symmetric n x n matrix into all n*n values
+void unpack_upper_triangle(const double* tri, const int n, double* dense);
+
+}
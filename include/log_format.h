@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace vi_ekf
+{
+
+// Log container layout:
+//
+//   "VIEKFLOG" | uint32 version | uint32 schema length | schema text
+//   block | block | ...
+//
+// The schema text lists the channels, their columns and units, the build capacity
+// (NUM_FEATURES) and free-form notes.  Every block holds a run of rows of one channel,
+// stored column by column, so a reader can pull out one channel (or one column) and seek
+// past everything else.  Column 0 of every channel is the time.
+//
+// Rows of an upper-triangle channel are the time followed by the row-major upper triangle
+// of a symmetric matrix over the channel's other columns (e.g. a covariance over the error
+// state).  They are delta-coded against the channel's previous row (see log_codec.h) and
+// every row is its own packed block, whose `cols` is the size of the coded row in bytes.
+
+static const char LOG_MAGIC[8] = {'V', 'I', 'E', 'K', 'F', 'L', 'O', 'G'};
+static const uint32_t LOG_VERSION = 2;
+static const uint32_t LOG_BLOCK_MAGIC = 0x4b4c4256; // "VBLK"
+static const uint32_t LOG_PACKED_BLOCK_MAGIC = 0x424b5056; // "VPKB"
+
+struct LogColumn
+{
+  std::string name;
+  std::string unit;
+};
+
+struct LogChannel
+{
+  int id;
+  std::string name;
+  std::vector<LogColumn> columns;
+  bool upper_triangle = false;
+
+  // Number of values in a row (columns.size() unless this is an upper-triangle channel)
+  int row_width() const;
+  void add_column(const std::string& name, const std::string& unit="");
+  int find_column(const std::string& name) const;
+};
+
+struct LogSchema
+{
+  int capacity = 0; // number of feature slots in the build that wrote the log
+  std::vector<LogChannel> channels;
+  std::vector<std::string> notes;
+
+  LogChannel& add_channel(const int id, const std::string& name, const bool upper_triangle=false);
+  const LogChannel* find_channel(const int id) const;
+  const LogChannel* find_channel(const std::string& name) const;
+
+  std::string serialize() const;
+  bool parse(const std::string& text);
+};
+
+#pragma pack(push, 1)
+struct LogBlockHeader
+{
+  uint32_t magic;
+  uint32_t channel;
+  uint32_t rows;
+  uint32_t cols;
+  double t_begin;
+  double t_end;
+};
+#pragma pack(pop)
+
+}
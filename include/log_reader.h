@@ -0,0 +1,74 @@
+#pragma once
+
+#include <fstream>
+#include <map>
+
+#include "log_codec.h"
+#include "log_format.h"
+
+namespace vi_ekf
+{
+
+// One block of rows of a single channel, stored column by column.  A packed block of an
+// upper-triangle channel comes out decoded, as a single row of row_width() values.
+struct LogBlock
+{
+  int channel = -1;
+  int rows = 0;
+  int cols = 0;
+  double t_begin = 0;
+  double t_end = 0;
+  std::vector<double> data;
+
+  inline const double* column(const int c) const { return data.data() + c * rows; }
+  inline double at(const int row, const int col) const { return data[col * rows + row]; }
+};
+
+// Streams through a log written by ColumnarLogWriter.  Blocks of other channels are
+// skipped with a seek, so pulling one channel out of a long log only reads that channel.
+// Rows of upper-triangle channels can only be decoded from the last keyframe on, so rows
+// after a skipped or damaged one (or at the start of a segment read on its own) are
+// skipped until the next keyframe, and counted in undecodable_rows().
+class LogReader
+{
+public:
+  // Read a single segment file, or all of the segments <base>_0000.vlog, <base>_0001.vlog, ...
+  bool open(const std::string& filename);
+  bool open_segments(const std::string& base);
+  inline int num_files() const { return files_.size(); }
+
+  inline const LogSchema& schema() const { return schema_; }
+
+  // Read the next block of `channel` (or of any channel when -1), false at the end of the log
+  bool next_block(LogBlock& block, const int channel=-1);
+
+  // Like next_block, but only fills in the header fields and skips the data (cols is 0 for
+  // packed blocks)
+  bool next_block_header(LogBlock& block, const int channel=-1);
+
+  // Read every row of the chosen columns of a channel (all row_width() of them if `which` is
+  // empty), from the start of the log.  Only the chosen columns are read from each block.
+  // Returns false if a chosen column is outside the channel's row.
+  bool read_channel(const std::string& name, std::vector<std::vector<double>>& columns,
+                    const std::vector<int>& which=std::vector<int>());
+
+  // Go back to the first block
+  void rewind();
+
+  inline uint64_t undecodable_rows() const { return undecodable_rows_; }
+
+private:
+  bool open_file(const int index);
+  bool read_header(LogBlockHeader& header);
+  bool next(LogBlock& block, const int channel, const bool read_data);
+
+  std::vector<std::string> files_;
+  int file_index_ = 0;
+  std::ifstream file_;
+  LogSchema schema_;
+  std::map<int, DeltaCodec> codecs_; // per upper-triangle channel
+  std::vector<char> packed_;
+  uint64_t undecodable_rows_ = 0;
+};
+
+}
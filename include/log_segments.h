@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+namespace vi_ekf
+{
+
+// Output for the log writer: a numbered series of preallocated, memory-mapped segment files
+// (<base>_0000.vlog, <base>_0001.vlog, ...).  Every segment starts with the same header, so
+// each one can be read on its own.  Writing is a memcpy into the mapping; opening and
+// preallocating the next segment, and syncing, truncating and closing full ones, are done
+// by a background thread.  Only the segment being written can be incomplete after a crash,
+// and the reader stops at its first unwritten block.
+class LogSegmentWriter
+{
+public:
+  LogSegmentWriter(const std::string& base, const size_t segment_bytes, const std::string& header);
+  ~LogSegmentWriter();
+
+  // Contiguous room for `bytes` bytes in the current segment (starting a new segment if it
+  // doesn't fit), or nullptr if it is more than capacity() or a segment couldn't be created
+  char* reserve(const size_t bytes);
+
+  // Start writing the current segment back to disk without waiting for it
+  void flush();
+
+  inline int num_segments() const { return active_index_ + 1; }
+  inline size_t capacity() const { return segment_bytes_ - header_.size(); }
+  inline bool failed() const { return failed_; }
+  static std::string segment_name(const std::string& base, const int index);
+
+private:
+  struct segment_t
+  {
+    int fd = -1;
+    char* data = nullptr;
+    size_t size = 0; // mapped size
+    size_t used = 0;
+  };
+
+  bool create(const int index, const size_t size, segment_t& seg);
+  void seal(segment_t& seg);
+  void run();
+
+  std::string base_;
+  size_t segment_bytes_;
+  std::string header_;
+  bool failed_;
+  int active_index_;
+  segment_t active_;
+
+  // Shared with the background thread (guarded by mtx_)
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  bool want_spare_;
+  bool have_spare_;
+  int spare_index_;
+  segment_t spare_; // preallocated next segment
+  std::deque<segment_t> full_; // waiting to be synced and closed
+  bool stop_;
+  std::thread thread_;
+};
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <memory>
+
+#include "async_logger.h"
+#include "log_codec.h"
+#include "log_format.h"
+#include "log_segments.h"
+
+namespace vi_ekf
+{
+
+// Writes the container described in log_format.h into segment files (see LogSegmentWriter).
+// Rows are collected per channel and written out column by column once rows_per_block of
+// them have arrived (or on flush).  Rows of upper-triangle channels are delta-coded here, on
+// the writer thread, with a keyframe every keyframe_interval rows, and written out right
+// away.  Records whose size doesn't match their channel's width are discarded.
+class ColumnarLogWriter : public LogSink
+{
+public:
+  ColumnarLogWriter(const std::string& base, const LogSchema& schema, const size_t segment_bytes=(64 << 20),
+                    const int rows_per_block=256, const int keyframe_interval=20);
+  ~ColumnarLogWriter();
+
+  void write(const int stream, const char* data, const size_t bytes) override;
+  void flush() override;
+
+  inline bool is_open() const { return !out_->failed(); }
+  inline int num_segments() const { return out_->num_segments(); }
+  inline uint64_t rejected_records() const { return rejected_records_; }
+
+private:
+  struct chunk_t
+  {
+    int cols = 0;
+    int rows = 0;
+    std::vector<double> data; // column-major, rows_per_block_ x cols
+    bool upper_triangle = false;
+    DeltaCodec codec;
+  };
+
+  void write_block(const int channel, chunk_t& chunk);
+  void write_packed(const int channel, chunk_t& chunk, const char* data, const size_t bytes);
+
+  std::unique_ptr<LogSegmentWriter> out_;
+  int rows_per_block_;
+  std::vector<chunk_t> chunks_; // indexed by channel id, cols == 0 if not in the schema
+  std::vector<double> row_;
+  std::vector<char> packed_;
+  uint64_t rejected_records_;
+};
+
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "vi_ekf.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace vi_ekf
+{
+
+typedef Matrix<double, VIEKF::xZ, 1> xCoreVector;
+typedef Matrix<double, VIEKF::dxZ, 1> dxCoreVector;
+typedef Matrix<double, VIEKF::dxZ, VIEKF::dxZ> dxCoreMatrix;
+
+// Rauch-Tung-Striebel fixed-lag smoother over the vehicle (non-feature) states.
+// The vehicle dynamics do not depend on the feature states, so the smoother only keeps the
+// vehicle block of the filter history, and features being added to or dropped from the
+// filter don't change its records.  This is an approximation: later feature measurements
+// also inform past vehicle states through the vehicle-feature cross-covariance, which is
+// discarded here, so the smoothed estimates are those of the vehicle marginal and are
+// somewhat more conservative than a full-state RTS pass.  The filter thread only pushes one
+// fixed-size record per propagation step, all of the smoothing happens on a background thread.
+class RTSSmoother
+{
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  static constexpr double MIN_PERIOD = 1e-3;
+
+  // The background thread smooths every (period) seconds.  Periods shorter than MIN_PERIOD
+  // (including zero and negative ones) are clamped to it, so the thread never spins.
+  RTSSmoother(const double lag, const double period);
+  // A copy has the same history and latest result, and its own background thread
+  RTSSmoother(const RTSSmoother& other);
+  RTSSmoother& operator=(const RTSSmoother&) = delete;
+  ~RTSSmoother();
+
+  // Called by the filter thread each time it propagates from (t_prev) to (t)
+  // x_prev and P_prev are the final (post-update) estimates at t_prev,
+  // A is the discrete state transition, x_prior and P_prior the predicted estimate at t
+  void push_step(const double t_prev, const xVector& x_prev, const dxMatrix& P_prev,
+                 const double t, const dxMatrix& A, const xVector& x_prior, const dxMatrix& P_prior);
+
+  // Query the most recent smoothing pass for the smoothed estimate closest to t
+  bool get_state(const double t, xCoreVector& x, dxCoreMatrix& P) const;
+  bool get_pose(const double t, Xformd& pose, Matrix6d& cov) const;
+  double get_lag() const { return lag_; }
+
+  // Forget the history (the filter state jumped, e.g. after a keyframe reset)
+  void clear();
+
+  // Run one smoothing pass immediately (normally this is done by the background thread)
+  void smooth();
+
+  static void boxplus(const xCoreVector& x, const dxCoreVector& dx, xCoreVector& out);
+  static void boxminus(const xCoreVector& x1, const xCoreVector& x2, dxCoreVector& out);
+
+private:
+  typedef struct
+  {
+    double t;
+    bool has_post; // the filter has moved past this step, so x and P are final
+    bool has_prior; // F, xp and Pp describe the transition from the previous record
+    xCoreVector x;
+    dxCoreMatrix P;
+    dxCoreMatrix F;
+    xCoreVector xp;
+    dxCoreMatrix Pp;
+  } record_t;
+  typedef std::deque<record_t, aligned_allocator<record_t>> recordBuf;
+
+  typedef struct
+  {
+    double t;
+    xCoreVector x;
+    dxCoreMatrix P;
+  } smoothed_t;
+  typedef std::vector<smoothed_t, aligned_allocator<smoothed_t>> smoothedBuf;
+
+  void run();
+
+  double lag_;
+  double period_;
+
+  // Records pushed by the filter thread (guarded by hist_mtx_)
+  mutable std::mutex hist_mtx_;
+  recordBuf hist_;
+
+  // Smoother workspace (guarded by work_mtx_)
+  std::mutex work_mtx_;
+  recordBuf window_;
+  smoothedBuf work_;
+
+  // Result of the latest smoothing pass (guarded by result_mtx_)
+  mutable std::mutex result_mtx_;
+  smoothedBuf result_;
+
+  std::mutex run_mtx_;
+  std::condition_variable run_cv_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+};
+
+}
@@ -5,10 +5,13 @@
 #include "Eigen/StdVector"
 #include "unsupported/Eigen/MatrixFunctions"
 
+#include <algorithm>
 #include <deque>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <functional>
+#include <memory>
 #include <fstream>
 #include <chrono>
 #include <iostream>
@@ -44,6 +47,12 @@ using namespace Eigen;
 #endif
 #endif
 
+#include "feat_soa.h"
+#include "worker_pool.h"
+#include "clone_ptr.h"
+#include "async_logger.h"
+#include "log_writer.h"
+
 #define MAX_X 17+NUM_FEATURES*5
 #define MAX_DX 16+NUM_FEATURES*3
 
@@ -64,6 +73,7 @@ namespace vi_ekf
 {
 
 class VIEKF;
+class RTSSmoother;
 
 typedef void (VIEKF::*measurement_function_ptr)(const xVector& x, zVector& h, hMatrix& H, const int id) const;
 
@@ -145,6 +155,7 @@ private:
     LOG_INPUT,
     LOG_XDOT,
     LOG_GLOBAL,
+    LOG_COV,
     LOG_CONF,
     LOG_KF,
     LOG_DEBUG,
@@ -195,12 +206,31 @@ private:
   int len_features_;
   int next_feature_id_;
   std::vector<int> current_feature_ids_;
+
+  // Each feature lives in a fixed slot of the state and covariance until it is cleared
+  int feature_slot_end_; // one past the highest occupied slot
+  std::vector<int> slot_feature_ids_; // global id of the feature in each slot (-1 if free)
+  std::set<int> free_slots_;
+  std::unordered_map<int, int> feature_slots_; // global id -> slot
+
+  // Schmidt "consider" features are carried in the state and contribute to the gain, but are
+  // never corrected.  Their covariance is kept cheap: only their own block and their
+  // cross-covariance with the core states (the cross-covariance with every other feature is
+  // dropped), and no gain is computed for them, so they don't add to the cost of the dense
+  // propagation and update of the estimated states.
+  std::vector<int> slot_consider_; // 1 if the feature in the slot is a consider state
+  std::vector<int> slot_updates_; // number of accepted updates of the feature in each slot
+  int max_estimated_features_;
+  int num_consider_features_;
+  int max_features_; // new features are refused past this many
+  dxVector gain_mask_; // zero on the consider states
   std::vector<int> keyframe_features_;
   double keyframe_overlap_threshold_;
 
   std::deque<edge_t> edges_;
 
   // Matrix Workspace
+  FeatureSoA feat_soa_;
   dxMatrix A_;
   dxuMatrix G_;
   dxVector dx_;
@@ -209,8 +239,13 @@ private:
   const dxVector dx_ones_ = dxVector::Constant(1.0);
   xVector xp_;
   Matrix<double, MAX_DX, 3>  K_;
+  Matrix<double, MAX_DX, 3>  PHt_;
   zVector zhat_;
   hMatrix H_;
+  Matrix<double, Dynamic, Dynamic, 0, MAX_DX, MAX_DX> D_;
+  Matrix<double, Dynamic, Dynamic, 0, MAX_DX, MAX_DX> Pidx_;
+  Matrix<double, Dynamic, Dynamic, 0, MAX_DX, MAX_DX> DP_;
+  Matrix<double, Dynamic, Dynamic, 0, MAX_DX, MAX_DX> DPD_;
 
   // EKF Configuration Parameters
   bool use_drag_term_;
@@ -218,14 +253,32 @@ private:
   bool partial_update_;
   double min_depth_;
   int cov_prop_skips_;
+  bool use_simd_dynamics_ = true;
 
-  // Camera Intrinsics and Extrinsics
-  Vector2d cam_center_;
-  Matrix<double, 2, 3> cam_F_;
-  Quatd q_b_c_;
-  Vector3d p_b_c_;
+  // Camera Intrinsics and Extrinsics (camera 0 is the one given to init, the rest come
+  // from add_camera), every feature belongs to the camera that first saw it
+  typedef struct
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Vector2d center;
+    Matrix<double, 2, 3> F;
+    Quatd q_b_c;
+    Vector3d p_b_c;
+
+    // Constants derived from the calibration (rebuilt by update_calibration_cache)
+    Matrix3d R_b_c;
+    Matrix3d skew_p_b_c;
+    double aspect; // focal_len(1) / focal_len(0)
+
+    // Camera velocities, filled in by dynamics
+    Vector3d omega_c;
+    Vector3d vel_c;
+  } camera_t;
+  std::vector<camera_t, aligned_allocator<camera_t>> cameras_;
+  std::vector<int> slot_camera_; // camera of the feature in each slot
 
   Xformd T_e_I_; // The transform from ECEF to the local NED frame
+  Matrix3d R_e_I_; // rotation between ECEF and the local NED frame used by h_gps (rebuilt by update_calibration_cache)
 
   Matrix6d global_pose_cov_;
   Xformd current_node_global_pose_;
@@ -234,8 +287,27 @@ private:
 
   std::function<void(void)> keyframe_reset_callback_;
 
-  // Log Stuff
-  std::vector<std::ofstream>* log_ = nullptr;
+  // Worker threads for the per-feature loops (nullptr when single-threaded), a copy of the
+  // filter gets its own pool
+  clone_ptr<WorkerPool> pool_;
+  int parallel_feature_threshold_ = 30;
+
+  // Fixed-Lag Smoother (runs on its own thread, nullptr when disabled), a copy of the filter
+  // gets its own copy of the smoother
+  clone_ptr<RTSSmoother> smoother_;
+
+  // Log Stuff (records are written out by the logger's own thread)
+  std::shared_ptr<AsyncLogger> log_;
+  size_t log_buffer_bytes_ = (1 << 23);
+  AsyncLogger::overflow_policy_t log_overflow_policy_ = AsyncLogger::DROP;
+  size_t log_segment_bytes_ = (64 << 20);
+  int log_keyframe_interval_ = 20;
+
+  // Runtime logging policy, indexed by channel (measurement types, then log_type_t)
+  bool log_enabled_[TOTAL_LOGS];
+  double log_period_[TOTAL_LOGS]; // minimum time between records, 0 logs every one
+  double log_last_t_[TOTAL_LOGS];
+  bool log_due(const int channel, const double t);
 
 public:
 
@@ -263,6 +335,28 @@ public:
 
   // Helpers
   int global_to_local_feature_id(const int global_id) const;
+  bool bracket_history(const double t, int& ia, int& ib, double& alpha) const;
+  void update_calibration_cache();
+  void propagate_covariance(const dxMatrix& P, const double dt, const int* idx, const int n, dxMatrix& P_out);
+  // One propagation step over the estimated rows idx, logging the result if log is set
+  void propagate_step(const uVector& u, const double t, const int* idx, const int n, const bool log);
+  void set_slot_consider(const int slot, const bool consider);
+  void balance_consider_features();
+  // Rows of the core states and the estimated features, in order (returns how many)
+  int estimated_index(int* idx) const;
+  // Drop a consider feature's cross-covariance with everything but the core states
+  void decouple_consider_feature(dxMatrix& P, const int slot) const;
+
+  // Call fn(begin, end) over the feature slots (including any free slots in between), split across the worker pool when there are enough of them
+  template <typename Fn>
+  void for_each_feature_range(Fn&& fn) const
+  {
+    if (pool_ && feature_slot_end_ >= parallel_feature_threshold_)
+      pool_->parallel_for(0, feature_slot_end_, simd_t::SIZE, std::ref(fn));
+    else
+      fn(0, feature_slot_end_);
+  }
+  inline bool slot_active(const int slot) const { return slot_feature_ids_[slot] >= 0; }
   const std::vector<int>& tracked_features() const;
 
 
@@ -279,28 +373,55 @@ public:
   double get_depth(const int id) const;
   inline int get_len_features() const { return len_features_; }
 
+  // Query the state history at an arbitrary time (interpolated between stored states).  The
+  // result is a copy, but the history is read in place, so like every other call on the filter
+  // these must hold whatever lock serializes it against propagate_state and handle_measurements.
+  bool state_at(const double t, xVector& x) const;
+  bool pose_at(const double t, Xformd& pose) const;
+  bool pose_at(const double t, Xformd& pose, Matrix6d& cov) const;
+  bool covariance_at(const double t, dxMatrix& P) const;
+
   void set_x0(const Matrix<double, xZ, 1>& _x0);
   void set_imu_bias(const Vector3d& b_g, const Vector3d& b_a);
   void set_drag_term(const bool use_drag_term) {use_drag_term_ = use_drag_term;}
-  void set_ecef_to_NED_transform(const Xformd& T_e_I) { T_e_I_ = T_e_I; }
+  void set_ecef_to_NED_transform(const Xformd& T_e_I) { T_e_I_ = T_e_I; update_calibration_cache(); }
+  void set_camera_extrinsics(const Vector4d& q_b_c, const Vector3d& p_b_c, const int cam=0);
+  int add_camera(const Vector2d& cam_center, const Vector2d& focal_len, const Vector4d& q_b_c, const Vector3d& p_b_c);
+  inline int get_num_cameras() const { return cameras_.size(); }
   bool get_drag_term() const {return use_drag_term_;}
+  void set_simd_dynamics(const bool use_simd) {use_simd_dynamics_ = use_simd;}
+  void set_num_threads(const int num_threads, const int feature_threshold=30);
   bool get_keyframe_reset() const {return keyframe_reset_;}
 
-  bool init_feature(const Vector2d &l, const int id, const double depth=-1.0);
+  bool init_feature(const Vector2d &l, const int id, const double depth=-1.0, const int cam=0);
   void clear_feature(const int id);
-  void keep_only_features(const std::vector<int> features);
+  // Drop every feature not in the list (when cam is given, only that camera's features are candidates)
+  void keep_only_features(const std::vector<int> features, const int cam=-1);
+  int get_feature_camera(const int id) const;
+
+  // Limit how many features are fully estimated, the rest are carried as consider states
+  // and swapped in and out based on how many updates they have received
+  void set_max_estimated_features(const int max_estimated);
+  bool promote_feature(const int id);
+  bool demote_feature(const int id);
+  bool is_consider_feature(const int id) const;
+
+  // Stop admitting new features past this many (existing features are kept until dropped)
+  void set_max_features(const int max_features) {max_features_ = std::min(max_features, (int)NUM_FEATURES);}
 
   // State Propagation
   void boxplus(const xVector &x, const dxVector &dx, xVector &out) const;
   void boxminus(const xVector& x1, const xVector &x2, dxVector& out) const;
   void step(const uVector& u, const double t);
   void propagate_state(const uVector& u, const double t, bool save_input=true);
+  // Same as propagate_state on each of the n (time, input) samples in order
+  void propagate_states(const std::pair<double, uVector>* samples, const int n);
   void dynamics(const xVector &x, const uVector& u, dxVector& xdot, dxMatrix& dfdx, dxuMatrix& dfdu);
   void dynamics(const xVector &x, const uVector& u, bool state = true, bool jac = true);
 
   // Measurement Updates
   void handle_measurements(std::vector<int> *gated_feature_ids=nullptr);
-  meas_result_t add_measurement(const double t, const VectorXd& z, const measurement_type_t& meas_type, const MatrixXd& R, bool active=false, const int id=-1, const double depth=NAN);
+  meas_result_t add_measurement(const double t, const VectorXd& z, const measurement_type_t& meas_type, const MatrixXd& R, bool active=false, const int id=-1, const double depth=NAN, const int cam=0);
   meas_result_t update(measurement_t &meas);
   void h_acc(const xVector& x, zVector& h, hMatrix& H, const int id) const;
   void h_alt(const xVector& x, zVector& h, hMatrix& H, const int id) const;
@@ -322,11 +443,33 @@ public:
   Xformd get_global_pose() const;
   Matrix6d get_global_cov() const;
 
+  // Fixed-Lag Smoother
+  void enable_smoother(const double lag, const double period);
+  void disable_smoother();
+  // Only the vehicle states are smoothed, without their cross-covariance with the features,
+  // so the smoothed state and covariance approximate the full-state RTS result (see RTSSmoother)
+  bool get_smoothed_state(const double t, Matrix<double, xZ, 1>& x, Matrix<double, dxZ, dxZ>& P) const;
+  bool get_smoothed_pose(const double t, Xformd& pose, Matrix6d& cov) const;
+
   // Logger
-  void log_state(const double t, const xVector& x, const dxVector& P, const uVector& u, const dxVector& dx);
-  void log_measurement(const measurement_type_t type, const double t, const int dim, const MatrixXd& z, const MatrixXd& zhat, const bool active, const int id);
+  void log_state(const double t, const xVector& x, const dxMatrix& P, const uVector& u, const dxVector& dx);
+  void log_measurement(const measurement_type_t type, const double t, const int dim, const zVector& z, const zVector& zhat, const bool active, const int id);
   void init_logger(std::string root_filename, string prefix="");
+  LogSchema log_schema() const;
   void disable_logger();
+  // Takes effect the next time the logger is initialized
+  void set_log_buffer(const size_t bytes, const bool block_on_overflow, const size_t segment_bytes=(64 << 20));
+  // Full covariance snapshots (the COV channel, off by default) are delta-coded against the
+  // previous snapshot, with a self-contained keyframe every `interval` snapshots.  Also takes
+  // effect the next time the logger is initialized.
+  void set_cov_log_keyframe_interval(const int interval) { log_keyframe_interval_ = interval; }
+  uint64_t get_log_dropped_records() const { return log_ ? log_->dropped_records() : 0; }
+
+  // Turn a log channel (by its name in the log, or "ALL") on or off and limit its rate
+  // (0 logs every record).  set_log_policy takes a list like "XDOT off, STATE 50, FEAT on".
+  // Either can be called at any time, from the thread that runs the filter.
+  bool set_log_channel(const std::string& name, const bool enabled, const double rate_hz=0.0);
+  bool set_log_policy(const std::string& policy);
   void log_global_position(const Xformd& truth_global_transform);
 
   // Inequality Constraint on Depth
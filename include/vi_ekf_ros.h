@@ -1,15 +1,21 @@
 #include "vi_ekf.h"
 #include "klt_tracker.h"
+#include "feature_budget.h"
 
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <deque>
 #include <vector>
+#include <memory>
+#include <atomic>
 
 #include <ros/ros.h>
 #include <ros/package.h>
 #include <sensor_msgs/Image.h>
 #include <sensor_msgs/Imu.h>
 #include <sensor_msgs/Range.h>
+#include <std_msgs/String.h>
 #include <nav_msgs/Odometry.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <geometry_msgs/TransformStamped.h>
@@ -26,6 +32,41 @@ using namespace quat;
 typedef Matrix<double, 1, 1> Matrix1d;
 typedef Matrix<double, 6, 1> Vector6d;
 
+// The output of the tracking stage for one image
+struct tracked_frame_t
+{
+  double t;
+  int cam;
+  std::vector<Point2f> features;
+  std::vector<int> ids; // filter ids
+  std::vector<float> depths; // NAN where there is no usable depth
+  bool got_depth;
+  double track_ms;
+};
+
+// One camera's tracker.  With more than one camera each runs on its own thread, which
+// tracks the newest image that has come in for it
+struct camera_tracker_t
+{
+  int index;
+  KLT_Tracker tracker;
+  Matrix3d R_b_c;
+  Matrix3d rotation; // camera rotation since the last image, from the gyros (protected by ekf_mtx_)
+  image_transport::Subscriber image_sub;
+  cv::Mat img; // only used to flip the image
+  std::vector<Point2f> features;
+  std::vector<int> ids;
+
+  std::thread thread;
+  std::mutex image_mtx;
+  std::condition_variable image_cv;
+  sensor_msgs::ImageConstPtr pending_image; // nullptr when there is nothing to track
+
+  // Gated features and feature budget changes from the filter (protected by tracker_feedback_mtx_)
+  std::vector<int> drops; // tracker ids
+  int num_features; // -1 when unchanged
+};
+
 
 class VIEKF_ROS
 {
@@ -34,6 +75,7 @@ public:
   VIEKF_ROS();
   ~VIEKF_ROS();
   void color_image_callback(const sensor_msgs::ImageConstPtr &msg);
+  void image_callback(const sensor_msgs::ImageConstPtr &msg, const int cam);
   void depth_image_callback(const sensor_msgs::ImageConstPtr& msg);
   void pose_truth_callback(const geometry_msgs::PoseStampedConstPtr &msg);
   void transform_truth_callback(const geometry_msgs::TransformStampedConstPtr &msg);
@@ -41,7 +83,9 @@ public:
   void truth_callback(Vector3d &z_pos_, Vector4d &z_att_, ros::Time time);
   void imu_callback(const sensor_msgs::ImuConstPtr& msg);
   void gps_callback(const inertial_sense::GPSConstPtr &msg);
+  void log_policy_callback(const std_msgs::StringConstPtr &msg);
   void keyframe_reset_callback();
+  void update_features(const tracked_frame_t& frame);
   vi_ekf::VIEKF ekf_;
   
 private:
@@ -54,20 +98,45 @@ private:
   image_transport::ImageTransport it_;
   image_transport::Publisher output_pub_;
   image_transport::Publisher cov_img_pub_;
-  image_transport::Subscriber image_sub_;
   image_transport::Subscriber depth_sub_;
   ros::Subscriber gps_sub_;
   ros::Subscriber imu_sub_;
   ros::Subscriber pose_sub_;
   ros::Subscriber transform_sub_;
   ros::Subscriber odom_truth_sub_;
+  ros::Subscriber log_policy_sub_;
   ros::Publisher odometry_pub_;
   ros::Publisher bias_pub_;
   nav_msgs::Odometry odom_msg_;
 
-  std::mutex ekf_mtx_;
-  KLT_Tracker klt_tracker_;
-
+  std::mutex ekf_mtx_; // every call on ekf_, including the state_at/pose_at history lookups
+  bool klt_gyro_prediction_;
+  bool klt_use_gyros_; // the trackers get the rotation since the last image
+  double last_imu_t_;
+  
+  // Camera 0 is configured by the top-level parameters, camera k by the camera<k>/ ones.
+  // Tracker ids are made unique across cameras with id * num_cameras + camera
+  std::vector<std::unique_ptr<camera_tracker_t>> cameras_;
+  std::atomic<bool> stop_tracker_threads_;
+  void track_image(const sensor_msgs::ImageConstPtr &msg, camera_tracker_t& camera);
+  void tracker_thread(camera_tracker_t* camera);
+  inline int filter_id(const int tracker_id, const int cam) const { return tracker_id * (int)cameras_.size() + cam; }
+  
+  // Tracking/filter pipeline: tracked frames queue up for the filter thread, and the gated
+  // features and feature budget changes go back to the tracker
+  void filter_thread();
+  bool pipeline_tracking_;
+  size_t pipeline_depth_;
+  std::deque<tracked_frame_t> frame_queue_;
+  std::mutex frame_mtx_;
+  std::condition_variable frame_cv_;
+  bool stop_filter_thread_;
+  std::thread filter_thread_;
+  std::mutex tracker_feedback_mtx_;
+  vi_ekf::FeatureBudget feature_budget_;
+  double imu_time_ms_; // IMU propagation time since the last image (protected by ekf_mtx_)
+
+  std::mutex depth_mtx_;
   cv::Mat depth_image_;
   bool got_depth_;
   bool invert_image_;
@@ -92,8 +161,9 @@ private:
   ros::Time start_time_;
 
   Vector6d imu_;
-  Vector3d kf_pos_;
   Vector3d init_pos_;
+  // Keyframe and truth, shared with keyframe_reset_callback (guarded by ekf_mtx_)
+  Vector3d kf_pos_;
   Quatd kf_att_;
   Vector3d truth_pos_;
   Quatd truth_att_;
@@ -102,18 +172,11 @@ private:
   Vector2d z_acc_drag_;
   Vector3d z_acc_grav_;
   Vector4d z_att_;
-  Vector2d z_feat_;
-  Matrix1d z_depth_;
   Matrix1d z_alt_;
   Vector3d z_pos_;
   xform::Xformd global_transform_;
   sensor_msgs::Imu bias_msg_;
   
-  cv_bridge::CvImagePtr cv_ptr_;
-  Mat img_;
-  std::vector<Point2f> features_;
-  std::vector<int> ids_;
-  
   Quatd q_b_IMU_;
   Quatd q_I_truth_;
   
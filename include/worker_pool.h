@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace vi_ekf
+{
+
+// Persistent pool of worker threads for splitting independent loops across cores.
+// The threads are created once, and each parallel_for only wakes them up.
+// parallel_for must only be called from one thread at a time.
+class WorkerPool
+{
+public:
+  WorkerPool(const int num_threads);
+  // A copy is a separate pool with the same number of threads
+  WorkerPool(const WorkerPool& other) : WorkerPool(other.num_threads()) {}
+  WorkerPool& operator=(const WorkerPool&) = delete;
+  ~WorkerPool();
+
+  // Split [begin, end) into one contiguous chunk per thread (chunk boundaries are multiples
+  // of grain from begin), and call fn(chunk_begin, chunk_end) on each.  The calling thread
+  // works on the first chunk, and this returns once all chunks are done.
+  void parallel_for(const int begin, const int end, const int grain, const std::function<void(int, int)>& fn);
+
+  inline int num_threads() const { return threads_.size() + 1; }
+
+private:
+  void work(const int id);
+
+  std::vector<std::thread> threads_;
+  std::vector<std::pair<int, int>> chunks_;
+  const std::function<void(int, int)>* fn_;
+
+  std::mutex mtx_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  int generation_;
+  int pending_;
+  bool stop_;
+};
+
+}
@@ -0,0 +1,177 @@
+#!/usr/bin/env python
+"""
+Generates flattened, common-subexpression-eliminated C++ for the per-feature
+dynamics, dynamics Jacobians and feature measurement model.
+
+The expressions are the same ones written out in vi_ekf_dyn.cpp and h_feat, so
+jac_test validates the generated code against the hand-written versions and
+against finite differences.  Run through the jacobian_codegen CMake target:
+
+    make jacobian_codegen
+
+usage: gen_jacobians.py <output header>
+"""
+import sys
+import sympy as sp
+from sympy.printing.c import C99CodePrinter
+
+
+class ScalarTemplatePrinter(C99CodePrinter):
+    """Prints expressions using only +, -, * (and / where unavoidable) on a generic
+    scalar type T, so the same code can be instantiated for double or simd packs"""
+
+    def _print_Pow(self, expr):
+        base, exp = expr.as_base_exp()
+        if exp.is_Integer and exp > 0:
+            return '(' + '*'.join([self.parenthesize(base, 100)] * int(exp)) + ')'
+        if exp.is_Integer and exp < 0:
+            return '(T(1)/' + self._print_Pow(base ** (-exp)) + ')'
+        raise ValueError('unsupported power: %s' % expr)
+
+    def _print_Integer(self, expr):
+        return 'T(%d)' % int(expr)
+
+    def _print_Rational(self, expr):
+        return 'T(%d.0/%d.0)' % (expr.p, expr.q)
+
+    def _print_Float(self, expr):
+        return 'T(%s)' % super(ScalarTemplatePrinter, self)._print_Float(expr)
+
+
+def vec(name, n):
+    return sp.Matrix(sp.symbols('%s[0:%d]' % (name, n)))
+
+
+def skew(v):
+    return sp.Matrix([[0, -v[2], v[1]], [v[2], 0, -v[0]], [-v[1], v[0], 0]])
+
+
+# Feature state
+q = vec('q', 4)
+w, x, y, z = q
+rho = sp.Symbol('rho')
+
+# Columns of R(q)^T: T_zeta is the first two, zeta is the last.  These are computed
+# once up front and kept symbolic, which keeps the quaternion polynomials from
+# being multiplied out through every expression below.
+Rt_q = sp.Matrix([[1 - 2*(y*y + z*z), 2*(x*y - w*z), 2*(x*z + w*y)],
+                  [2*(x*y + w*z), 1 - 2*(x*x + z*z), 2*(y*z - w*x)],
+                  [2*(x*z - w*y), 2*(y*z + w*x), 1 - 2*(x*x + y*y)]])
+Rt = sp.Matrix(3, 3, sp.symbols('Rt0:9'))
+T_z = Rt[:, 0:2]
+zeta = Rt[:, 2]
+
+# Camera velocities and extrinsics
+omega_c = vec('omega_c', 3)
+vel_c = vec('vel_c', 3)
+R_b_c = sp.Matrix(3, 3, sp.symbols('R_b_c[0:9]'))  # row-major
+p_b_c = vec('p_b_c', 3)
+
+# Feature dynamics
+zeta_x_vel = zeta.cross(vel_c)
+dzeta = T_z.T * (omega_c + rho * zeta_x_vel)
+drho = rho**2 * zeta.dot(vel_c)
+
+# Feature dynamics Jacobians (the input Jacobian is the same as the gyro bias block)
+A_zeta_vel = rho * T_z.T * skew(zeta) * R_b_c
+A_zeta_bg = T_z.T * (rho * skew(zeta) * R_b_c * skew(p_b_c) - R_b_c)
+A_zeta_zeta = -T_z.T * (skew(omega_c + rho * zeta_x_vel) + rho * skew(vel_c) * skew(zeta)) * T_z
+A_zeta_rho = T_z.T * zeta_x_vel
+A_rho_vel = rho**2 * zeta.T * R_b_c
+A_rho_bg = rho**2 * zeta.T * R_b_c * skew(p_b_c)
+A_rho_zeta = rho**2 * vel_c.T * skew(zeta) * T_z
+A_rho_rho = 2 * rho * zeta.dot(vel_c)
+
+# Feature pixel measurement
+f = vec('f', 2)
+c = vec('c', 2)
+cam_F = sp.Matrix([[f[0], 0, 0], [0, f[1], 0]])
+e_z = sp.Matrix([0, 0, 1])
+ezT_zeta = zeta[2]
+h_feat = cam_F * zeta / ezT_zeta + c
+H_feat = (1 / ezT_zeta) * cam_F * (sp.eye(3) - (zeta * e_z.T) / ezT_zeta) * skew(zeta) * T_z
+
+
+def flatten(m):
+    return list(m) if isinstance(m, sp.MatrixBase) else [m]
+
+
+def emit_function(printer, name, comment, args, outputs):
+    exprs = []
+    for out, m in outputs:
+        exprs += [(out, i, e) for i, e in enumerate(flatten(m))]
+
+    temps, reduced = sp.cse([e for _, _, e in exprs], symbols=sp.numbered_symbols('t'), optimizations='basic')
+
+    # Only compute the parts of R(q)^T that are used
+    used = set().union(*[e.free_symbols for _, e in temps], *[e.free_symbols for e in reduced])
+    prelude = [(Rt[i], Rt_q[i]) for i in range(9) if Rt[i] in used]
+    q_temps, q_reduced = sp.cse([e for _, e in prelude], symbols=sp.numbered_symbols('s'), optimizations='basic')
+
+    lines = ['// ' + l for l in comment]
+    lines.append('template <typename T>')
+    lines.append('inline void %s(%s)' % (name, ', '.join(args)))
+    lines.append('{')
+    for sym, e in q_temps:
+        lines.append('  const T %s = %s;' % (sym, printer.doprint(e)))
+    for (sym, _), e in zip(prelude, q_reduced):
+        lines.append('  const T %s = %s;' % (sym, printer.doprint(e)))
+    for sym, e in temps:
+        lines.append('  const T %s = %s;' % (sym, printer.doprint(e)))
+    for (out, i, _), e in zip(exprs, reduced):
+        lines.append('  %s[%d] = %s;' % (out, i, printer.doprint(e)))
+    lines.append('}')
+
+    # Count the arithmetic so regressions in the generated code are easy to spot
+    ops = sum(sp.count_ops(e) for _, e in temps + q_temps) + sum(sp.count_ops(e) for e in reduced + q_reduced)
+    return lines, ops
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__)
+        sys.exit(1)
+
+    printer = ScalarTemplatePrinter()
+    feat_args = ['const T* q', 'const T rho', 'const T* omega_c', 'const T* vel_c']
+    functions = [
+        emit_function(printer, 'feat_dynamics',
+                      ['Feature state derivative dzeta[2], drho[1]'],
+                      feat_args + ['T* dzeta', 'T* drho'],
+                      [('dzeta', dzeta), ('drho', drho)]),
+        emit_function(printer, 'feat_jacobian',
+                      ['Feature dynamics Jacobian blocks (row-major).  R_b_c is row-major, and the input',
+                       'Jacobian blocks are the same as the gyro bias blocks'],
+                      feat_args + ['const T* R_b_c', 'const T* p_b_c',
+                                   'T* A_zeta_vel', 'T* A_zeta_bg', 'T* A_zeta_zeta', 'T* A_zeta_rho',
+                                   'T* A_rho_vel', 'T* A_rho_bg', 'T* A_rho_zeta', 'T* A_rho_rho'],
+                      [('A_zeta_vel', A_zeta_vel), ('A_zeta_bg', A_zeta_bg), ('A_zeta_zeta', A_zeta_zeta),
+                       ('A_zeta_rho', A_zeta_rho), ('A_rho_vel', A_rho_vel), ('A_rho_bg', A_rho_bg),
+                       ('A_rho_zeta', A_rho_zeta), ('A_rho_rho', A_rho_rho)]),
+        emit_function(printer, 'feat_measurement',
+                      ['Pixel measurement of a feature h[2] and its Jacobian w.r.t. zeta H[4] (row-major),',
+                       'given the focal length f[2] and image center c[2]'],
+                      ['const T* q', 'const T* f', 'const T* c', 'T* h', 'T* H'],
+                      [('h', h_feat), ('H', H_feat)]),
+    ]
+
+    out = ['// Generated by scripts/gen_jacobians.py (make jacobian_codegen), do not edit by hand',
+           '#pragma once',
+           '',
+           'namespace vi_ekf',
+           '{',
+           'namespace gen',
+           '{',
+           '']
+    for lines, ops in functions:
+        out.append('// %d operations' % ops)
+        out += lines
+        out.append('')
+    out += ['}', '}', '']
+
+    with open(sys.argv[1], 'w') as fp:
+        fp.write('\n'.join(out))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,195 @@
+#include "async_logger.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace vi_ekf
+{
+
+AsyncLogger::AsyncLogger(std::unique_ptr<LogSink> sink, const size_t buffer_bytes, const overflow_policy_t policy) :
+  policy_(policy),
+  head_(0),
+  tail_(0),
+  in_record_(false),
+  record_pos_(0),
+  record_end_(0),
+  dropped_records_(0),
+  written_records_(0),
+  sink_(std::move(sink)),
+  stop_(false)
+{
+  // Round the buffer up to a power of two so positions wrap with a mask
+  size_t size = 64;
+  while (size < buffer_bytes)
+    size <<= 1;
+  buf_.resize(size);
+  mask_ = size - 1;
+
+  thread_ = std::thread(&AsyncLogger::work, this);
+}
+
+AsyncLogger::~AsyncLogger()
+{
+  {
+    std::lock_guard<std::mutex> lock(wake_mtx_);
+    stop_ = true;
+  }
+  wake_cv_.notify_one();
+  thread_.join();
+  sink_->flush();
+}
+
+bool AsyncLogger::begin(const int stream, const size_t bytes)
+{
+  size_t need = sizeof(record_header_t) + bytes;
+  size_t head = head_.load(std::memory_order_relaxed);
+  in_record_ = false;
+
+  if (need > buf_.size())
+  {
+    dropped_records_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  if (buf_.size() - (head - tail_.load(std::memory_order_acquire)) < need)
+  {
+    if (policy_ == DROP)
+    {
+      dropped_records_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    std::unique_lock<std::mutex> lock(wake_mtx_);
+    wake_cv_.notify_one();
+    drained_cv_.wait(lock, [&]{ return buf_.size() - (head - tail_.load(std::memory_order_acquire)) >= need; });
+  }
+
+  record_header_t header = {(uint32_t)stream, (uint32_t)bytes};
+  copy_in(head, &header, sizeof(header));
+  record_pos_ = head + sizeof(header);
+  record_end_ = head + need;
+  in_record_ = true;
+  return true;
+}
+
+void AsyncLogger::append(const void *data, const size_t bytes)
+{
+  if (!in_record_)
+    return;
+  // Never write past the space reserved by begin
+  size_t len = std::min(bytes, record_end_ - record_pos_);
+  copy_in(record_pos_, data, len);
+  record_pos_ += len;
+}
+
+void AsyncLogger::commit()
+{
+  if (!in_record_)
+    return;
+  // Zero-fill anything that wasn't appended so the writer never sees stale bytes
+  static const char zeros[64] = {0};
+  while (record_pos_ < record_end_)
+    append(zeros, std::min(sizeof(zeros), record_end_ - record_pos_));
+  size_t head = head_.load(std::memory_order_relaxed);
+  head_.store(record_end_);
+  in_record_ = false;
+
+  // The writer only sleeps once the buffer is empty, so wake it when this is the first record
+  // since, and again when the buffer passes half full.  (Both this head store and tail load and
+  // the writer's tail store and head load are sequentially consistent, so either this sees the
+  // buffer empty or the writer sees the record before it sleeps.)
+  size_t tail = tail_.load();
+  size_t high_water = buf_.size() / 2;
+  if (tail == head || (head - tail < high_water && record_end_ - tail >= high_water))
+  {
+    std::lock_guard<std::mutex> lock(wake_mtx_);
+    wake_cv_.notify_one();
+  }
+}
+
+bool AsyncLogger::write(const int stream, const void *data, const size_t bytes)
+{
+  if (!begin(stream, bytes))
+    return false;
+  append(data, bytes);
+  commit();
+  return true;
+}
+
+void AsyncLogger::flush()
+{
+  size_t head = head_.load(std::memory_order_relaxed);
+  {
+    std::unique_lock<std::mutex> lock(wake_mtx_);
+    wake_cv_.notify_one();
+    drained_cv_.wait(lock, [&]{ return tail_.load(std::memory_order_acquire) >= head; });
+  }
+  std::lock_guard<std::mutex> lock(sink_mtx_);
+  sink_->flush();
+}
+
+void AsyncLogger::copy_in(const size_t pos, const void *data, const size_t bytes)
+{
+  size_t start = pos & mask_;
+  size_t first = std::min(bytes, buf_.size() - start);
+  memcpy(buf_.data() + start, data, first);
+  memcpy(buf_.data(), (const char*)data + first, bytes - first);
+}
+
+const char* AsyncLogger::contiguous(const size_t pos, const size_t bytes)
+{
+  size_t start = pos & mask_;
+  if (start + bytes <= buf_.size())
+    return buf_.data() + start;
+  scratch_.resize(bytes);
+  size_t first = buf_.size() - start;
+  memcpy(scratch_.data(), buf_.data() + start, first);
+  memcpy(scratch_.data() + first, buf_.data(), bytes - first);
+  return scratch_.data();
+}
+
+bool AsyncLogger::drain()
+{
+  size_t head = head_.load();
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  if (tail == head)
+    return false;
+
+  std::lock_guard<std::mutex> lock(sink_mtx_);
+  while (tail < head)
+  {
+    record_header_t header;
+    memcpy(&header, contiguous(tail, sizeof(header)), sizeof(header));
+    sink_->write(header.stream, contiguous(tail + sizeof(header), header.bytes), header.bytes);
+
+    // Hand the space back to the producer record by record
+    tail += sizeof(header) + header.bytes;
+    tail_.store(tail);
+    written_records_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+void AsyncLogger::work()
+{
+  while (true)
+  {
+    if (drain())
+    {
+      // Let a producer waiting for room (or in flush) see the space that was freed
+      {
+        std::lock_guard<std::mutex> lock(wake_mtx_);
+      }
+      drained_cv_.notify_all();
+      continue;
+    }
+    if (stop_)
+    {
+      // The producer is gone, so whatever is committed now is everything
+      drain();
+      return;
+    }
+    std::unique_lock<std::mutex> lock(wake_mtx_);
+    wake_cv_.wait(lock, [this]{ return stop_ || head_.load() != tail_.load(); });
+  }
+}
+
+}
@@ -0,0 +1,51 @@
+#include "feature_budget.h"
+
+#include <algorithm>
+
+namespace vi_ekf
+{
+
+FeatureBudget::FeatureBudget() :
+  FeatureBudget(0, 0, 0.0)
+{}
+
+FeatureBudget::FeatureBudget(const int min_features, const int max_features, const double target_ms,
+                             const double hysteresis, const int step, const int settle_frames) :
+  min_features_(min_features),
+  max_features_(std::max(min_features, max_features)),
+  target_ms_(target_ms),
+  hysteresis_(hysteresis),
+  step_(std::max(step, 1)),
+  settle_frames_(settle_frames),
+  num_features_(std::max(min_features, max_features)),
+  smoothed_ms_(-1.0),
+  frames_since_change_(0)
+{}
+
+int FeatureBudget::update(const double frame_ms)
+{
+  if (!enabled())
+    return num_features_;
+
+  // Low-pass filter the frame time (the first frame initializes it)
+  static const double alpha = 0.2;
+  if (smoothed_ms_ < 0.0)
+    smoothed_ms_ = frame_ms;
+  else
+    smoothed_ms_ = alpha * frame_ms + (1.0 - alpha) * smoothed_ms_;
+
+  if (++frames_since_change_ < settle_frames_)
+    return num_features_;
+
+  int prev = num_features_;
+  if (smoothed_ms_ > target_ms_ * (1.0 + hysteresis_))
+    num_features_ = std::max(num_features_ - step_, min_features_);
+  else if (smoothed_ms_ < target_ms_ * (1.0 - hysteresis_))
+    num_features_ = std::min(num_features_ + step_, max_features_);
+
+  if (num_features_ != prev)
+    frames_since_change_ = 0;
+  return num_features_;
+}
+
+}
@@ -1,15 +1,41 @@
 #include "klt_tracker.h"
 
 #include "iostream"
+#include <chrono>
+#include <cmath>
 using namespace std;
 
 KLT_Tracker::KLT_Tracker()
 {
+  detect_pending_ = detect_busy_ = detect_stop_ = false;
+  pyramid_levels_ = 3;
+  window_size_ = Size(21, 21);
+  set_detector(GFTT, 80, 2, 20);
+  set_camera(Eigen::Vector2d(320, 320), Eigen::Vector2d(320, 240));
+  set_resolution(0);
+  set_outlier_rejection(0.0, 0.0);
+  gyro_prediction_ = true;
+  set_detection_policy(1, 1.0, false);
   init(12, true, 30, cv::Size(640, 480));
 }
 
+KLT_Tracker::~KLT_Tracker()
+{
+  {
+    std::lock_guard<std::mutex> lock(detect_mtx_);
+    detect_stop_ = true;
+  }
+  detect_cv_.notify_all();
+  if (detect_thread_.joinable())
+    detect_thread_.join();
+}
+
 void KLT_Tracker::init(int _num_features, bool _show_image, int _radius, cv::Size _size)
 {
+  // Throw away a search that's still running on the old image
+  wait_for_detection();
+  detect_pending_ = false;
+  frames_since_detect_ = 0;
   initialized_ = false;
   num_features_ = _num_features;
   
@@ -28,16 +54,65 @@ void KLT_Tracker::init(int _num_features, bool _show_image, int _radius, cv::Siz
   }
   mask_ = cv::Mat(_size, CV_8UC1);
   mask_ = 255;
+  point_mask_.release();
+  grid_cell_size_ = grid_cols_ = grid_rows_ = 0;
+  prev_tile_index_.clear();
+}
+
+void KLT_Tracker::set_pyramid(int _levels, int _window_size)
+{
+  Size window_size(_window_size, _window_size);
+  if (_levels == pyramid_levels_ && window_size == window_size_)
+    return;
+  pyramid_levels_ = _levels;
+  window_size_ = window_size;
+  tile_size_ = window_size_.width + 2 * ((1 << max_scale_level_) + 2);
+  prev_tile_index_.clear();
+  
+  // The pyramid's borders depend on the window size, so rebuild the previous one to match
+  if (initialized_)
+  {
+    vector<Mat> prev_pyramid;
+    buildOpticalFlowPyramid(prev_pyramid_[0], prev_pyramid, window_size_, pyramid_levels_);
+    std::swap(prev_pyramid, prev_pyramid_);
+  }
+}
+
+void KLT_Tracker::set_resolution(int _max_scale_level, double _time_budget_ms)
+{
+  max_scale_level_ = std::max(_max_scale_level, 0);
+  // The budget counts levels of resolution, so the run time slowly walks the scale up and down
+  resolution_budget_ = vi_ekf::FeatureBudget(0, max_scale_level_, max_scale_level_ > 0 ? _time_budget_ms : 0.0, 0.2, 1);
+  scale_level_ = resolution_budget_.enabled() ? 0 : max_scale_level_;
+  
+  // Room around the LK window for what's left after tracking a scaled down image
+  tile_size_ = window_size_.width + 2 * ((1 << max_scale_level_) + 2);
+  prev_tile_index_.clear();
+}
+
+void KLT_Tracker::set_outlier_rejection(double _fb_threshold, double _ransac_threshold, int _ransac_iterations)
+{
+  fb_threshold_ = _fb_threshold;
+  ransac_threshold_ = _ransac_threshold;
+  ransac_iterations_ = std::max(_ransac_iterations, 1);
+  ransac_rng_ = RNG(1234);
 }
 
 bool KLT_Tracker::drop_feature(int feature_id)
 {
-  // get the local index of this feature_id
+  // get the local index of this feature_id (between frames, ids_ goes with prev_features_)
   int local_id = std::distance(ids_.begin(), std::find(ids_.begin(), ids_.end(), feature_id));
   if (local_id < ids_.size())
   {
     ids_.erase(ids_.begin() + local_id);
     new_features_.erase(new_features_.begin() + local_id);
+    if (local_id < prev_features_.size())
+      prev_features_.erase(prev_features_.begin() + local_id);
+    if (local_id < prev_tile_index_.size())
+    {
+      prev_tile_index_.erase(prev_tile_index_.begin() + local_id);
+      prev_tile_origins_.erase(prev_tile_origins_.begin() + local_id);
+    }
     return true;
   }
   else
@@ -48,108 +123,649 @@ bool KLT_Tracker::drop_feature(int feature_id)
 
 void KLT_Tracker::set_feature_mask(std::string filename)
 {
+  wait_for_detection();
   cv::threshold(cv::imread(filename, IMREAD_GRAYSCALE), mask_, 1, 255, CV_8UC1);
+  point_mask_.release();
+}
+
+void KLT_Tracker::grid_clear()
+{
+  // Cells are one radius across, so every point within a radius is in the 3x3 block around it
+  int cell_size = std::max(feature_nearby_radius_, 1);
+  int cols = (mask_.cols + cell_size - 1) / cell_size;
+  int rows = (mask_.rows + cell_size - 1) / cell_size;
+  if (cell_size != grid_cell_size_ || cols != grid_cols_ || rows != grid_rows_)
+  {
+    grid_cell_size_ = cell_size;
+    grid_cols_ = cols;
+    grid_rows_ = rows;
+    grid_head_.resize(cols * rows);
+    point_mask_.release();
+  }
+  std::fill(grid_head_.begin(), grid_head_.end(), -1);
+  grid_next_.clear();
+  grid_pts_.clear();
+}
+
+int KLT_Tracker::grid_cell(int col, int row) const
+{
+  col = std::min(std::max(col, 0), grid_cols_ - 1);
+  row = std::min(std::max(row, 0), grid_rows_ - 1);
+  return row * grid_cols_ + col;
+}
+
+void KLT_Tracker::grid_insert(const Point2f& pt)
+{
+  int cell = grid_cell(pt.x / grid_cell_size_, pt.y / grid_cell_size_);
+  grid_next_.push_back(grid_head_[cell]);
+  grid_pts_.push_back(pt);
+  grid_head_[cell] = grid_pts_.size() - 1;
+}
+
+bool KLT_Tracker::grid_near(const Point2f& pt) const
+{
+  int col = pt.x / grid_cell_size_;
+  int row = pt.y / grid_cell_size_;
+  double r2 = (double)feature_nearby_radius_ * feature_nearby_radius_;
+  for (int r = std::max(row - 1, 0); r <= std::min(row + 1, grid_rows_ - 1); r++)
+  {
+    for (int c = std::max(col - 1, 0); c <= std::min(col + 1, grid_cols_ - 1); c++)
+    {
+      for (int j = grid_head_[r * grid_cols_ + c]; j >= 0; j = grid_next_[j])
+      {
+        double dx = grid_pts_[j].x - pt.x;
+        double dy = grid_pts_[j].y - pt.y;
+        if (dx*dx + dy*dy < r2)
+          return true;
+      }
+    }
+  }
+  return false;
+}
+
+void KLT_Tracker::update_point_mask()
+{
+  // Blank out the cells with a point in them.  Only the cells that changed since the last
+  // time are rewritten, instead of copying the whole mask and drawing every point.
+  if (point_mask_.size() != mask_.size())
+  {
+    mask_.copyTo(point_mask_);
+    cell_occupied_.assign(grid_head_.size(), 0);
+  }
+  for (int cell = 0; cell < grid_head_.size(); cell++)
+  {
+    uchar occupied = grid_head_[cell] >= 0;
+    if (occupied == cell_occupied_[cell])
+      continue;
+    Rect roi = Rect((cell % grid_cols_) * grid_cell_size_, (cell / grid_cols_) * grid_cell_size_,
+                    grid_cell_size_, grid_cell_size_) & Rect(0, 0, mask_.cols, mask_.rows);
+    if (occupied)
+      point_mask_(roi).setTo(0);
+    else
+      mask_(roi).copyTo(point_mask_(roi));
+    cell_occupied_[cell] = occupied;
+  }
+}
+
+void KLT_Tracker::set_detector(detector_t _detector, int _cell_size, int _corners_per_cell, int _fast_threshold)
+{
+  wait_for_detection();
+  detector_ = _detector;
+  detect_cell_size_ = std::max(_cell_size, 8);
+  corners_per_cell_ = std::max(_corners_per_cell, 1);
+  fast_threshold_ = _fast_threshold;
+}
+
+void KLT_Tracker::set_camera(const Eigen::Vector2d& _focal_len, const Eigen::Vector2d& _cam_center)
+{
+  K_ << _focal_len(0), 0, _cam_center(0),
+        0, _focal_len(1), _cam_center(1),
+        0, 0, 1;
+}
+
+void KLT_Tracker::set_detection_policy(int _interval, double _fill_threshold, bool _async)
+{
+  wait_for_detection();
+  detect_interval_ = std::max(_interval, 0);
+  detect_fill_ = _fill_threshold;
+  detect_async_ = _async;
+  if (detect_async_ && !detect_thread_.joinable())
+    detect_thread_ = std::thread(&KLT_Tracker::detection_thread, this);
+}
+
+void KLT_Tracker::start_detection()
+{
+  // Called once the frame is done, so its image is the level 0 of prev_pyramid_ (the worker
+  // keeps its own reference to it) and its points are prev_features_ and in the grid
+  if (detector_ == GFTT)
+    update_point_mask();
+  detect_img_ = prev_pyramid_[0];
+  detect_points_.assign(prev_features_.begin(), prev_features_.end());
+  detect_level_ = scale_level_;
+  detect_radius_ = feature_nearby_radius_;
+  detect_max_corners_ = 2 * (num_features_ - prev_features_.size());
+  detect_pending_ = true;
+  {
+    std::lock_guard<std::mutex> lock(detect_mtx_);
+    detect_busy_ = true;
+  }
+  detect_cv_.notify_all();
+}
+
+void KLT_Tracker::wait_for_detection()
+{
+  if (!detect_pending_)
+    return;
+  std::unique_lock<std::mutex> lock(detect_mtx_);
+  detect_cv_.wait(lock, [this]{ return !detect_busy_; });
+}
+
+void KLT_Tracker::finish_detection()
+{
+  if (!detect_pending_)
+    return;
+  wait_for_detection();
+  detect_pending_ = false;
+  
+  // The corners were found in the last frame, so they join its points and are tracked with
+  // them.  They don't have a tile from that frame, so they skip the full resolution refinement.
+  bool has_tiles = max_scale_level_ > 0 && prev_tile_index_.size() == prev_features_.size();
+  add_corners(detect_corners_, detect_level_, prev_features_);
+  new_features_.resize(prev_features_.size());
+  if (has_tiles)
+  {
+    prev_tile_index_.resize(prev_features_.size(), -1);
+    prev_tile_origins_.resize(prev_features_.size());
+  }
+}
+
+void KLT_Tracker::detection_thread()
+{
+  std::unique_lock<std::mutex> lock(detect_mtx_);
+  while (true)
+  {
+    detect_cv_.wait(lock, [this]{ return detect_busy_ || detect_stop_; });
+    if (detect_stop_)
+      break;
+    lock.unlock();
+    find_corners(detect_img_, detect_points_, detect_level_, detect_radius_, detect_max_corners_, detect_corners_);
+    lock.lock();
+    detect_busy_ = false;
+    detect_cv_.notify_all();
+  }
+}
+
+void KLT_Tracker::detect_features(const Mat& grey_img)
+{
+  int num_new_features = num_features_ - new_features_.size();
+  if (num_new_features <= 0)
+    return;
+  
+  // Look for corners outside the cells that already have a point
+  if (detector_ == GFTT)
+    update_point_mask();
+  find_corners(grey_img, new_features_, scale_level_, feature_nearby_radius_, 2*num_new_features, new_corners_);
+  add_corners(new_corners_, scale_level_, new_features_);
+}
+
+void KLT_Tracker::find_corners(const Mat& grey_img, const vector<Point2f>& points, int level, int radius, int max_corners,
+                               vector<Point2f>& corners)
+{
+  corners.clear();
+  if (detector_ == GRID_FAST)
+  {
+    detect_grid_fast(grey_img, points, level, corners);
+  }
+  else if (level > 0)
+  {
+    resize(point_mask_, scaled_mask_, grey_img.size(), 0, 0, INTER_NEAREST);
+    goodFeaturesToTrack(grey_img, corners, max_corners, 0.3, std::max(radius >> level, 1), scaled_mask_, 7);
+  }
+  else
+  {
+    goodFeaturesToTrack(grey_img, corners, max_corners, 0.3, radius, point_mask_, 7);
+  }
+}
+
+void KLT_Tracker::add_corners(const vector<Point2f>& corners, int level, vector<Point2f>& features)
+{
+  // The corners are best first, skip the ones that are too close to a point in a neighboring cell
+  int num_new_features = num_features_ - features.size();
+  for (int i = 0; i < corners.size() && num_new_features > 0; i++)
+  {
+    Point2f corner = to_full(corners[i], level);
+    if (grid_near(corner))
+      continue;
+    grid_insert(corner);
+    features.push_back(corner);
+    ids_.push_back(next_feature_id_++);
+    num_new_features--;
+  }
+}
+
+void KLT_Tracker::detect_grid_fast(const Mat& grey_img, const vector<Point2f>& points, int level, vector<Point2f>& new_corners)
+{
+  // Only the cells without a track are searched (the image and the cells may be scaled down)
+  int cell_size = std::max(detect_cell_size_ >> level, 8);
+  int cols = (grey_img.cols + cell_size - 1) / cell_size;
+  int rows = (grey_img.rows + cell_size - 1) / cell_size;
+  cell_has_track_.assign(cols * rows, 0);
+  for (int i = 0; i < points.size(); i++)
+  {
+    Point2f pt = to_scaled(points[i], level);
+    int col = std::min(std::max((int)(pt.x / cell_size), 0), cols - 1);
+    int row = std::min(std::max((int)(pt.y / cell_size), 0), rows - 1);
+    cell_has_track_[row * cols + col] = 1;
+  }
+  // Sized for every cell, so the buffers stop growing after the first search
+  empty_cells_.clear();
+  empty_cells_.reserve(cols * rows);
+  candidates_.reserve(cols * rows * corners_per_cell_);
+  new_corners.reserve(cols * rows * corners_per_cell_);
+  for (int cell = 0; cell < cols * rows; cell++)
+  {
+    if (!cell_has_track_[cell])
+      empty_cells_.push_back(cell);
+  }
+  if (cell_corners_.size() < empty_cells_.size())
+    cell_corners_.resize(empty_cells_.size());
+  
+  // Run FAST on each empty cell (padded by the detector's 3 pixel border), in parallel, and
+  // keep the strongest few corners in the cell that are inside the feature mask.  The body only
+  // captures two pointers, so it fits in the std::function without a heap allocation.
+  struct { const Mat* img; int level, cell_size, cols; } job = {&grey_img, level, cell_size, cols};
+  parallel_for_(Range(0, empty_cells_.size()), [this, &job](const Range& range)
+  {
+    const Mat& grey_img = *job.img;
+    int level = job.level;
+    int cell_size = job.cell_size;
+    int cols = job.cols;
+    for (int k = range.start; k < range.end; k++)
+    {
+      int cell = empty_cells_[k];
+      Rect cell_rect = Rect((cell % cols) * cell_size, (cell / cols) * cell_size,
+                            cell_size, cell_size) & Rect(0, 0, grey_img.cols, grey_img.rows);
+      Rect roi = Rect(cell_rect.x - 3, cell_rect.y - 3, cell_rect.width + 6, cell_rect.height + 6)
+                 & Rect(0, 0, grey_img.cols, grey_img.rows);
+      vector<KeyPoint>& corners = cell_corners_[k];
+      corners.clear();
+      FAST(grey_img(roi), corners, fast_threshold_, true);
+      
+      int n = 0;
+      for (int j = 0; j < corners.size(); j++)
+      {
+        Point2f pt = corners[j].pt + Point2f(roi.x, roi.y);
+        if (!cell_rect.contains(Point(pt)) || mask_.at<uint8_t>(Point(to_full(pt, level))) != 255)
+          continue;
+        corners[n] = corners[j];
+        corners[n].pt = pt;
+        n++;
+      }
+      corners.resize(n);
+      if (n > corners_per_cell_)
+      {
+        std::nth_element(corners.begin(), corners.begin() + corners_per_cell_, corners.end(),
+                         [](const KeyPoint& a, const KeyPoint& b) { return a.response > b.response; });
+        corners.resize(corners_per_cell_);
+      }
+    }
+  });
+  
+  // Strongest first across all of the cells
+  candidates_.clear();
+  for (int k = 0; k < empty_cells_.size(); k++)
+    candidates_.insert(candidates_.end(), cell_corners_[k].begin(), cell_corners_[k].end());
+  std::sort(candidates_.begin(), candidates_.end(),
+            [](const KeyPoint& a, const KeyPoint& b) { return a.response > b.response; });
+  for (int i = 0; i < candidates_.size(); i++)
+    new_corners.push_back(candidates_[i].pt);
 }
 
 void KLT_Tracker::load_image(const Mat& img, double t, std::vector<Point2f> &features, std::vector<int> &ids, OutputArray& output)
 {
-  Mat grey_img;
+  track(img, nullptr, features, ids, output);
+}
+
+void KLT_Tracker::load_image(const Mat& img, double t, const Eigen::Matrix3d& R_c2_c1, std::vector<Point2f> &features,
+                             std::vector<int> &ids, OutputArray& output)
+{
+  track(img, &R_c2_c1, features, ids, output);
+}
+
+bool KLT_Tracker::cut_tile(const Mat& img, const Point2f& pt, Mat& tiles, int index, Point2f& origin)
+{
+  // The tile is centered on the point, with the parts that fall outside of the image filled
+  // in by repeating its edge pixels
+  Rect tile(cvRound(pt.x) - tile_size_/2, cvRound(pt.y) - tile_size_/2, tile_size_, tile_size_);
+  Rect inside = tile & Rect(0, 0, img.cols, img.rows);
+  origin = Point2f(tile.x, tile.y);
+  if (inside.empty())
+    return false;
+  
+  Point2f offset = tile_offset(index);
+  Mat dst = tiles(Rect(offset.x, offset.y, tile_size_, tile_size_));
+  Rect rect(inside.x - tile.x, inside.y - tile.y, inside.width, inside.height);
+  Mat dst_inside = dst(rect);
   if (img.channels() > 1)
+    cvtColor(img(inside), dst_inside, COLOR_BGR2GRAY);
+  else
+    img(inside).copyTo(dst_inside);
+  
+  for (int c = 0; c < rect.x; c++)
+    dst.col(rect.x).rowRange(rect.y, rect.br().y).copyTo(dst.col(c).rowRange(rect.y, rect.br().y));
+  for (int c = rect.br().x; c < tile_size_; c++)
+    dst.col(rect.br().x - 1).rowRange(rect.y, rect.br().y).copyTo(dst.col(c).rowRange(rect.y, rect.br().y));
+  for (int r = 0; r < rect.y; r++)
+    dst.row(rect.y).copyTo(dst.row(r));
+  for (int r = rect.br().y; r < tile_size_; r++)
+    dst.row(rect.br().y - 1).copyTo(dst.row(r));
+  return true;
+}
+
+void KLT_Tracker::cut_prev_tiles(const Mat& img)
+{
+  int rows = std::max(((int)prev_features_.size() + TILE_COLS - 1) / TILE_COLS, 1);
+  prev_tiles_.create(rows * tile_size_, TILE_COLS * tile_size_, CV_8UC1);
+  prev_tile_origins_.resize(prev_features_.size());
+  prev_tile_index_.resize(prev_features_.size());
+  for (int i = 0; i < prev_features_.size(); i++)
   {
-    cvtColor(img, grey_img, COLOR_BGR2GRAY);
+    prev_tile_index_[i] = i;
+    cut_tile(img, prev_features_[i], prev_tiles_, i, prev_tile_origins_[i]);
   }
-  else
+}
+
+void KLT_Tracker::refine_features(const Mat& img)
+{
+  // Track each point again from the last frame's tile into a tile around the coarse estimate,
+  // at full resolution and without a pyramid, since the coarse estimate is within a couple of
+  // pixels.  Each frame's tiles are in a single image, so this is one LK call.
+  tiles_.create(prev_tiles_.size(), CV_8UC1);
+  tile_origins_.resize(new_features_.size());
+  tile_prev_pts_.resize(new_features_.size());
+  tile_pts_.resize(new_features_.size());
+  for (int i = 0; i < new_features_.size(); i++)
   {
-    grey_img = img;
+    // Without a tile from the last frame, the point keeps its coarse estimate
+    int index = prev_tile_index_[i];
+    if (index < 0)
+    {
+      tile_prev_pts_[i] = tile_pts_[i] = Point2f(0, 0);
+      continue;
+    }
+    tile_prev_pts_[i] = prev_features_[i] - prev_tile_origins_[i] + tile_offset(index);
+    if (status_[i] == 0 || !cut_tile(img, new_features_[i], tiles_, index, tile_origins_[i]))
+    {
+      status_[i] = 0;
+      tile_pts_[i] = tile_prev_pts_[i];
+      continue;
+    }
+    tile_pts_[i] = new_features_[i] - tile_origins_[i] + tile_offset(index);
   }
-  if (!initialized_)
+  
+  calcOpticalFlowPyrLK(prev_tiles_, tiles_, tile_prev_pts_, tile_pts_, refine_status_, refine_err_, window_size_, 0,
+                       TermCriteria(TermCriteria::COUNT+TermCriteria::EPS, 30, 0.01), OPTFLOW_USE_INITIAL_FLOW);
+  
+  // The point has to stay far enough inside its tile that the window never saw the next one
+  float lo = window_size_.width / 2;
+  float hi = tile_size_ - 1 - lo;
+  for (int i = 0; i < new_features_.size(); i++)
   {
-    double quality_level = 0.3;
-    int block_size = 7;
-    goodFeaturesToTrack(grey_img, new_features_, num_features_, quality_level, feature_nearby_radius_, mask_, block_size);
-    for (int i = 0; i < new_features_.size(); i++)
+    if (status_[i] == 0 || prev_tile_index_[i] < 0)
+      continue;
+    Point2f pt = tile_pts_[i] - tile_offset(prev_tile_index_[i]);
+    if (refine_status_[i] == 0 || pt.x < lo || pt.y < lo || pt.x > hi || pt.y > hi)
+      status_[i] = 0;
+    else
+      new_features_[i] = pt + tile_origins_[i];
+  }
+}
+
+void KLT_Tracker::check_forward_backward(const vector<Point2f>& prev, const vector<Point2f>& next, int levels, float threshold)
+{
+  // Track every point back from the new frame, starting from where it was, in one LK call
+  back_features_.assign(prev.begin(), prev.end());
+  calcOpticalFlowPyrLK(pyramid_, prev_pyramid_, next, back_features_, back_status_, back_err_, window_size_, levels,
+                       TermCriteria(TermCriteria::COUNT+TermCriteria::EPS, 30, 0.01), OPTFLOW_USE_INITIAL_FLOW);
+  float threshold2 = threshold * threshold;
+  for (int i = 0; i < prev.size(); i++)
+  {
+    Point2f d = back_features_[i] - prev[i];
+    if (back_status_[i] == 0 || d.dot(d) > threshold2)
+      status_[i] = 0;
+  }
+}
+
+void KLT_Tracker::reject_outliers(const Eigen::Matrix3d& R_c2_c1)
+{
+  // Bearings (on the normalized image plane) of the tracks that are left, with the old ones
+  // rotated into the new frame
+  Eigen::Matrix3d K_inv = K_.inverse();
+  Eigen::Matrix3d RK_inv = R_c2_c1 * K_inv;
+  ransac_index_.clear();
+  ransac_prev_.clear();
+  ransac_new_.clear();
+  ransac_normals_.clear();
+  for (int i = 0; i < new_features_.size(); i++)
+  {
+    if (status_[i] == 0)
+      continue;
+    ransac_index_.push_back(i);
+    ransac_prev_.push_back(RK_inv * Eigen::Vector3d(prev_features_[i].x, prev_features_[i].y, 1.0));
+    ransac_new_.push_back(K_inv * Eigen::Vector3d(new_features_[i].x, new_features_[i].y, 1.0));
+    ransac_normals_.push_back(ransac_prev_.back().cross(ransac_new_.back()));
+  }
+  int n = ransac_index_.size();
+  if (n < 5)
+    return;
+  
+  // With the rotation known, the translation is perpendicular to every track's epipolar plane,
+  // so two tracks give its direction.  Score it by how many tracks are within the threshold of
+  // their epipolar line (a static point that only rotated is on every line).
+  double threshold = ransac_threshold_ / (0.5 * (K_(0,0) + K_(1,1)));
+  inliers_.resize(n);
+  best_inliers_.resize(n);
+  int best_count = -1;
+  int iterations = ransac_iterations_;
+  for (int it = 0; it < iterations; it++)
+  {
+    int a = ransac_rng_.uniform(0, n);
+    int b = ransac_rng_.uniform(0, n - 1);
+    if (b >= a)
+      b++;
+    Eigen::Vector3d t = ransac_normals_[a].cross(ransac_normals_[b]);
+    double norm = t.norm();
+    if (norm < 1e-12)
+      continue;
+    t /= norm;
+    
+    int count = 0;
+    for (int j = 0; j < n; j++)
+    {
+      Eigen::Vector3d line = t.cross(ransac_prev_[j]);
+      double scale = line.head<2>().norm();
+      inliers_[j] = scale > 1e-12 && std::abs(ransac_new_[j].dot(line)) < threshold * scale;
+      count += inliers_[j];
+    }
+    if (count > best_count)
     {
-      ids_.push_back(next_feature_id_++);
+      best_count = count;
+      std::swap(inliers_, best_inliers_);
+      // Enough samples to draw two inliers with 99% confidence
+      double p_outlier_pair = 1.0 - ((double)count / n) * ((double)count / n);
+      if (p_outlier_pair < 1e-9)
+        break;
+      iterations = std::min(ransac_iterations_, (int)std::ceil(std::log(0.01) / std::log(p_outlier_pair)));
     }
-    prev_image_ = grey_img;
+  }
+  if (best_count < 0)
+    return;
+  
+  for (int j = 0; j < n; j++)
+  {
+    if (!best_inliers_[j])
+      status_[ransac_index_[j]] = 0;
+  }
+}
+
+void KLT_Tracker::track(const Mat& img, const Eigen::Matrix3d* R_c2_c1, std::vector<Point2f> &features, std::vector<int> &ids, OutputArray& output)
+{
+  auto start = std::chrono::steady_clock::now();
+  finish_detection();
+  
+  // Everything below writes into buffers kept from the last frame, so once the sizes settle
+  // tracking a frame doesn't allocate
+  const Mat* src = &img;
+  if (scale_level_ > 0)
+  {
+    resize(img, small_img_, Size(img.cols >> scale_level_, img.rows >> scale_level_), 0, 0, INTER_AREA);
+    src = &small_img_;
+  }
+  if (src->channels() > 1)
+  {
+    cvtColor(*src, grey_img_, COLOR_BGR2GRAY);
+  }
+  const Mat& grey_img = (src->channels() > 1) ? grey_img_ : *src;
+  int levels = std::max(pyramid_levels_ - scale_level_, 0);
+  buildOpticalFlowPyramid(grey_img, pyramid_, window_size_, levels);
+  
+  // The scale changed since the last frame, so bring that frame to the new one
+  if (initialized_ && prev_pyramid_[0].size() != grey_img.size())
+  {
+    Mat prev_img;
+    resize(prev_pyramid_[0], prev_img, grey_img.size(), 0, 0, INTER_AREA);
+    buildOpticalFlowPyramid(prev_img, prev_pyramid_, window_size_, levels);
+  }
+  
+  bool start_async = false;
+  if (!initialized_)
+  {
+    new_features_.clear();
+    ids_.clear();
+    grid_clear();
+    detect_features(grey_img);
+    frames_since_detect_ = 0;
     initialized_ = true;
     prev_features_.resize(new_features_.size());
   }
   
   else
   {
-    vector<uchar> status;
-    vector<float> err;
-    calcOpticalFlowPyrLK(prev_image_, grey_img, prev_features_, new_features_, status, err);
+    int flags = 0;
+    if (R_c2_c1 && gyro_prediction_)
+    {
+      // Under a pure rotation the pixels move by the homography K R K^-1
+      Eigen::Matrix3d H = K_ * (*R_c2_c1) * K_.inverse();
+      for (int i = 0; i < prev_features_.size(); i++)
+      {
+        Eigen::Vector3d p = H * Eigen::Vector3d(prev_features_[i].x, prev_features_[i].y, 1.0);
+        if (p(2) > 1e-6)
+          new_features_[i] = Point2f(p(0) / p(2), p(1) / p(2));
+        else
+          new_features_[i] = prev_features_[i];
+      }
+      flags = OPTFLOW_USE_INITIAL_FLOW;
+    }
+    if (scale_level_ > 0)
+    {
+      // Track on the scaled down image, then refine at full resolution if the last frame's
+      // tiles are there (they aren't right after the scale leaves full resolution)
+      scaled_prev_features_.resize(prev_features_.size());
+      scaled_features_.resize(prev_features_.size());
+      for (int i = 0; i < prev_features_.size(); i++)
+      {
+        scaled_prev_features_[i] = to_scaled(prev_features_[i]);
+        scaled_features_[i] = to_scaled(new_features_[i]);
+      }
+      calcOpticalFlowPyrLK(prev_pyramid_, pyramid_, scaled_prev_features_, scaled_features_, status_, err_, window_size_, levels,
+                           TermCriteria(TermCriteria::COUNT+TermCriteria::EPS, 30, 0.01), flags);
+      if (fb_threshold_ > 0.0)
+        check_forward_backward(scaled_prev_features_, scaled_features_, levels, fb_threshold_ / (1 << scale_level_));
+      for (int i = 0; i < scaled_features_.size(); i++)
+        new_features_[i] = to_full(scaled_features_[i]);
+      if (prev_tile_index_.size() == prev_features_.size() && !prev_features_.empty())
+        refine_features(img);
+    }
+    else
+    {
+      calcOpticalFlowPyrLK(prev_pyramid_, pyramid_, prev_features_, new_features_, status_, err_, window_size_, levels,
+                           TermCriteria(TermCriteria::COUNT+TermCriteria::EPS, 30, 0.01), flags);
+      if (fb_threshold_ > 0.0)
+        check_forward_backward(prev_features_, new_features_, levels, fb_threshold_);
+    }
+    if (R_c2_c1 && ransac_threshold_ > 0.0)
+      reject_outliers(*R_c2_c1);
     
-    // Keep only good points
-    deque<int> good_ids;
+    // Keep only good points (going from the back, so on a conflict the later point wins)
+    grid_clear();
     for (int i = prev_features_.size()-1; i >= 0; i--)
     {
       // If we found a match and the match is in the image
       double new_x = new_features_[i].x;
       double new_y = new_features_[i].y;
-      if (status[i] == 0 || new_x <= 1.0 || new_y <= 1.0 || new_x >= img.cols-1.0 || new_y >= img.rows-1.0 || mask_.at<uint8_t>(cv::Point(round(new_x), round(new_y))) != 255)
+      if (status_[i] == 0 || new_x <= 1.0 || new_y <= 1.0 || new_x >= img.cols-1.0 || new_y >= img.rows-1.0 || mask_.at<uint8_t>(cv::Point(round(new_x), round(new_y))) != 255)
       {
-        new_features_.erase(new_features_.begin() + i);
-        ids_.erase(ids_.begin() + i);
+        status_[i] = 0;
         continue;
       }
       
       // Make sure that it's not too close to other points
-      bool good_point = true;
-      for (auto it = good_ids.begin(); it != good_ids.end(); it++)
+      if (grid_near(new_features_[i]))
       {
-        double dx = new_features_[*it].x - new_x;
-        double dy = new_features_[*it].y - new_y;
-        if (std::sqrt(dx*dx + dy*dy) < feature_nearby_radius_)
-        {
-          good_point = false;
-          new_features_.erase(new_features_.begin() + i);
-          ids_.erase(ids_.begin() + i);
-          break;
-        }
+        status_[i] = 0;
+        continue;
       }
-      if (good_point)
-        good_ids.push_back(i);
+      grid_insert(new_features_[i]);
+    }
+    
+    // Compact in place, keeping the order (the youngest tracks stay at the back)
+    int num_kept = 0;
+    for (int i = 0; i < new_features_.size(); i++)
+    {
+      if (status_[i] == 0)
+        continue;
+      new_features_[num_kept] = new_features_[i];
+      ids_[num_kept] = ids_[i];
+      num_kept++;
     }
+    new_features_.resize(num_kept);
+    ids_.resize(num_kept);
     
-    // If we are missing points, collect new ones
+    // If we are missing points, collect new ones, unless it's too soon since the last search
+    // and there are enough left
+    frames_since_detect_++;
     if (new_features_.size() < num_features_)
     {
-      // create a mask around current points
-      Mat point_mask;
-      mask_.copyTo(point_mask);
-      for (int i = 0; i < new_features_.size(); i++)
-      {
-        circle(point_mask, new_features_[i], feature_nearby_radius_, 0, -1, 0);
-      }
-      
-      // Now find a bunch of points, not in the mask
-      int num_new_features = num_features_ - new_features_.size();
-      vector<Point2f> new_corners;
-      goodFeaturesToTrack(grey_img, new_corners, num_new_features, 0.3, feature_nearby_radius_, point_mask, 7);
-
-      for (int i = 0; i < new_corners.size(); i++)
+      bool due = (detect_interval_ > 0 && frames_since_detect_ >= detect_interval_)
+                 || new_features_.size() < detect_fill_ * num_features_;
+      if (due)
       {
-        new_features_.push_back(new_corners[i]);
-        ids_.push_back(next_feature_id_++);
+        frames_since_detect_ = 0;
+        if (detect_async_)
+          start_async = true;
+        else
+          detect_features(grey_img);
       }
     }
+    // If the feature budget was lowered, drop the youngest tracks (they are at the back)
+    else if (new_features_.size() > num_features_)
+    {
+      new_features_.resize(num_features_);
+      ids_.resize(num_features_);
+    }
   }
   
   if (plot_matches_)
   {
-    Mat color_img;
-    cvtColor(grey_img, color_img, COLOR_GRAY2BGR);
-    // draw features and ids
+    cvtColor(grey_img, color_img_, COLOR_GRAY2BGR);
+    // draw features and ids (on the image that was tracked, which may be scaled down)
     for (int i = 0; i < new_features_.size(); i++)
     {
-      Scalar color = colors_[ids_[i] % num_features_];
-      circle(color_img, new_features_[i], 5, color, -1);
-      putText(color_img, to_string(ids_[i]), new_features_[i], FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0, 255, 0));
+      Scalar color = colors_[ids_[i] % colors_.size()];
+      circle(color_img_, to_scaled(new_features_[i]), 5, color, -1);
+      putText(color_img_, to_string(ids_[i]), to_scaled(new_features_[i]), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0, 255, 0));
     }
-    color_img.copyTo(output);
+    color_img_.copyTo(output);
   }
   
   // Save off measurements for output
@@ -164,7 +780,24 @@ void KLT_Tracker::load_image(const Mat& img, double t, std::vector<Point2f> &fea
   }
   
   // get ready for next iteration
-  prev_image_ = grey_img;
+  std::swap(pyramid_, prev_pyramid_);
   std::swap(new_features_, prev_features_);
   new_features_.resize(prev_features_.size());
+  if (start_async)
+    start_detection();
+  
+  if (max_scale_level_ > 0)
+  {
+    // Pick the next frame's scale from how long this one took, and keep the tiles around this
+    // frame's points if the next one won't be tracked at full resolution
+    if (resolution_budget_.enabled())
+    {
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      scale_level_ = max_scale_level_ - resolution_budget_.update(ms);
+    }
+    if (scale_level_ > 0)
+      cut_prev_tiles(img);
+    else
+      prev_tile_index_.clear();
+  }
 }
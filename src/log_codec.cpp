@@ -0,0 +1,156 @@
+#include "log_codec.h"
+
+#include <cstring>
+
+namespace vi_ekf
+{
+
+namespace
+{
+// Row header: sequence number, keyframe flag, number of values
+struct row_header_t
+{
+  uint32_t seq;
+  uint32_t n;
+  uint8_t key;
+} __attribute__((packed));
+
+inline int leading_zero_bytes(const uint64_t x) { return __builtin_clzll(x) / 8; }
+inline int trailing_zero_bytes(const uint64_t x) { return __builtin_ctzll(x) / 8; }
+}
+
+DeltaCodec::DeltaCodec(const int keyframe_interval) :
+  keyframe_interval_(keyframe_interval > 0 ? keyframe_interval : 1)
+{
+  reset();
+}
+
+void DeltaCodec::reset()
+{
+  seq_ = 0;
+  have_ref_ = false;
+  prev_.clear();
+}
+
+void DeltaCodec::encode(const double *row, const int n, std::vector<char> &out)
+{
+  bool key = (seq_ % keyframe_interval_ == 0) || (int)prev_.size() != n;
+  if (key)
+    prev_.assign(n, 0);
+
+  row_header_t header = {seq_++, (uint32_t)n, (uint8_t)key};
+  out.insert(out.end(), (const char*)&header, (const char*)&header + sizeof(header));
+
+  int run = 0;
+  for (int i = 0; i < n; i++)
+  {
+    uint64_t bits;
+    memcpy(&bits, row + i, sizeof(bits));
+    uint64_t x = bits ^ prev_[i];
+    prev_[i] = bits;
+
+    if (x == 0)
+    {
+      if (++run == 128)
+      {
+        out.push_back((char)(0x80 | (run - 1)));
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0)
+    {
+      out.push_back((char)(0x80 | (run - 1)));
+      run = 0;
+    }
+
+    // Only leading zeros up to 7 bytes fit in the control byte (x != 0 so there are at most 7)
+    int lz = leading_zero_bytes(x);
+    int tz = trailing_zero_bytes(x);
+    int len = 8 - lz - tz;
+    out.push_back((char)((lz << 4) | len));
+    x >>= 8 * tz;
+    for (int b = 0; b < len; b++)
+    {
+      out.push_back((char)(x & 0xff));
+      x >>= 8;
+    }
+  }
+  if (run > 0)
+    out.push_back((char)(0x80 | (run - 1)));
+}
+
+bool DeltaCodec::decode(const char *data, const size_t bytes, std::vector<double> &row)
+{
+  row_header_t header;
+  if (bytes < sizeof(header))
+    return false;
+  memcpy(&header, data, sizeof(header));
+
+  // A delta row needs the row right before it
+  if (!header.key && (!have_ref_ || header.seq != seq_ + 1 || prev_.size() != header.n))
+  {
+    have_ref_ = false;
+    return false;
+  }
+  if (header.key)
+    prev_.assign(header.n, 0);
+
+  const unsigned char* p = (const unsigned char*)data + sizeof(header);
+  const unsigned char* end = (const unsigned char*)data + bytes;
+  uint32_t i = 0;
+  while (i < header.n)
+  {
+    if (p >= end)
+    {
+      have_ref_ = false;
+      return false;
+    }
+    unsigned char c = *p++;
+    if (c & 0x80)
+    {
+      // unchanged values
+      i += (c & 0x7f) + 1;
+      continue;
+    }
+    int lz = c >> 4;
+    int len = c & 0x0f;
+    int tz = 8 - lz - len;
+    if (len < 1 || tz < 0 || p + len > end)
+    {
+      have_ref_ = false;
+      return false;
+    }
+    uint64_t x = 0;
+    for (int b = len - 1; b >= 0; b--)
+      x = (x << 8) | p[b];
+    p += len;
+    prev_[i++] ^= (x << (8 * tz));
+  }
+  if (i != header.n)
+  {
+    have_ref_ = false;
+    return false;
+  }
+
+  seq_ = header.seq;
+  have_ref_ = true;
+  row.resize(header.n);
+  memcpy(row.data(), prev_.data(), sizeof(double) * header.n);
+  return true;
+}
+
+void unpack_upper_triangle(const double *tri, const int n, double *dense)
+{
+  for (int i = 0; i < n; i++)
+  {
+    for (int j = i; j < n; j++)
+    {
+      dense[i * n + j] = *tri;
+      dense[j * n + i] = *tri;
+      tri++;
+    }
+  }
+}
+
+}
@@ -0,0 +1,204 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <cstdlib>
+
+#include "log_reader.h"
+
+using namespace vi_ekf;
+
+// Inspects and converts logs written by ColumnarLogWriter
+//
+// <log> is either one segment file, or the segment base name (e.g. logs/log for logs/log_0000.vlog, ...)
+//
+//   vi_ekf_log_convert <log> info                  schema and per-channel row counts
+//   vi_ekf_log_convert <log> csv <channel> [out]   one channel as CSV (stdout by default), an
+//                                                  upper-triangle channel (COV) one entry per column
+//   vi_ekf_log_convert <log> legacy <dir>          the old per-channel .bin files and conf.txt
+
+void usage()
+{
+  std::cerr << "usage: vi_ekf_log_convert <log> info\n"
+            << "       vi_ekf_log_convert <log> csv <channel> [out.csv]\n"
+            << "       vi_ekf_log_convert <log> legacy <dir>\n";
+}
+
+int info(LogReader& reader)
+{
+  const LogSchema& schema = reader.schema();
+  std::map<int, long> rows;
+  std::map<int, double> t_begin, t_end;
+  LogBlock block;
+  while (reader.next_block_header(block))
+  {
+    if (rows.count(block.channel) == 0)
+      t_begin[block.channel] = block.t_begin;
+    rows[block.channel] += block.rows;
+    t_end[block.channel] = block.t_end;
+  }
+
+  std::cout << "capacity: " << schema.capacity << " features\n";
+  for (auto ch = schema.channels.begin(); ch != schema.channels.end(); ch++)
+  {
+    std::cout << std::setw(12) << std::left << ch->name << std::setw(6) << std::right << ch->columns.size()
+              << (ch->upper_triangle ? " upper   " : " columns ") << std::setw(10) << rows[ch->id] << " rows";
+    if (rows[ch->id] > 0)
+      std::cout << "  t = [" << t_begin[ch->id] << ", " << t_end[ch->id] << "]";
+    std::cout << "\n";
+  }
+  for (auto note = schema.notes.begin(); note != schema.notes.end(); note++)
+  {
+    std::cout << "  " << *note << "\n";
+  }
+  return 0;
+}
+
+int csv(LogReader& reader, const std::string& name, std::ostream& out)
+{
+  const LogChannel* ch = reader.schema().find_channel(name);
+  if (ch == nullptr)
+  {
+    std::cerr << "no channel named " << name << "\n";
+    return 1;
+  }
+  if (ch->upper_triangle)
+  {
+    // t, then one column per entry of the upper triangle
+    out << ch->columns[0].name << " [" << ch->columns[0].unit << "]";
+    for (int i = 1; i < (int)ch->columns.size(); i++)
+      for (int j = i; j < (int)ch->columns.size(); j++)
+        out << ",(" << ch->columns[i].name << " " << ch->columns[j].name << ")";
+  }
+  else
+  {
+    for (int c = 0; c < (int)ch->columns.size(); c++)
+    {
+      out << (c > 0 ? "," : "") << ch->columns[c].name;
+      if (!ch->columns[c].unit.empty())
+        out << " [" << ch->columns[c].unit << "]";
+    }
+  }
+  out << "\n" << std::setprecision(17);
+
+  LogBlock block;
+  while (reader.next_block(block, ch->id))
+  {
+    for (int r = 0; r < block.rows; r++)
+    {
+      for (int c = 0; c < block.cols; c++)
+      {
+        out << (c > 0 ? "," : "") << block.at(r, c);
+      }
+      out << "\n";
+    }
+  }
+  return 0;
+}
+
+// Writes the layout the matlab scripts read: raw rows of doubles per channel, and the
+// measurements trimmed to their dimension with the id only on the feature measurements
+int legacy(LogReader& reader, const std::string& dir)
+{
+  static const std::map<std::string, std::string> file_names = {
+    {"STATE", "prop.bin"}, {"FEATURE_IDS", "feat_id.bin"}, {"INPUT", "input.bin"},
+    {"XDOT", "xdot.bin"}, {"GLOBAL", "global.bin"}};
+  static const char* feature_meas[] = {"FEAT", "QZETA", "DEPTH", "INV_DEPTH", "PIXEL_VEL"};
+
+  int result = system(("mkdir -p " + dir).c_str());
+  (void)result;
+
+  const LogSchema& schema = reader.schema();
+  std::ofstream conf(dir + "/conf.txt");
+  for (auto note = schema.notes.begin(); note != schema.notes.end(); note++)
+  {
+    conf << *note << "\n";
+  }
+
+  std::map<int, std::unique_ptr<std::ofstream>> files;
+  std::map<int, bool> is_meas, has_id;
+  for (auto ch = schema.channels.begin(); ch != schema.channels.end(); ch++)
+  {
+    auto it = file_names.find(ch->name);
+    std::string file = (it != file_names.end()) ? it->second : ch->name + ".bin";
+    files[ch->id].reset(new std::ofstream(dir + "/" + file, std::ofstream::binary));
+    is_meas[ch->id] = (ch->find_column("dim") == 1);
+    has_id[ch->id] = false;
+    for (auto f : feature_meas)
+    {
+      if (ch->name == f)
+        has_id[ch->id] = true;
+    }
+  }
+
+  LogBlock block;
+  std::vector<double> row;
+  while (reader.next_block(block))
+  {
+    if (files.count(block.channel) == 0)
+      continue;
+    std::ofstream& file = *files[block.channel];
+    for (int r = 0; r < block.rows; r++)
+    {
+      row.clear();
+      if (is_meas[block.channel])
+      {
+        // t, dim, z[max_dim], zhat[max_dim], active, id
+        int max_dim = (block.cols - 4) / 2;
+        int dim = block.at(r, 1);
+        row.push_back(block.at(r, 0));
+        for (int i = 0; i < dim; i++)
+          row.push_back(block.at(r, 2 + i));
+        for (int i = 0; i < dim; i++)
+          row.push_back(block.at(r, 2 + max_dim + i));
+        row.push_back(block.at(r, 2 + 2*max_dim));
+        if (has_id[block.channel])
+          row.push_back(block.at(r, 3 + 2*max_dim));
+      }
+      else
+      {
+        for (int c = 0; c < block.cols; c++)
+          row.push_back(block.at(r, c));
+      }
+      file.write((const char*)row.data(), sizeof(double) * row.size());
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc < 3)
+  {
+    usage();
+    return 1;
+  }
+
+  LogReader reader;
+  std::string log = argv[1];
+  bool is_file = log.size() > 5 && log.compare(log.size() - 5, 5, ".vlog") == 0;
+  if (!(is_file ? reader.open(log) : reader.open_segments(log)))
+  {
+    std::cerr << "could not read " << argv[1] << "\n";
+    return 1;
+  }
+
+  std::string cmd = argv[2];
+  if (cmd == "info")
+    return info(reader);
+  else if (cmd == "csv" && argc >= 4)
+  {
+    if (argc >= 5)
+    {
+      std::ofstream out(argv[4]);
+      return csv(reader, argv[3], out);
+    }
+    return csv(reader, argv[3], std::cout);
+  }
+  else if (cmd == "legacy" && argc >= 4)
+    return legacy(reader, argv[3]);
+
+  usage();
+  return 1;
+}
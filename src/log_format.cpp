@@ -0,0 +1,138 @@
+#include "log_format.h"
+
+#include <sstream>
+
+namespace vi_ekf
+{
+
+void LogChannel::add_column(const std::string &name, const std::string &unit)
+{
+  columns.push_back({name, unit});
+}
+
+int LogChannel::row_width() const
+{
+  if (!upper_triangle)
+    return columns.size();
+  int n = columns.size() - 1;
+  return 1 + n * (n + 1) / 2;
+}
+
+int LogChannel::find_column(const std::string &name) const
+{
+  for (int i = 0; i < (int)columns.size(); i++)
+  {
+    if (columns[i].name == name)
+      return i;
+  }
+  return -1;
+}
+
+LogChannel& LogSchema::add_channel(const int id, const std::string &name, const bool upper_triangle)
+{
+  channels.push_back(LogChannel());
+  channels.back().id = id;
+  channels.back().name = name;
+  channels.back().upper_triangle = upper_triangle;
+  channels.back().add_column("t", "s");
+  return channels.back();
+}
+
+const LogChannel* LogSchema::find_channel(const int id) const
+{
+  for (auto it = channels.begin(); it != channels.end(); it++)
+  {
+    if (it->id == id)
+      return &(*it);
+  }
+  return nullptr;
+}
+
+const LogChannel* LogSchema::find_channel(const std::string &name) const
+{
+  for (auto it = channels.begin(); it != channels.end(); it++)
+  {
+    if (it->name == name)
+      return &(*it);
+  }
+  return nullptr;
+}
+
+std::string LogSchema::serialize() const
+{
+  std::stringstream ss;
+  ss << "capacity " << capacity << "\n";
+  for (auto ch = channels.begin(); ch != channels.end(); ch++)
+  {
+    ss << "channel " << ch->id << " " << ch->name << " " << ch->columns.size();
+    if (ch->upper_triangle)
+      ss << " upper";
+    ss << "\n";
+    for (auto col = ch->columns.begin(); col != ch->columns.end(); col++)
+    {
+      ss << "column " << col->name << " " << (col->unit.empty() ? "-" : col->unit) << "\n";
+    }
+  }
+  for (auto note = notes.begin(); note != notes.end(); note++)
+  {
+    ss << "note " << *note << "\n";
+  }
+  ss << "end\n";
+  return ss.str();
+}
+
+bool LogSchema::parse(const std::string &text)
+{
+  channels.clear();
+  notes.clear();
+  capacity = 0;
+
+  std::stringstream ss(text);
+  std::string line;
+  while (std::getline(ss, line))
+  {
+    std::stringstream ls(line);
+    std::string key;
+    ls >> key;
+    if (key == "capacity")
+    {
+      ls >> capacity;
+    }
+    else if (key == "channel")
+    {
+      int id, num_columns;
+      std::string name;
+      if (!(ls >> id >> name >> num_columns))
+        return false;
+      LogChannel ch;
+      std::string layout;
+      ch.id = id;
+      ch.name = name;
+      ch.upper_triangle = (ls >> layout) && layout == "upper";
+      ch.columns.reserve(num_columns);
+      channels.push_back(ch);
+    }
+    else if (key == "column")
+    {
+      std::string name, unit;
+      if (channels.empty() || !(ls >> name >> unit))
+        return false;
+      channels.back().add_column(name, (unit == "-") ? "" : unit);
+    }
+    else if (key == "note")
+    {
+      notes.push_back(line.size() > 5 ? line.substr(5) : "");
+    }
+    else if (key == "end")
+    {
+      return true;
+    }
+    else if (!key.empty())
+    {
+      return false;
+    }
+  }
+  return false;
+}
+
+}
@@ -0,0 +1,199 @@
+#include "log_reader.h"
+#include "log_segments.h"
+
+#include <cstring>
+
+namespace vi_ekf
+{
+
+bool LogReader::open(const std::string &filename)
+{
+  files_.assign(1, filename);
+  codecs_.clear();
+  return open_file(0);
+}
+
+bool LogReader::open_segments(const std::string &base)
+{
+  files_.clear();
+  while (true)
+  {
+    std::string name = LogSegmentWriter::segment_name(base, files_.size());
+    std::ifstream test(name);
+    if (!test.is_open())
+      break;
+    files_.push_back(name);
+  }
+  codecs_.clear();
+  return !files_.empty() && open_file(0);
+}
+
+bool LogReader::open_file(const int index)
+{
+  file_index_ = index;
+  file_.close();
+  file_.clear();
+  file_.open(files_[index], std::ifstream::in | std::ifstream::binary);
+  if (!file_.is_open())
+    return false;
+
+  char magic[sizeof(LOG_MAGIC)];
+  uint32_t version, len;
+  file_.read(magic, sizeof(magic));
+  file_.read((char*)&version, sizeof(version));
+  file_.read((char*)&len, sizeof(len));
+  if (!file_ || memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0 || version > LOG_VERSION)
+    return false;
+
+  std::string text(len, '\0');
+  file_.read(&text[0], len);
+  return file_ && schema_.parse(text);
+}
+
+void LogReader::rewind()
+{
+  codecs_.clear();
+  open_file(0);
+}
+
+bool LogReader::read_header(LogBlockHeader &header)
+{
+  while (true)
+  {
+    file_.read((char*)&header, sizeof(header));
+    // The end of a segment (or a block cut short by a crash) moves on to the next segment
+    if (file_.gcount() == sizeof(header) && (header.magic == LOG_BLOCK_MAGIC || header.magic == LOG_PACKED_BLOCK_MAGIC))
+      return true;
+    if (file_index_ + 1 >= (int)files_.size() || !open_file(file_index_ + 1))
+      return false;
+  }
+}
+
+bool LogReader::next_block_header(LogBlock &block, const int channel)
+{
+  return next(block, channel, false);
+}
+
+bool LogReader::next_block(LogBlock &block, const int channel)
+{
+  return next(block, channel, true);
+}
+
+bool LogReader::next(LogBlock &block, const int channel, const bool read_data)
+{
+  LogBlockHeader header;
+  while (read_header(header))
+  {
+    bool packed = (header.magic == LOG_PACKED_BLOCK_MAGIC);
+    std::streamoff bytes = packed ? header.cols : sizeof(double) * header.rows * header.cols;
+    if (channel < 0 || (int)header.channel == channel)
+    {
+      block.channel = header.channel;
+      block.rows = header.rows;
+      block.cols = packed ? 0 : header.cols;
+      block.t_begin = header.t_begin;
+      block.t_end = header.t_end;
+      if (!read_data)
+      {
+        block.data.clear();
+        file_.seekg(bytes, std::ios::cur);
+        return true;
+      }
+      if (packed)
+      {
+        packed_.resize(bytes);
+        file_.read(packed_.data(), bytes);
+        if (file_.gcount() != bytes)
+          return false;
+        if (!codecs_[header.channel].decode(packed_.data(), bytes, block.data))
+        {
+          undecodable_rows_++;
+          continue;
+        }
+        block.rows = 1;
+        block.cols = block.data.size();
+        return true;
+      }
+      block.data.resize(header.rows * header.cols);
+      file_.read((char*)block.data.data(), bytes);
+      return file_.gcount() == bytes;
+    }
+    file_.seekg(bytes, std::ios::cur);
+  }
+  return false;
+}
+
+bool LogReader::read_channel(const std::string &name, std::vector<std::vector<double>> &columns,
+                             const std::vector<int> &which)
+{
+  const LogChannel* ch = schema_.find_channel(name);
+  if (ch == nullptr)
+    return false;
+
+  // Upper-triangle channels have more values per row than named columns
+  const int width = ch->row_width();
+  std::vector<int> cols = which;
+  if (cols.empty())
+  {
+    for (int c = 0; c < width; c++)
+      cols.push_back(c);
+  }
+  for (int i = 0; i < (int)cols.size(); i++)
+  {
+    if (cols[i] < 0 || cols[i] >= width)
+      return false;
+  }
+  columns.clear();
+  columns.resize(cols.size());
+
+  rewind();
+  if (ch->upper_triangle)
+  {
+    // Every row has to be decoded in order
+    LogBlock block;
+    while (next_block(block, ch->id))
+    {
+      for (int i = 0; i < (int)cols.size(); i++)
+      {
+        if (cols[i] < 0 || cols[i] >= block.cols)
+          return false;
+        columns[i].push_back(block.data[cols[i]]);
+      }
+    }
+    file_.clear();
+    return true;
+  }
+
+  LogBlockHeader header;
+  while (read_header(header))
+  {
+    std::streamoff bytes = (header.magic == LOG_PACKED_BLOCK_MAGIC) ? header.cols
+                                                                     : sizeof(double) * header.rows * header.cols;
+    std::streampos start = file_.tellg();
+    if ((int)header.channel == ch->id)
+    {
+      for (int i = 0; i < (int)cols.size(); i++)
+      {
+        if (cols[i] < 0 || cols[i] >= (int)header.cols)
+          return false;
+        std::vector<double>& out = columns[i];
+        size_t n = out.size();
+        out.resize(n + header.rows);
+        file_.seekg(start + (std::streamoff)(sizeof(double) * header.rows * cols[i]));
+        file_.read((char*)(out.data() + n), sizeof(double) * header.rows);
+        if (file_.gcount() != (std::streamsize)(sizeof(double) * header.rows))
+        {
+          // Truncated block, keep what was complete
+          out.resize(n);
+          file_.clear();
+          return true;
+        }
+      }
+    }
+    file_.seekg(start + bytes);
+  }
+  file_.clear();
+  return true;
+}
+
+}
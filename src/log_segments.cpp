@@ -0,0 +1,171 @@
+#include "log_segments.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace vi_ekf
+{
+
+LogSegmentWriter::LogSegmentWriter(const std::string &base, const size_t segment_bytes, const std::string &header) :
+  base_(base),
+  segment_bytes_(segment_bytes),
+  header_(header),
+  failed_(false),
+  active_index_(0),
+  want_spare_(true),
+  have_spare_(false),
+  spare_index_(1),
+  stop_(false)
+{
+  // Leave room for at least a few blocks after the header
+  if (segment_bytes_ < header_.size() + (1 << 20))
+    segment_bytes_ = header_.size() + (1 << 20);
+
+  // Segment 0 is truncated below, but a longer earlier run into the same base leaves higher
+  // numbered segments behind that the reader would append to this log
+  for (int i = 1; unlink(segment_name(base_, i).c_str()) == 0; i++) {}
+
+  failed_ = !create(active_index_, segment_bytes_, active_);
+  want_spare_ = !failed_;
+  thread_ = std::thread(&LogSegmentWriter::run, this);
+}
+
+LogSegmentWriter::~LogSegmentWriter()
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (active_.data)
+      full_.push_back(active_);
+    active_ = segment_t();
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+
+  // The spare was never written to, so it isn't part of the log
+  if (have_spare_)
+  {
+    munmap(spare_.data, spare_.size);
+    close(spare_.fd);
+    unlink(segment_name(base_, spare_index_).c_str());
+  }
+}
+
+std::string LogSegmentWriter::segment_name(const std::string &base, const int index)
+{
+  char num[16];
+  snprintf(num, sizeof(num), "_%04d.vlog", index);
+  return base + num;
+}
+
+bool LogSegmentWriter::create(const int index, const size_t size, segment_t &seg)
+{
+  std::string name = segment_name(base_, index);
+  seg.fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (seg.fd < 0)
+    return false;
+
+  // Allocate the blocks up front so writing never has to grow the file
+  if (posix_fallocate(seg.fd, 0, size) != 0 && ftruncate(seg.fd, size) != 0)
+  {
+    close(seg.fd);
+    return false;
+  }
+  void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0);
+  if (data == MAP_FAILED)
+  {
+    close(seg.fd);
+    return false;
+  }
+  seg.data = (char*)data;
+  seg.size = size;
+  memcpy(seg.data, header_.data(), header_.size());
+  seg.used = header_.size();
+  return true;
+}
+
+void LogSegmentWriter::seal(segment_t &seg)
+{
+  // Write it back, then cut off the unused preallocated tail
+  msync(seg.data, seg.used, MS_SYNC);
+  munmap(seg.data, seg.size);
+  if (ftruncate(seg.fd, seg.used) == 0)
+    fsync(seg.fd);
+  close(seg.fd);
+}
+
+char* LogSegmentWriter::reserve(const size_t bytes)
+{
+  if (failed_ || bytes > capacity())
+    return nullptr;
+
+  if (active_.used + bytes > active_.size)
+  {
+    // Swap in the preallocated segment and hand the full one to the background thread
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait(lock, [this]{ return have_spare_ || !want_spare_; });
+    if (!have_spare_)
+    {
+      failed_ = true;
+      return nullptr;
+    }
+    full_.push_back(active_);
+    active_ = spare_;
+    active_index_ = spare_index_;
+    have_spare_ = false;
+    want_spare_ = true;
+    spare_index_ = active_index_ + 1;
+    lock.unlock();
+    cv_.notify_all();
+  }
+
+  char* out = active_.data + active_.used;
+  active_.used += bytes;
+  return out;
+}
+
+void LogSegmentWriter::flush()
+{
+  if (active_.data)
+    msync(active_.data, active_.used, MS_ASYNC);
+}
+
+void LogSegmentWriter::run()
+{
+  std::unique_lock<std::mutex> lock(mtx_);
+  while (true)
+  {
+    cv_.wait(lock, [this]{ return stop_ || !full_.empty() || want_spare_; });
+
+    if (!full_.empty())
+    {
+      segment_t seg = full_.front();
+      full_.pop_front();
+      lock.unlock();
+      seal(seg);
+      lock.lock();
+    }
+    else if (want_spare_ && !stop_)
+    {
+      int index = spare_index_;
+      lock.unlock();
+      segment_t seg;
+      bool ok = create(index, segment_bytes_, seg);
+      lock.lock();
+      want_spare_ = false;
+      have_spare_ = ok;
+      if (ok)
+        spare_ = seg;
+      cv_.notify_all();
+    }
+    else if (stop_)
+    {
+      return;
+    }
+  }
+}
+
+}
@@ -0,0 +1,144 @@
+#include "log_writer.h"
+
+#include <cstring>
+#include <algorithm>
+
+namespace vi_ekf
+{
+
+ColumnarLogWriter::ColumnarLogWriter(const std::string &base, const LogSchema &schema, const size_t segment_bytes,
+                                     const int rows_per_block, const int keyframe_interval) :
+  rows_per_block_(std::max(rows_per_block, 1)),
+  rejected_records_(0)
+{
+  // Every segment starts with the magic, version and schema
+  std::string text = schema.serialize();
+  uint32_t len = text.size();
+  std::string header(LOG_MAGIC, sizeof(LOG_MAGIC));
+  header.append((const char*)&LOG_VERSION, sizeof(LOG_VERSION));
+  header.append((const char*)&len, sizeof(len));
+  header.append(text);
+  out_.reset(new LogSegmentWriter(base, segment_bytes, header));
+
+  size_t max_cols = 1;
+  for (auto ch = schema.channels.begin(); ch != schema.channels.end(); ch++)
+  {
+    if (!ch->upper_triangle)
+      max_cols = std::max(max_cols, ch->columns.size());
+  }
+  row_.resize(max_cols);
+
+  // A block must fit in a segment
+  int max_rows = (out_->capacity() - sizeof(LogBlockHeader)) / (sizeof(double) * max_cols);
+  rows_per_block_ = std::max(std::min(rows_per_block_, max_rows), 1);
+
+  for (auto ch = schema.channels.begin(); ch != schema.channels.end(); ch++)
+  {
+    if (ch->id >= (int)chunks_.size())
+      chunks_.resize(ch->id + 1);
+    chunk_t& chunk = chunks_[ch->id];
+    chunk.cols = ch->row_width();
+    chunk.upper_triangle = ch->upper_triangle;
+    chunk.codec = DeltaCodec(keyframe_interval);
+    if (!chunk.upper_triangle)
+      chunk.data.resize(rows_per_block_ * chunk.cols);
+  }
+}
+
+ColumnarLogWriter::~ColumnarLogWriter()
+{
+  flush();
+}
+
+void ColumnarLogWriter::write(const int stream, const char *data, const size_t bytes)
+{
+  if (stream < 0 || stream >= (int)chunks_.size() || chunks_[stream].cols == 0
+      || bytes != chunks_[stream].cols * sizeof(double))
+  {
+    rejected_records_++;
+    return;
+  }
+
+  chunk_t& chunk = chunks_[stream];
+  if (chunk.upper_triangle)
+  {
+    write_packed(stream, chunk, data, bytes);
+    return;
+  }
+
+  // Scatter the row into the columns
+  memcpy(row_.data(), data, bytes);
+  for (int c = 0; c < chunk.cols; c++)
+  {
+    chunk.data[c * rows_per_block_ + chunk.rows] = row_[c];
+  }
+  if (++chunk.rows == rows_per_block_)
+    write_block(stream, chunk);
+}
+
+void ColumnarLogWriter::flush()
+{
+  for (int i = 0; i < (int)chunks_.size(); i++)
+  {
+    if (chunks_[i].rows > 0)
+      write_block(i, chunks_[i]);
+  }
+  out_->flush();
+}
+
+void ColumnarLogWriter::write_block(const int channel, chunk_t &chunk)
+{
+  size_t col_bytes = sizeof(double) * chunk.rows;
+  char* out = out_->reserve(sizeof(LogBlockHeader) + col_bytes * chunk.cols);
+  if (out == nullptr)
+  {
+    rejected_records_ += chunk.rows;
+    chunk.rows = 0;
+    return;
+  }
+
+  for (int c = 0; c < chunk.cols; c++)
+  {
+    memcpy(out + sizeof(LogBlockHeader) + c * col_bytes, chunk.data.data() + c * rows_per_block_, col_bytes);
+  }
+
+  // The header goes in last, so a block cut short by a crash has no magic and ends the log
+  LogBlockHeader header;
+  header.magic = LOG_BLOCK_MAGIC;
+  header.channel = channel;
+  header.rows = chunk.rows;
+  header.cols = chunk.cols;
+  header.t_begin = chunk.data[0];
+  header.t_end = chunk.data[chunk.rows - 1];
+  memcpy(out, &header, sizeof(header));
+  chunk.rows = 0;
+}
+
+void ColumnarLogWriter::write_packed(const int channel, chunk_t &chunk, const char *data, const size_t bytes)
+{
+  row_.resize(std::max(row_.size(), (size_t)chunk.cols));
+  memcpy(row_.data(), data, bytes);
+  packed_.clear();
+  chunk.codec.encode(row_.data(), chunk.cols, packed_);
+
+  char* out = out_->reserve(sizeof(LogBlockHeader) + packed_.size());
+  if (out == nullptr)
+  {
+    // The next row can't be coded against this one, so start over with a keyframe
+    chunk.codec.reset();
+    rejected_records_++;
+    return;
+  }
+  memcpy(out + sizeof(LogBlockHeader), packed_.data(), packed_.size());
+
+  LogBlockHeader header;
+  header.magic = LOG_PACKED_BLOCK_MAGIC;
+  header.channel = channel;
+  header.rows = 1;
+  header.cols = packed_.size();
+  header.t_begin = row_[0];
+  header.t_end = row_[0];
+  memcpy(out, &header, sizeof(header));
+}
+
+}
@@ -0,0 +1,197 @@
+#include "rts_smoother.h"
+
+namespace vi_ekf
+{
+
+constexpr double RTSSmoother::MIN_PERIOD;
+
+RTSSmoother::RTSSmoother(const double lag, const double period) :
+  lag_(lag),
+  period_(std::max(period, MIN_PERIOD)),
+  running_(true)
+{
+  thread_ = std::thread(&RTSSmoother::run, this);
+}
+
+RTSSmoother::RTSSmoother(const RTSSmoother& other) :
+  lag_(other.lag_),
+  period_(other.period_),
+  running_(true)
+{
+  {
+    std::lock_guard<std::mutex> lock(other.hist_mtx_);
+    hist_ = other.hist_;
+  }
+  {
+    std::lock_guard<std::mutex> lock(other.result_mtx_);
+    result_ = other.result_;
+  }
+  thread_ = std::thread(&RTSSmoother::run, this);
+}
+
+RTSSmoother::~RTSSmoother()
+{
+  {
+    std::lock_guard<std::mutex> lock(run_mtx_);
+    running_ = false;
+  }
+  run_cv_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+void RTSSmoother::run()
+{
+  while (running_)
+  {
+    {
+      std::unique_lock<std::mutex> lock(run_mtx_);
+      run_cv_.wait_for(lock, std::chrono::duration<double>(period_), [this]{ return !running_; });
+    }
+    if (!running_)
+      break;
+    smooth();
+  }
+}
+
+void RTSSmoother::push_step(const double t_prev, const xVector &x_prev, const dxMatrix &P_prev,
+                            const double t, const dxMatrix &A, const xVector &x_prior, const dxMatrix &P_prior)
+{
+  std::lock_guard<std::mutex> lock(hist_mtx_);
+
+  // If the filter rewound to handle a delayed measurement, throw away the steps it is about to redo
+  while (!hist_.empty() && hist_.back().t > t_prev)
+    hist_.pop_back();
+
+  if (hist_.empty() || hist_.back().t < t_prev)
+  {
+    hist_.emplace_back();
+    hist_.back().t = t_prev;
+    hist_.back().has_prior = false;
+  }
+
+  // The filter is done with the previous step, so its estimate is final
+  record_t& prev = hist_.back();
+  prev.has_post = true;
+  prev.x = x_prev.topRows<VIEKF::xZ>();
+  prev.P = P_prev.topLeftCorner<VIEKF::dxZ, VIEKF::dxZ>();
+
+  hist_.emplace_back();
+  record_t& next = hist_.back();
+  next.t = t;
+  next.has_post = false;
+  next.has_prior = true;
+  next.F = A.topLeftCorner<VIEKF::dxZ, VIEKF::dxZ>();
+  next.xp = x_prior.topRows<VIEKF::xZ>();
+  next.Pp = P_prior.topLeftCorner<VIEKF::dxZ, VIEKF::dxZ>();
+
+  // Only keep enough history to cover the lag
+  while (hist_.size() > 2 && hist_.front().t < t - lag_)
+    hist_.pop_front();
+}
+
+void RTSSmoother::clear()
+{
+  std::lock_guard<std::mutex> lock(hist_mtx_);
+  hist_.clear();
+}
+
+void RTSSmoother::smooth()
+{
+  std::lock_guard<std::mutex> work_lock(work_mtx_);
+
+  // Grab a snapshot of the history so the filter thread is only blocked for the copy
+  {
+    std::lock_guard<std::mutex> lock(hist_mtx_);
+    window_.assign(hist_.begin(), hist_.end());
+  }
+
+  // The newest step is still being updated by the filter
+  while (!window_.empty() && !window_.back().has_post)
+    window_.pop_back();
+  if (window_.empty())
+    return;
+
+  // Find the longest unbroken chain of transitions leading up to the newest final step
+  int n = window_.size();
+  int start = n - 1;
+  while (start > 0 && window_[start].has_prior && window_[start-1].has_post)
+    start--;
+
+  work_.resize(n - start);
+  smoothed_t* next = &work_.back();
+  next->t = window_[n-1].t;
+  next->x = window_[n-1].x;
+  next->P = window_[n-1].P;
+
+  // Backwards RTS pass, performed on the manifold
+  dxCoreMatrix C;
+  dxCoreVector dx;
+  for (int k = n-2; k >= start; k--)
+  {
+    const record_t& r = window_[k];
+    const record_t& rn = window_[k+1];
+    smoothed_t* s = &work_[k - start];
+
+    // C = P F^T Pp^-1  (P and Pp are symmetric)
+    C = rn.Pp.ldlt().solve(rn.F * r.P).transpose();
+
+    boxminus(next->x, rn.xp, dx);
+    boxplus(r.x, C * dx, s->x);
+    s->P = r.P + C * (next->P - rn.Pp) * C.transpose();
+    s->t = r.t;
+    next = s;
+  }
+
+  std::lock_guard<std::mutex> lock(result_mtx_);
+  std::swap(result_, work_);
+}
+
+bool RTSSmoother::get_state(const double t, xCoreVector &x, dxCoreMatrix &P) const
+{
+  std::lock_guard<std::mutex> lock(result_mtx_);
+  if (result_.empty() || t < result_.front().t || t > result_.back().t)
+    return false;
+
+  // Find the closest smoothed step
+  auto it = std::lower_bound(result_.begin(), result_.end(), t,
+                             [](const smoothed_t& s, const double t) { return s.t < t; });
+  if (it != result_.begin() && (it == result_.end() || t - (it-1)->t < it->t - t))
+    it--;
+
+  x = it->x;
+  P = it->P;
+  return true;
+}
+
+bool RTSSmoother::get_pose(const double t, Xformd &pose, Matrix6d &cov) const
+{
+  xCoreVector x;
+  dxCoreMatrix P;
+  if (!get_state(t, x, P))
+    return false;
+
+  pose.t() = x.block<3,1>((int)VIEKF::xPOS, 0);
+  pose.q() = Quatd(x.block<4,1>((int)VIEKF::xATT, 0));
+  cov.block<3,3>(0, 0) = P.block<3,3>((int)VIEKF::dxPOS, (int)VIEKF::dxPOS);
+  cov.block<3,3>(0, 3) = P.block<3,3>((int)VIEKF::dxPOS, (int)VIEKF::dxATT);
+  cov.block<3,3>(3, 0) = P.block<3,3>((int)VIEKF::dxATT, (int)VIEKF::dxPOS);
+  cov.block<3,3>(3, 3) = P.block<3,3>((int)VIEKF::dxATT, (int)VIEKF::dxATT);
+  return true;
+}
+
+void RTSSmoother::boxplus(const xCoreVector &x, const dxCoreVector &dx, xCoreVector &out)
+{
+  out.block<6,1>((int)VIEKF::xPOS, 0) = x.block<6,1>((int)VIEKF::xPOS, 0) + dx.block<6,1>((int)VIEKF::dxPOS, 0);
+  out.block<4,1>((int)VIEKF::xATT, 0) = (Quatd(x.block<4,1>((int)VIEKF::xATT, 0)) + dx.block<3,1>((int)VIEKF::dxATT, 0)).elements();
+  out.block<7,1>((int)VIEKF::xB_A, 0) = x.block<7,1>((int)VIEKF::xB_A, 0) + dx.block<7,1>((int)VIEKF::dxB_A, 0);
+}
+
+void RTSSmoother::boxminus(const xCoreVector &x1, const xCoreVector &x2, dxCoreVector &out)
+{
+  out.block<6,1>((int)VIEKF::dxPOS, 0) = x1.block<6,1>((int)VIEKF::xPOS, 0) - x2.block<6,1>((int)VIEKF::xPOS, 0);
+  out.block<3,1>((int)VIEKF::dxATT, 0) = (Quatd(x1.block<4,1>((int)VIEKF::xATT, 0)) - Quatd(x2.block<4,1>((int)VIEKF::xATT, 0)));
+  out.block<7,1>((int)VIEKF::dxB_A, 0) = x1.block<7,1>((int)VIEKF::xB_A, 0) - x2.block<7,1>((int)VIEKF::xB_A, 0);
+}
+
+}
@@ -0,0 +1,119 @@
+#include <iostream>
+#include <chrono>
+#include <vector>
+
+#include "vi_ekf.h"
+
+using namespace quat;
+using namespace vi_ekf;
+using namespace Eigen;
+
+// Times VIEKF::dynamics with the scalar and SIMD feature loops for increasing feature counts,
+// and a whole filter step with the features split between estimated and consider states
+void init_ekf(VIEKF& ekf, int num_features)
+{
+  Matrix<double, VIEKF::xZ, 1> x0;
+  x0.setZero();
+  x0(VIEKF::xATT) = 1.0;
+  x0(VIEKF::xMU) = 0.2;
+  x0.block<3,1>((int)VIEKF::xVEL, 0) = Vector3d::Random();
+  Matrix<double, VIEKF::dxZ, 1> P0, Qx, lambda;
+  P0.setOnes();
+  Qx.setOnes();
+  lambda.setOnes();
+  uVector Qu;
+  Qu.setOnes();
+  Vector3d P0feat, Qxfeat, lambdafeat;
+  P0feat.setOnes();
+  Qxfeat.setOnes();
+  lambdafeat.setOnes();
+  Vector2d cam_center, focal_len;
+  cam_center << 320, 240;
+  focal_len << 250, 250;
+  Vector4d q_b_c = Quatd::Random().elements();
+  Vector3d p_b_c = Vector3d::Random() * 0.5;
+  ekf.init(x0, P0, Qx, lambda, Qu, P0feat, Qxfeat, lambdafeat, cam_center, focal_len, q_b_c, p_b_c,
+           2.0, "~", true, false, false, 0.0, 0);
+  for (int i = 0; i < num_features; i++)
+  {
+    Vector2d l;
+    l << std::rand()%640, std::rand()%480;
+    ekf.init_feature(l, i, 1.0 + std::rand()%10);
+  }
+}
+
+double time_dynamics(VIEKF& ekf, const uVector& u, const bool use_simd, const int iters)
+{
+  ekf.set_simd_dynamics(use_simd);
+  xVector x = ekf.get_state();
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < iters; i++)
+  {
+    ekf.dynamics(x, u, true, true);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() / iters;
+}
+
+// A propagation and an update of an estimated feature, per step
+double time_step(VIEKF& ekf, const uVector& u, const int iters)
+{
+  int id = -1;
+  for (int i = 0; i < (int)ekf.tracked_features().size() && id < 0; i++)
+  {
+    if (!ekf.is_consider_feature(ekf.tracked_features()[i]))
+      id = ekf.tracked_features()[i];
+  }
+  Matrix2d R = Matrix2d::Identity();
+  double t = 0.0;
+  ekf.propagate_state(u, t);
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < iters; i++)
+  {
+    t += 0.001;
+    ekf.propagate_state(u, t);
+    if (id >= 0)
+    {
+      ekf.add_measurement(t, ekf.get_feat(id), VIEKF::FEAT, R, true, id);
+      ekf.handle_measurements();
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() / iters;
+}
+
+int main(int argc, char* argv[])
+{
+  int iters = (argc > 1) ? atoi(argv[1]) : 10000;
+  uVector u;
+  u.setRandom();
+
+  std::cout << "NUM_FEATURES = " << NUM_FEATURES << ", " << iters << " iterations\n";
+  std::cout << "features\tscalar (us)\tsimd (us)\tspeedup\n";
+  for (int n = 4; n <= NUM_FEATURES; n += 4)
+  {
+    VIEKF ekf;
+    init_ekf(ekf, n);
+    double scalar = time_dynamics(ekf, u, false, iters);
+    double simd = time_dynamics(ekf, u, true, iters);
+    std::cout << n << "\t\t" << scalar << "\t\t" << simd << "\t\t" << scalar / simd << "\n";
+  }
+  
+  // Each consider feature only adds a small fixed cost, so with the estimated count held the
+  // step time should grow slowly and linearly as consider features are added, instead of with
+  // the cube of the state size as it does with all of them estimated
+  int num_estimated = 8;
+  int step_iters = std::max(iters / 10, 1);
+  std::cout << "\nestimated\tconsider\tstep (us)\tall estimated (us)\n";
+  for (int n = num_estimated; n <= NUM_FEATURES; n += 8)
+  {
+    VIEKF ekf;
+    init_ekf(ekf, n);
+    double all_estimated = time_step(ekf, u, step_iters);
+    init_ekf(ekf, n);
+    ekf.set_max_estimated_features(num_estimated);
+    double step = time_step(ekf, u, step_iters);
+    std::cout << num_estimated << "\t\t" << n - num_estimated << "\t\t" << step << "\t\t" << all_estimated << "\n";
+  }
+  return 0;
+}
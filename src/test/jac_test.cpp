@@ -5,8 +5,13 @@
 #include <string>
 #include <eigen3/unsupported/Eigen/MatrixFunctions>
 #include "vi_ekf.h"
+#include "feature_budget.h"
+#include "async_logger.h"
+#include "log_reader.h"
 #include <random>
 #include <chrono>
+#include <thread>
+#include <cstring>
 
 using namespace quat;
 using namespace vi_ekf;
@@ -385,6 +390,139 @@ void VIEKF_dfdu_test()
 }
 TEST(VI_EKF, dfdu_test){VIEKF_dfdu_test();}
 
+void VIEKF_simd_dynamics_test()
+{
+  xVector x0;
+  uVector u0;
+  dxVector scalar_dx, simd_dx;
+  dxMatrix scalar_dfdx, simd_dfdx;
+  dxuMatrix scalar_dfdu, simd_dfdu;
+  for (int j = 0; j < NUM_ITERS; j++)
+  {
+    vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+    
+    ekf.set_simd_dynamics(false);
+    ekf.dynamics(x0, u0, scalar_dx, scalar_dfdx, scalar_dfdu);
+    ekf.set_simd_dynamics(true);
+    ekf.dynamics(x0, u0, simd_dx, simd_dfdx, simd_dfdu);
+    
+    // Very close features give large entries, so scale the tolerance for roundoff
+    ASSERT_FALSE(check_all(simd_dx, scalar_dx, "xdot", 1e-8 * std::max(1.0, scalar_dx.cwiseAbs().maxCoeff())));
+    ASSERT_FALSE(check_all(simd_dfdx, scalar_dfdx, "dfdx", 1e-8 * std::max(1.0, scalar_dfdx.cwiseAbs().maxCoeff())));
+    ASSERT_FALSE(check_all(simd_dfdu, scalar_dfdu, "dfdu", 1e-8 * std::max(1.0, scalar_dfdu.cwiseAbs().maxCoeff())));
+  }
+}
+TEST(VI_EKF, simd_dynamics_test){VIEKF_simd_dynamics_test();}
+
+// The feature loop is only split once there are more slots than the SIMD grain, which takes
+// the jac_test_32 build (NUM_FEATURES=32); with the default feature count this runs serially
+void VIEKF_parallel_test()
+{
+  xVector x0, serial_x, parallel_x;
+  uVector u0;
+  dxVector serial_dx, parallel_dx, dx;
+  dxMatrix serial_dfdx, parallel_dfdx;
+  dxuMatrix serial_dfdu, parallel_dfdu;
+  for (int j = 0; j < NUM_ITERS; j++)
+  {
+    vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+    dx.setRandom();
+    
+    for (int simd = 0; simd < 2; simd++)
+    {
+      ekf.set_simd_dynamics(simd);
+      ekf.set_num_threads(1);
+      ekf.dynamics(x0, u0, serial_dx, serial_dfdx, serial_dfdu);
+      ekf.boxplus(x0, dx, serial_x);
+      ekf.set_num_threads(4, 0);
+      ekf.dynamics(x0, u0, parallel_dx, parallel_dfdx, parallel_dfdu);
+      ekf.boxplus(x0, dx, parallel_x);
+      
+      ASSERT_FALSE(check_all(parallel_dx, serial_dx, "xdot", 1e-12));
+      ASSERT_FALSE(check_all(parallel_dfdx, serial_dfdx, "dfdx", 1e-12));
+      ASSERT_FALSE(check_all(parallel_dfdu, serial_dfdu, "dfdu", 1e-12));
+      ASSERT_FALSE(check_all(parallel_x, serial_x, "boxplus", 1e-12));
+    }
+  }
+}
+TEST(VI_EKF, parallel_test){VIEKF_parallel_test();}
+
+void VIEKF_multi_camera_test()
+{
+  xVector x0, xprime;
+  uVector u0;
+  dxVector dx0, dxprime, simd_dx;
+  dxMatrix a_dfdx, simd_dfdx, dummydfdx;
+  dxuMatrix a_dfdu, simd_dfdu, dummydfdu;
+  dxMatrix Idx = dxMatrix::Identity();
+  double epsilon = 1e-6;
+  for (int j = 0; j < NUM_ITERS; j++)
+  {
+    vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+    
+    // Move every other feature to a second camera with its own calibration (square pixels,
+    // so the pixel it was initialized from projects back to the same place)
+    Vector2d cam_center(640 + std::rand()%50, 360 + std::rand()%50);
+    Vector2d focal_len = Vector2d::Constant(200.0 + std::rand()%400);
+    ASSERT_EQ(ekf.add_camera(cam_center, focal_len, Quatd::Random().elements(), Vector3d::Random() * 0.5), 1);
+    ASSERT_EQ(ekf.get_num_cameras(), 2);
+    int num_features = ekf.get_len_features();
+    for (int i = 1; i < num_features; i += 2)
+    {
+      Vector2d l(cam_center(0) - 100 + std::rand()%200, cam_center(1) - 100 + std::rand()%200);
+      ekf.clear_feature(i);
+      ASSERT_TRUE(ekf.init_feature(l, i, 1.0 + std::rand()%10, 1));
+      EXPECT_EQ(ekf.get_feature_camera(i), 1);
+      EXPECT_LE((ekf.get_feat(i) - l).norm(), 1e-6);
+    }
+    x0 = ekf.get_state();
+    
+    // Each feature's dynamics use its own camera
+    ekf.set_simd_dynamics(false);
+    ekf.dynamics(x0, u0, dx0, a_dfdx, a_dfdu);
+    dxMatrix d_dfdx = dxMatrix::Zero();
+    for (int i = 0; i < d_dfdx.cols(); i++)
+    {
+      ekf.boxplus(x0, (Idx.col(i) * epsilon), xprime);
+      ekf.dynamics(xprime, u0, dxprime, dummydfdx, dummydfdu);
+      d_dfdx.col(i) = (dxprime - dx0) / epsilon;
+    }
+    for (int i = 0; i < num_features; i++)
+    {
+      std::string zeta_key = "dxZETA_" + std::to_string(i);
+      std::string rho_key = "dxRHO_" + std::to_string(i);
+      ASSERT_FALSE(check_block(zeta_key, "dxVEL", a_dfdx, d_dfdx));
+      ASSERT_FALSE(check_block(zeta_key, "dxB_G", a_dfdx, d_dfdx));
+      ASSERT_FALSE(check_block(zeta_key, zeta_key, a_dfdx, d_dfdx));
+      ASSERT_FALSE(check_block(rho_key, "dxVEL", a_dfdx, d_dfdx));
+      ASSERT_FALSE(check_block(rho_key, "dxB_G", a_dfdx, d_dfdx));
+      ASSERT_FALSE(check_block(rho_key, rho_key, a_dfdx, d_dfdx));
+    }
+    
+    // The vectorized kernel agrees with a camera per lane
+    ekf.set_simd_dynamics(true);
+    ekf.dynamics(x0, u0, simd_dx, simd_dfdx, simd_dfdu);
+    ASSERT_FALSE(check_all(simd_dx, dx0, "xdot", 1e-8 * std::max(1.0, dx0.cwiseAbs().maxCoeff())));
+    ASSERT_FALSE(check_all(simd_dfdx, a_dfdx, "dfdx", 1e-8 * std::max(1.0, a_dfdx.cwiseAbs().maxCoeff())));
+    ASSERT_FALSE(check_all(simd_dfdu, a_dfdu, "dfdu", 1e-8 * std::max(1.0, a_dfdu.cwiseAbs().maxCoeff())));
+    
+    // The feature measurement model uses the feature's camera
+    for (int i = 0; i < num_features; i++)
+    {
+      EXPECT_FALSE(htest(&VIEKF::h_feat, ekf, VIEKF::FEAT, i, 2, 1e-1));
+    }
+    
+    // A camera's feature list only drops that camera's features
+    ekf.keep_only_features(std::vector<int>(), 1);
+    EXPECT_EQ(ekf.get_len_features(), (num_features + 1) / 2);
+    for (int i = 0; i < num_features; i++)
+    {
+      EXPECT_EQ(ekf.get_feature_camera(i), (i % 2 == 0) ? 0 : -1);
+    }
+  }
+}
+TEST(VI_EKF, multi_camera_test){VIEKF_multi_camera_test();}
+
 void VI_EKF_h_test()
 {
   xVector x0;
@@ -402,6 +540,11 @@ void VI_EKF_h_test()
     ekf.set_drag_term(false);
     ASSERT_FALSE(htest(&VIEKF::h_att, ekf, VIEKF::ATT, 0, 3));
     ASSERT_FALSE(htest(&VIEKF::h_gps, ekf, VIEKF::GPS, 0, 3));
+    // The ECEF origin hasn't been set, which leaves the ECEF to NED rotation at identity
+    zVector h_gps = zVector::Zero();
+    hMatrix H_gps = hMatrix::Zero();
+    ekf.h_gps(ekf.get_state(), h_gps, H_gps, 0);
+    ASSERT_TRUE(NO_NANS(h_gps) && NO_NANS(H_gps));
     for (int i = 0; i < ekf.get_len_features(); i++)
     {
       EXPECT_FALSE(htest(&VIEKF::h_feat, ekf, VIEKF::FEAT, i, 2, 1e-1));
@@ -458,6 +601,681 @@ void VIEKF_KF_reset_test()
 }
 //TEST(VI_EKF, KF_reset_test){VIEKF_KF_reset_test();}
 
+void VIEKF_smoother_test()
+{
+  xVector x0;
+  uVector u0;
+  vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+  ekf.enable_smoother(1.0, 0.01);
+  
+  std::vector<double> t_hist;
+  std::vector<dxMatrix, aligned_allocator<dxMatrix>> P_hist;
+  Matrix3d R = Matrix3d::Identity() * 1e-2;
+  for (int i = 0; i < 200; i++)
+  {
+    double t = i * 0.005;
+    ekf.propagate_state(u0, t);
+    if (i > 0 && i % 10 == 0)
+    {
+      Vector3d z_pos = ekf.get_state().block<3,1>((int)VIEKF::xPOS, 0);
+      ekf.add_measurement(t, z_pos, VIEKF::POS, R, true);
+      ekf.handle_measurements();
+    }
+    t_hist.push_back(t);
+    P_hist.push_back(ekf.get_covariance());
+  }
+  
+  // Wait for the background thread to finish a pass
+  Xformd pose;
+  Matrix6d cov;
+  bool got_pose = false;
+  for (int i = 0; i < 100 && !got_pose; i++)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    got_pose = ekf.get_smoothed_pose(t_hist[100], pose, cov);
+  }
+  ASSERT_TRUE(got_pose);
+  
+  // Smoothing should never make us less certain than filtering alone
+  for (int i = 20; i < 180; i++)
+  {
+    ASSERT_TRUE(ekf.get_smoothed_pose(t_hist[i], pose, cov));
+    ASSERT_TRUE(NO_NANS(cov));
+    double smoothed_trace = cov.block<3,3>(0,0).trace();
+    double filtered_trace = P_hist[i].block<3,3>((int)VIEKF::dxPOS, (int)VIEKF::dxPOS).trace();
+    EXPECT_LE(smoothed_trace, filtered_trace + 1e-8);
+  }
+  
+  // A copy of the filter has its own smoother
+  vi_ekf::VIEKF copy_ekf = ekf;
+  ekf.disable_smoother();
+  EXPECT_FALSE(ekf.get_smoothed_pose(t_hist[100], pose, cov));
+  EXPECT_TRUE(copy_ekf.get_smoothed_pose(t_hist[100], pose, cov));
+}
+TEST(VI_EKF, smoother_test){VIEKF_smoother_test();}
+
+void VIEKF_state_at_test()
+{
+  xVector x0;
+  uVector u0;
+  vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+  
+  std::vector<double> t_hist;
+  std::vector<xVector, aligned_allocator<xVector>> x_hist;
+  for (int i = 0; i < 100; i++)
+  {
+    double t = i * 0.005;
+    ekf.propagate_state(u0, t);
+    t_hist.push_back(t);
+    x_hist.push_back(ekf.get_state());
+  }
+  
+  xVector x;
+  Xformd pose;
+  Matrix6d cov;
+  for (int i = 1; i < 99; i++)
+  {
+    // Stored states come back exactly
+    ASSERT_TRUE(ekf.state_at(t_hist[i], x));
+    MATRIX_EQUAL(x.topRows<(int)VIEKF::xZ>(), x_hist[i].topRows<(int)VIEKF::xZ>(), 1e-8);
+    
+    // Halfway between two states is halfway on the manifold
+    ASSERT_TRUE(ekf.pose_at(0.5 * (t_hist[i] + t_hist[i+1]), pose, cov));
+    Vector3d p_mid = 0.5 * (x_hist[i].block<3,1>((int)VIEKF::xPOS, 0) + x_hist[i+1].block<3,1>((int)VIEKF::xPOS, 0));
+    VECTOR3_EQUALS(pose.t(), p_mid);
+    Quatd qa(x_hist[i].block<4,1>((int)VIEKF::xATT, 0));
+    Quatd qb(x_hist[i+1].block<4,1>((int)VIEKF::xATT, 0));
+    VECTOR3_EQUALS(pose.q() - qa, qb - pose.q());
+  }
+  
+  // Can't extrapolate into the future
+  ASSERT_FALSE(ekf.state_at(t_hist.back() + 0.1, x));
+}
+TEST(VI_EKF, state_at_test){VIEKF_state_at_test();}
+
+void VIEKF_batch_propagate_test()
+{
+  xVector x0;
+  uVector u0;
+  vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+  vi_ekf::VIEKF batch_ekf = ekf;
+  std::string dir = "/tmp/vi_ekf_batch_propagate_test";
+  ekf.init_logger(dir + "/sample");
+  batch_ekf.init_logger(dir + "/batch");
+  ASSERT_TRUE(ekf.set_log_policy("STATE 100"));
+  ASSERT_TRUE(batch_ekf.set_log_policy("STATE 100"));
+  
+  std::vector<std::pair<double, uVector>, aligned_allocator<std::pair<double, uVector>>> samples;
+  for (int i = 0; i < 45; i++)
+  {
+    uVector u = u0 + 0.1 * uVector::Random();
+    samples.push_back(std::make_pair(i * 0.002, u));
+    ekf.propagate_state(u, i * 0.002);
+  }
+  batch_ekf.propagate_states(samples.data(), samples.size());
+  
+  // Batching only saves bookkeeping, every sample is still propagated the same way
+  MATRIX_EQUAL(batch_ekf.get_state(), ekf.get_state(), 1e-10);
+  MATRIX_EQUAL(batch_ekf.get_covariance(), ekf.get_covariance(), 1e-10);
+  
+  // Including the history inside the batches that a measurement can rewind into
+  xVector x, x_batch;
+  dxMatrix P, P_batch;
+  for (int i = 1; i < (int)samples.size(); i++)
+  {
+    ASSERT_TRUE(ekf.state_at(samples[i].first, x));
+    ASSERT_TRUE(batch_ekf.state_at(samples[i].first, x_batch));
+    MATRIX_EQUAL(x_batch, x, 1e-10);
+    ASSERT_TRUE(ekf.covariance_at(samples[i].first, P));
+    ASSERT_TRUE(batch_ekf.covariance_at(samples[i].first, P_batch));
+    MATRIX_EQUAL(P_batch, P, 1e-10);
+  }
+  
+  // And every sample the log policy asks for is logged
+  ekf.disable_logger();
+  batch_ekf.disable_logger();
+  LogReader reader, batch_reader;
+  std::vector<std::vector<double>> t, t_batch;
+  ASSERT_TRUE(reader.open_segments(dir + "/sample/log"));
+  ASSERT_TRUE(batch_reader.open_segments(dir + "/batch/log"));
+  ASSERT_TRUE(reader.read_channel("STATE", t, {0}));
+  ASSERT_TRUE(batch_reader.read_channel("STATE", t_batch, {0}));
+  EXPECT_EQ(t[0].size(), 9u);
+  EXPECT_EQ(t_batch[0], t[0]);
+  
+  // So a measurement from the middle of a batch ends up in the same place
+  Vector3d z_pos = x.block<3,1>((int)VIEKF::xPOS, 0) + Vector3d::Constant(0.1);
+  Matrix3d R = Matrix3d::Identity() * 1e-2;
+  ekf.add_measurement(samples[23].first, z_pos, VIEKF::POS, R, true);
+  ekf.handle_measurements();
+  batch_ekf.add_measurement(samples[23].first, z_pos, VIEKF::POS, R, true);
+  batch_ekf.handle_measurements();
+  MATRIX_EQUAL(batch_ekf.get_state(), ekf.get_state(), 1e-10);
+  MATRIX_EQUAL(batch_ekf.get_covariance(), ekf.get_covariance(), 1e-10);
+}
+TEST(VI_EKF, batch_propagate_test){VIEKF_batch_propagate_test();}
+
+void VIEKF_feature_slot_test()
+{
+  xVector x0;
+  uVector u0;
+  vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+  ASSERT_GE(NUM_FEATURES, 3);
+  
+  // Dropping a feature only clears its own block, everything else stays put
+  dxMatrix P = ekf.get_covariance();
+  ekf.clear_feature(1);
+  xVector x = ekf.get_state();
+  dxMatrix P_cleared = ekf.get_covariance();
+  int dx1 = VIEKF::dxZ + 3;
+  double err = (x.segment<5>(VIEKF::xZ) - x0.segment<5>(VIEKF::xZ)).norm()
+      + (x.segment<5>(VIEKF::xZ+10) - x0.segment<5>(VIEKF::xZ+10)).norm()
+      + (P_cleared.block<3,3>(VIEKF::dxZ, VIEKF::dxZ+6) - P.block<3,3>(VIEKF::dxZ, VIEKF::dxZ+6)).norm();
+  EXPECT_LE(err, 1e-12);
+  double cleared = P_cleared.middleRows<3>(dx1).norm() + P_cleared.middleCols<3>(dx1).norm();
+  EXPECT_LE(cleared, 1e-12);
+  EXPECT_EQ(ekf.get_len_features(), NUM_FEATURES - 1);
+  
+  // Propagating with a free slot leaves it alone
+  ekf.propagate_state(u0, 0.0);
+  ekf.propagate_state(u0, 0.01);
+  P_cleared = ekf.get_covariance();
+  cleared = P_cleared.block(dx1, 0, 3, dx1).norm() + P_cleared.block(0, dx1, dx1, 3).norm();
+  EXPECT_LE(cleared, 1e-12);
+  
+  // The next feature reuses the free slot
+  Vector2d l(320, 240);
+  ASSERT_TRUE(ekf.init_feature(l, -1, 5.0));
+  EXPECT_NEAR(ekf.get_state()(VIEKF::xZ+5+4), 0.2, 1e-12);
+  EXPECT_NEAR(ekf.get_depth(NUM_FEATURES), 5.0, 1e-12);
+  EXPECT_EQ(ekf.get_len_features(), NUM_FEATURES);
+}
+TEST(VI_EKF, feature_slot_test){VIEKF_feature_slot_test();}
+
+void VIEKF_consider_test()
+{
+  xVector x0;
+  uVector u0;
+  vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+  ASSERT_GE(NUM_FEATURES, 2);
+  ekf.propagate_state(u0, 0.0);
+  
+  // The sparse covariance propagation matches the dense one (Qx and Qu are identity in this test)
+  dxVector xdot;
+  dxMatrix F;
+  dxuMatrix G;
+  ekf.dynamics(ekf.get_state(), u0, xdot, F, G);
+  F = dxMatrix::Identity() + F * 0.01;
+  dxMatrix P_dense = F * ekf.get_covariance() * F.transpose() + G * G.transpose() + dxMatrix::Identity();
+  vi_ekf::VIEKF dense_ekf = ekf;
+  dense_ekf.propagate_state(u0, 0.01);
+  double err = (dense_ekf.get_covariance() - P_dense).norm() / P_dense.norm();
+  EXPECT_LE(err, 1e-12);
+  
+  // A consider feature only keeps its own block and its cross-covariance with the core states
+  auto without_feature_cross_terms = [](const dxMatrix& P, const int slot)
+  {
+    dxMatrix out = P;
+    int dxC = VIEKF::dxZ + 3*slot;
+    out.block(dxC, VIEKF::dxZ, 3, 3*NUM_FEATURES).setZero();
+    out.block(VIEKF::dxZ, dxC, 3*NUM_FEATURES, 3).setZero();
+    out.block<3,3>(dxC, dxC) = P.block<3,3>(dxC, dxC);
+    return out;
+  };
+  vi_ekf::VIEKF estimated_ekf = ekf;
+  ASSERT_TRUE(ekf.demote_feature(0));
+  ASSERT_FALSE(ekf.demote_feature(0));
+  EXPECT_TRUE(ekf.is_consider_feature(0));
+  dxMatrix P_expected = without_feature_cross_terms(estimated_ekf.get_covariance(), 0);
+  MATRIX_EQUAL(ekf.get_covariance(), P_expected, 1e-12);
+  
+  // Its dynamics only depend on the core states and itself, so while rotating, those blocks
+  // move with the state exactly as if it were estimated (and so does everything else)
+  uVector u_rot = u0;
+  u_rot.block<3,1>((int)VIEKF::uG, 0) << 0.5, -0.3, 1.0;
+  Matrix3d P_c = ekf.get_covariance().block<3,3>(VIEKF::dxZ, VIEKF::dxZ);
+  double t = 0.0;
+  for (int i = 0; i < 5; i++)
+  {
+    t += 0.01;
+    ekf.propagate_state(u_rot, t);
+    estimated_ekf.propagate_state(u_rot, t);
+  }
+  Matrix3d P_c_prop = ekf.get_covariance().block<3,3>(VIEKF::dxZ, VIEKF::dxZ);
+  EXPECT_GT((P_c_prop - P_c - 5.0 * Matrix3d::Identity()).norm(), 1e-6);
+  EXPECT_GT(ekf.get_covariance().block<3,3>(VIEKF::dxZ, (int)VIEKF::dxVEL).norm(), 1e-8);
+  P_expected = without_feature_cross_terms(estimated_ekf.get_covariance(), 0);
+  MATRIX_EQUAL(ekf.get_covariance(), P_expected, 1e-10);
+  
+  // After promotion it carries on from there (its cross-covariance with the other features
+  // starts over from zero, but nothing else depends on that)
+  ASSERT_TRUE(ekf.promote_feature(0));
+  t += 0.01;
+  ekf.propagate_state(u_rot, t);
+  estimated_ekf.propagate_state(u_rot, t);
+  MATRIX_EQUAL(ekf.get_state(), estimated_ekf.get_state(), 1e-10);
+  dxMatrix P_promoted = without_feature_cross_terms(ekf.get_covariance(), 0);
+  P_expected = without_feature_cross_terms(estimated_ekf.get_covariance(), 0);
+  MATRIX_EQUAL(P_promoted, P_expected, 1e-10);
+  ASSERT_TRUE(ekf.demote_feature(0));
+  
+  // A measurement of an estimated feature corrects the core and estimated features, but not the consider feature
+  vi_ekf::VIEKF no_update_ekf = ekf;
+  Vector2d z = ekf.get_feat(1) + Vector2d(1.0, 1.0);
+  Matrix2d R = Matrix2d::Identity();
+  ekf.add_measurement(t, z, VIEKF::FEAT, R, true, 1);
+  ekf.handle_measurements();
+  xVector x = ekf.get_state();
+  xVector x_no_update = no_update_ekf.get_state();
+  double consider_change = (x.segment<5>(VIEKF::xZ) - x_no_update.segment<5>(VIEKF::xZ)).norm();
+  double estimated_change = (x.segment<5>(VIEKF::xZ+5) - x_no_update.segment<5>(VIEKF::xZ+5)).norm();
+  EXPECT_LE(consider_change, 1e-12);
+  EXPECT_GT(estimated_change, 1e-8);
+  
+  // It keeps its own block, and stays uncorrelated with the estimated features
+  dxMatrix P = ekf.get_covariance();
+  dxMatrix P_no_update = no_update_ekf.get_covariance();
+  MATRIX_EQUAL(P.block<3,3>(VIEKF::dxZ, VIEKF::dxZ), P_no_update.block<3,3>(VIEKF::dxZ, VIEKF::dxZ), 1e-12);
+  P_expected = without_feature_cross_terms(P, 0);
+  MATRIX_EQUAL(P, P_expected, 0.0);
+  
+  // Limiting the number of estimated features demotes the least observed ones
+  ASSERT_TRUE(ekf.promote_feature(0));
+  ekf.set_max_estimated_features(1);
+  EXPECT_FALSE(ekf.is_consider_feature(1));
+  EXPECT_TRUE(ekf.is_consider_feature(0));
+}
+TEST(VI_EKF, consider_test){VIEKF_consider_test();}
+
+void VIEKF_budget_test()
+{
+  // Too slow: the count steps down to the minimum, and doesn't move while settling
+  FeatureBudget budget(4, 20, 10.0, 0.2, 2, 5);
+  EXPECT_TRUE(budget.enabled());
+  EXPECT_EQ(budget.num_features(), 20);
+  for (int i = 0; i < 4; i++)
+    budget.update(20.0);
+  EXPECT_EQ(budget.num_features(), 20);
+  budget.update(20.0);
+  EXPECT_EQ(budget.num_features(), 18);
+  for (int i = 0; i < 200; i++)
+    budget.update(20.0);
+  EXPECT_EQ(budget.num_features(), 4);
+
+  // Within the hysteresis band: it stays put
+  for (int i = 0; i < 200; i++)
+    budget.update(10.5);
+  EXPECT_EQ(budget.num_features(), 4);
+
+  // Lots of headroom: back up to the maximum
+  for (int i = 0; i < 200; i++)
+    budget.update(1.0);
+  EXPECT_EQ(budget.num_features(), 20);
+
+  // Disabled budgets never change the count
+  FeatureBudget disabled;
+  EXPECT_FALSE(disabled.enabled());
+
+  // The filter refuses new features past its limit
+  xVector x0;
+  uVector u0;
+  vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+  int len = ekf.get_len_features();
+  ekf.set_max_features(len);
+  EXPECT_FALSE(ekf.init_feature(Vector2d(320, 240), 1000, 2.0));
+  ekf.set_max_features(NUM_FEATURES);
+  if (len < NUM_FEATURES)
+    EXPECT_TRUE(ekf.init_feature(Vector2d(320, 240), 1000, 2.0));
+}
+TEST(VI_EKF, budget_test){VIEKF_budget_test();}
+
+// Keeps every record it is handed
+class MemorySink : public LogSink
+{
+public:
+  std::vector<std::pair<int, std::vector<char>>>& records;
+  MemorySink(std::vector<std::pair<int, std::vector<char>>>& r) : records(r) {}
+  void write(const int stream, const char* data, const size_t bytes) override
+  {
+    records.push_back(std::make_pair(stream, std::vector<char>(data, data + bytes)));
+  }
+  void flush() override {}
+};
+
+void async_logger_test()
+{
+  // Push many more records than fit in the buffer, blocking loses nothing and keeps the order
+  int num_records = 5000;
+  std::vector<std::pair<int, std::vector<char>>> records;
+  {
+    AsyncLogger logger(std::unique_ptr<LogSink>(new MemorySink(records)), 256, AsyncLogger::BLOCK);
+    for (int i = 0; i < num_records; i++)
+    {
+      double rec[3] = {(double)i, 2.0*i, 3.0*i};
+      logger.begin(0, sizeof(rec));
+      logger.append(rec, sizeof(double));
+      logger.append(rec + 1, 2*sizeof(double));
+      logger.commit();
+      logger.write(2, &i, sizeof(int));
+    }
+    logger.flush();
+    EXPECT_EQ(logger.dropped_records(), 0u);
+    EXPECT_EQ(logger.written_records(), 2u*num_records);
+  }
+  ASSERT_EQ(records.size(), 2u*num_records);
+  int bad = 0;
+  for (int i = 0; i < num_records; i++)
+  {
+    const std::pair<int, std::vector<char>>& a = records[2*i];
+    const std::pair<int, std::vector<char>>& b = records[2*i+1];
+    if (a.first != 0 || a.second.size() != 3*sizeof(double) || b.first != 2 || b.second.size() != sizeof(int))
+    {
+      bad++;
+      continue;
+    }
+    double rec[3];
+    int j;
+    memcpy(rec, a.second.data(), sizeof(rec));
+    memcpy(&j, b.second.data(), sizeof(int));
+    if (rec[0] != i || rec[1] != 2.0*i || rec[2] != 3.0*i || j != i)
+      bad++;
+  }
+  EXPECT_EQ(bad, 0);
+
+  // A record that can never fit is dropped and counted
+  AsyncLogger small(std::unique_ptr<LogSink>(new MemorySink(records)), 64, AsyncLogger::DROP);
+  char big[128] = {0};
+  EXPECT_FALSE(small.write(0, big, sizeof(big)));
+  EXPECT_EQ(small.dropped_records(), 1u);
+}
+TEST(VI_EKF, async_logger_test){async_logger_test();}
+
+void VIEKF_log_format_test()
+{
+  xVector x0;
+  uVector u0;
+  vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+  std::string dir = "/tmp/vi_ekf_log_format_test";
+  ekf.init_logger(dir);
+  ekf.propagate_state(u0, 0.0);
+
+  // More rows than fit in one block
+  int num_steps = 600;
+  std::vector<xVector, aligned_allocator<xVector>> states;
+  for (int i = 1; i <= num_steps; i++)
+  {
+    ekf.propagate_state(u0, 0.001 * i);
+    states.push_back(ekf.get_state());
+  }
+  Vector2d z = ekf.get_feat(0);
+  Matrix2d R = Matrix2d::Identity();
+  ekf.add_measurement(0.001 * num_steps, z, VIEKF::FEAT, R, true, 0);
+  ekf.handle_measurements();
+  ekf.disable_logger();
+
+  LogReader reader;
+  ASSERT_TRUE(reader.open_segments(dir + "/log"));
+  EXPECT_EQ(reader.schema().capacity, NUM_FEATURES);
+  const LogChannel* state = reader.schema().find_channel("STATE");
+  ASSERT_TRUE(state != nullptr);
+  EXPECT_EQ((int)state->columns.size(), 1 + MAX_X + MAX_DX);
+  EXPECT_EQ(state->columns[1 + VIEKF::xVEL].name, "v_x");
+  EXPECT_EQ(state->columns[1 + VIEKF::xVEL].unit, "m/s");
+  EXPECT_FALSE(reader.schema().notes.empty());
+
+  // Pull out only the velocity columns
+  std::vector<std::vector<double>> cols;
+  std::vector<int> which = {0, 1 + VIEKF::xVEL, 2 + VIEKF::xVEL, 3 + VIEKF::xVEL};
+  ASSERT_TRUE(reader.read_channel("STATE", cols, which));
+  ASSERT_EQ(cols.size(), 4u);
+  ASSERT_EQ((int)cols[0].size(), num_steps);
+  double err = 0;
+  for (int i = 0; i < num_steps; i++)
+  {
+    Vector3d vel(cols[1][i], cols[2][i], cols[3][i]);
+    err = std::max(err, (vel - states[i].segment<3>(VIEKF::xVEL)).norm());
+  }
+  EXPECT_EQ(err, 0.0);
+
+  // Stream the feature measurement back
+  reader.rewind();
+  LogBlock block;
+  const LogChannel* feat = reader.schema().find_channel("FEAT");
+  ASSERT_TRUE(feat != nullptr);
+  ASSERT_TRUE(reader.next_block(block, feat->id));
+  EXPECT_EQ(block.rows, 1);
+  EXPECT_EQ(block.at(0, feat->find_column("dim")), 2.0);
+  EXPECT_EQ(block.at(0, feat->find_column("z0")), z(0));
+  EXPECT_EQ(block.at(0, feat->find_column("id")), 0.0);
+  EXPECT_FALSE(reader.next_block(block, feat->id));
+}
+TEST(VI_EKF, log_format_test){VIEKF_log_format_test();}
+
+void log_segment_test()
+{
+  std::string dir = "/tmp/vi_ekf_log_segment_test";
+  int result = system(("rm -rf " + dir + " && mkdir -p " + dir).c_str());
+  (void)result;
+
+  LogSchema schema;
+  schema.capacity = 1;
+  LogChannel& ch = schema.add_channel(3, "TEST");
+  for (int i = 0; i < 15; i++)
+    ch.add_column("c" + std::to_string(i));
+
+  // 4MB of rows across (the minimum) 1MB segments
+  int num_rows = 32000;
+  int num_segments;
+  {
+    ColumnarLogWriter writer(dir + "/log", schema, 1 << 20);
+    double row[16];
+    for (int i = 0; i < num_rows; i++)
+    {
+      for (int j = 0; j < 16; j++)
+        row[j] = i + 0.01*j;
+      writer.write(3, (const char*)row, sizeof(row));
+    }
+    writer.flush();
+    num_segments = writer.num_segments();
+    EXPECT_EQ(writer.rejected_records(), 0u);
+  }
+  EXPECT_GE(num_segments, 4);
+
+  // Full segments are truncated to what was written, and the spare segment is removed
+  std::ifstream seg(LogSegmentWriter::segment_name(dir + "/log", 0), std::ios::binary | std::ios::ate);
+  EXPECT_LT((int)seg.tellg(), 1 << 20);
+  std::ifstream spare(LogSegmentWriter::segment_name(dir + "/log", num_segments));
+  EXPECT_FALSE(spare.is_open());
+
+  // Every segment stands on its own, and together they hold every row in order
+  LogReader reader;
+  ASSERT_TRUE(reader.open(LogSegmentWriter::segment_name(dir + "/log", 1)));
+  LogBlock block;
+  EXPECT_TRUE(reader.next_block(block));
+  ASSERT_TRUE(reader.open_segments(dir + "/log"));
+  EXPECT_EQ(reader.num_files(), num_segments);
+  std::vector<std::vector<double>> cols;
+  ASSERT_TRUE(reader.read_channel("TEST", cols, {0, 15}));
+  ASSERT_EQ((int)cols[0].size(), num_rows);
+  int bad = 0;
+  for (int i = 0; i < num_rows; i++)
+  {
+    if (cols[0][i] != i || cols[1][i] != i + 0.01*15)
+      bad++;
+  }
+  EXPECT_EQ(bad, 0);
+
+  // A shorter log into the same base replaces the longer one instead of picking up its old segments
+  int short_rows = 100;
+  {
+    ColumnarLogWriter writer(dir + "/log", schema, 1 << 20);
+    double row[16];
+    for (int i = 0; i < short_rows; i++)
+    {
+      for (int j = 0; j < 16; j++)
+        row[j] = -i - 0.01*j;
+      writer.write(3, (const char*)row, sizeof(row));
+    }
+    writer.flush();
+    EXPECT_EQ(writer.num_segments(), 1);
+  }
+  std::ifstream stale(LogSegmentWriter::segment_name(dir + "/log", 1));
+  EXPECT_FALSE(stale.is_open());
+  ASSERT_TRUE(reader.open_segments(dir + "/log"));
+  EXPECT_EQ(reader.num_files(), 1);
+  ASSERT_TRUE(reader.read_channel("TEST", cols, {0}));
+  ASSERT_EQ((int)cols[0].size(), short_rows);
+  EXPECT_EQ(cols[0].back(), -(short_rows - 1));
+}
+TEST(VI_EKF, log_segment_test){log_segment_test();}
+
+void VIEKF_log_policy_test()
+{
+  xVector x0;
+  uVector u0;
+  vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+  std::string dir = "/tmp/vi_ekf_log_policy_test";
+  ekf.init_logger(dir);
+  EXPECT_FALSE(ekf.set_log_policy("NOT_A_CHANNEL off"));
+  EXPECT_FALSE(ekf.set_log_policy("STATE fast"));
+  ASSERT_TRUE(ekf.set_log_policy("XDOT off, STATE 50; FEATURE_IDS, FEAT 10"));
+  ekf.propagate_state(u0, 0.0);
+
+  // 1 kHz propagation, XDOT is turned back on at 100 Hz halfway through
+  for (int i = 1; i <= 1000; i++)
+  {
+    if (i == 501)
+      ASSERT_TRUE(ekf.set_log_channel("XDOT", true, 100.0));
+    ekf.propagate_state(u0, 0.001 * i);
+  }
+
+  // Three features per 20 Hz image, of which every other image is logged
+  zVector z;
+  z.setZero();
+  for (int k = 0; k < 20; k++)
+  {
+    for (int id = 0; id < 3; id++)
+      ekf.log_measurement(VIEKF::FEAT, 1.0 + 0.05 * k, 2, z, z, true, id);
+  }
+  ekf.disable_logger();
+
+  LogReader reader;
+  ASSERT_TRUE(reader.open_segments(dir + "/log"));
+  std::vector<std::vector<double>> state, xdot, input;
+  ASSERT_TRUE(reader.read_channel("STATE", state, {0}));
+  ASSERT_TRUE(reader.read_channel("XDOT", xdot, {0}));
+  ASSERT_TRUE(reader.read_channel("INPUT", input, {0}));
+  EXPECT_EQ((int)input[0].size(), 1000);
+  EXPECT_EQ((int)state[0].size(), 50);
+  EXPECT_EQ((int)xdot[0].size(), 50);
+  ASSERT_FALSE(xdot[0].empty());
+  EXPECT_GT(xdot[0].front(), 0.5);
+
+  std::vector<std::vector<double>> feat;
+  ASSERT_TRUE(reader.read_channel("FEAT", feat, {0, reader.schema().find_channel("FEAT")->find_column("id")}));
+  ASSERT_EQ((int)feat[0].size(), 30);
+  for (int i = 0; i < 30; i++)
+  {
+    EXPECT_NEAR(feat[0][i], 1.0 + 0.1 * (i / 3), 1e-9);
+    EXPECT_EQ(feat[1][i], i % 3);
+  }
+}
+TEST(VI_EKF, log_policy_test){VIEKF_log_policy_test();}
+
+void log_codec_test()
+{
+  // Rows that drift a little, with a block that never changes
+  int n = 200;
+  int num_rows = 50;
+  std::vector<std::vector<double>> rows(num_rows, std::vector<double>(n));
+  for (int i = 0; i < num_rows; i++)
+  {
+    for (int j = 0; j < n; j++)
+      rows[i][j] = (j < n/2) ? 1.0 / (j + 1) : 1e-3 * (j + 1) * (1.0 + 1e-6 * i);
+  }
+
+  DeltaCodec encoder(10);
+  std::vector<std::vector<char>> coded(num_rows);
+  size_t coded_bytes = 0;
+  for (int i = 0; i < num_rows; i++)
+  {
+    encoder.encode(rows[i].data(), n, coded[i]);
+    coded_bytes += coded[i].size();
+  }
+  EXPECT_LT(coded_bytes, sizeof(double) * n * num_rows / 2);
+
+  // Lossless, and a lost row is only recovered from at the next keyframe
+  DeltaCodec decoder;
+  std::vector<double> row;
+  for (int i = 0; i < num_rows; i++)
+  {
+    if (i == 13)
+      continue;
+    bool ok = decoder.decode(coded[i].data(), coded[i].size(), row);
+    EXPECT_EQ(ok, i < 13 || i >= 20) << "row " << i;
+    if (ok)
+      EXPECT_TRUE(row == rows[i]) << "row " << i;
+  }
+}
+TEST(VI_EKF, log_codec_test){log_codec_test();}
+
+void VIEKF_cov_log_test()
+{
+  xVector x0;
+  uVector u0;
+  vi_ekf::VIEKF ekf = init_jacobians_test(x0, u0);
+  std::string dir = "/tmp/vi_ekf_cov_log_test";
+  ekf.init_logger(dir);
+  ASSERT_TRUE(ekf.set_log_policy("COV 100"));
+  ekf.propagate_state(u0, 0.0);
+
+  // 100 Hz snapshots of 1 kHz propagation, starting with the first step
+  dxMatrix P;
+  for (int i = 1; i <= 1000; i++)
+  {
+    ekf.propagate_state(u0, 0.001 * i);
+    if (i == 991)
+      P = ekf.get_covariance().selfadjointView<Lower>();
+  }
+  ekf.disable_logger();
+
+  LogReader reader;
+  ASSERT_TRUE(reader.open_segments(dir + "/log"));
+  const LogChannel* cov = reader.schema().find_channel("COV");
+  ASSERT_TRUE(cov != nullptr);
+  EXPECT_TRUE(cov->upper_triangle);
+  EXPECT_EQ((int)cov->columns.size(), 1 + MAX_DX);
+
+  // Every snapshot decodes, and the last one is the final covariance
+  LogBlock block;
+  int num_snapshots = 0;
+  std::vector<double> dense(dxMatrix::SizeAtCompileTime);
+  while (reader.next_block(block, cov->id))
+  {
+    ASSERT_EQ(block.cols, cov->row_width());
+    num_snapshots++;
+  }
+  EXPECT_EQ(num_snapshots, 100);
+  EXPECT_EQ(reader.undecodable_rows(), 0u);
+  EXPECT_EQ(block.data[0], 0.001 * 991);
+  unpack_upper_triangle(block.data.data() + 1, MAX_DX, dense.data());
+  EXPECT_EQ((Map<Matrix<double, MAX_DX, MAX_DX, RowMajor>>(dense.data()) - P).cwiseAbs().maxCoeff(), 0.0);
+
+  // read_channel returns the whole decoded row, and only accepts indices inside it
+  std::vector<std::vector<double>> columns;
+  ASSERT_TRUE(reader.read_channel("COV", columns));
+  ASSERT_EQ((int)columns.size(), cov->row_width());
+  ASSERT_EQ((int)columns[0].size(), 100);
+  for (int c = 0; c < cov->row_width(); c++)
+    EXPECT_EQ(columns[c].back(), block.data[c]);
+  ASSERT_TRUE(reader.read_channel("COV", columns, {0, cov->row_width() - 1}));
+  EXPECT_EQ(columns[0].back(), 0.001 * 991);
+  EXPECT_EQ(columns[1].back(), P(MAX_DX-1, MAX_DX-1));
+  EXPECT_FALSE(reader.read_channel("COV", columns, {cov->row_width()}));
+  EXPECT_FALSE(reader.read_channel("COV", columns, {-1}));
+}
+TEST(VI_EKF, cov_log_test){VIEKF_cov_log_test();}
+
 int main(int argc, char **argv) {
   srand(std::chrono::system_clock::now().time_since_epoch().count());
   testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,639 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "klt_tracker.h"
+
+// Every heap allocation goes through here (a cv::Mat buffer also allocates its UMatData with new)
+static std::atomic<long> num_allocations(0);
+
+void* operator new(size_t size)
+{
+  num_allocations++;
+  void* p = malloc(size ? size : 1);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+// A smooth random texture, seen through a window that moves back and forth by a couple of
+// pixels so that every feature stays in view.  Optionally a 100x100 block in the middle shows
+// another texture that moves at right angles to the rest.
+class MovingTexture
+{
+public:
+  MovingTexture(int width=320, int height=240, bool moving_block=false) :
+    texture_(height + 80, width + 80, CV_8UC3), size_(width, height), moving_block_(moving_block)
+  {
+    cv::theRNG().state = 1234;
+    randu(texture_, Scalar::all(0), Scalar::all(255));
+    GaussianBlur(texture_, texture_, Size(0, 0), 2.0);
+    if (moving_block_)
+    {
+      block_texture_.create(texture_.size(), CV_8UC3);
+      randu(block_texture_, Scalar::all(0), Scalar::all(255));
+      GaussianBlur(block_texture_, block_texture_, Size(0, 0), 2.0);
+    }
+  }
+
+  void frame(int k, Mat& img) const
+  {
+    Point2f d = offset(k);
+    texture_(Rect(40 + d.x, 40 + d.y, size_.width, size_.height)).copyTo(img);
+    if (moving_block_)
+    {
+      Point2f b = block_offset(k);
+      block_texture_(block_ + Point(40 + b.x, 40 + b.y)).copyTo(img(block_));
+    }
+  }
+
+  // How far the scene and the block moved between frames k-1 and k
+  Point2f motion(int k) const { return offset(k - 1) - offset(k); }
+  Point2f block_motion(int k) const { return block_offset(k - 1) - block_offset(k); }
+
+  // Where a point seen at pt in frame 0 is in frame k
+  Point2f track(int k, const Point2f& pt) const
+  {
+    return pt + offset(0) - offset(k);
+  }
+
+private:
+  Point2f offset(int k) const
+  {
+    static const int offsets[] = {0, 1, 2, 1, 0, -1, -2, -1};
+    return Point2f(offsets[k % 8], offsets[(k + 2) % 8]);
+  }
+  Point2f block_offset(int k) const
+  {
+    Point2f d = offset(k);
+    return Point2f(-d.y, d.x);
+  }
+
+  Mat texture_;
+  Mat block_texture_;
+  Size size_;
+  bool moving_block_;
+  Rect block_ = Rect(110, 70, 100, 100);
+};
+
+// A feature mask that keeps new features 20 pixels away from the edges, written into a
+// temporary directory of its own, which is removed again along with the mask
+class EdgeMaskFile
+{
+public:
+  EdgeMaskFile()
+  {
+    const char* tmp = getenv("TMPDIR");
+    std::string dir = std::string(tmp ? tmp : "/tmp") + "/klt_test_XXXXXX";
+    if (mkdtemp(&dir[0]) == nullptr)
+      return;
+    dir_ = dir;
+    file_ = dir_ + "/mask.png";
+    Mat mask(240, 320, CV_8UC1, Scalar(0));
+    mask(Rect(20, 20, 280, 200)).setTo(255);
+    imwrite(file_, mask);
+  }
+
+  ~EdgeMaskFile()
+  {
+    if (dir_.empty())
+      return;
+    remove(file_.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  const std::string& file() const { return file_; }
+
+private:
+  std::string dir_;
+  std::string file_;
+};
+
+// How a steady state run sets up the tracker
+struct SteadyStateCase
+{
+  std::string name;
+  KLT_Tracker::detector_t detector;
+  bool drop_tracks; // the two oldest tracks go after every frame, so the detector refills the grid every frame
+  int scale_level; // set_resolution
+  bool reject_outliers; // forward-backward check, and the RANSAC (the frames come with a rotation)
+  bool async; // detection on the tracker's worker thread
+};
+
+// Allocations made by each group of OpenCV calls on a frame
+struct FrameAllocations
+{
+  long convert = 0;
+  long pyramid = 0;
+  long track = 0;
+  long detection = 0;
+  long total() const { return convert + pyramid + track + detection; }
+};
+
+std::ostream& operator<<(std::ostream& os, const FrameAllocations& a)
+{
+  return os << "convert " << a.convert << ", pyramid " << a.pyramid << ", track " << a.track
+            << ", detection " << a.detection;
+}
+
+// The OpenCV calls the tracker makes on a frame, with the same arguments, made directly with
+// buffers kept across frames.  Whatever they allocate is OpenCV's own work (e.g.
+// calcOpticalFlowPyrLK copies the pyramid headers into vectors of its own, and
+// goodFeaturesToTrack builds its candidate list and distance grid), so it bounds what the
+// tracker may allocate on that frame.  The detector gets the tracker's inputs: for GFTT the
+// feature mask with the cells holding a point blanked out (cells one radius across) and twice
+// the missing feature count, for GRID_FAST only the cells without a point.
+class OpenCVCalls
+{
+public:
+  OpenCVCalls(const std::string& mask_file, const SteadyStateCase& c, int levels, int window, int cell_size,
+              int fast_threshold, int radius) :
+    levels_(std::max(levels - c.scale_level, 0)), window_(window, window), scale_level_(c.scale_level),
+    detector_(c.detector), cell_size_(std::max(cell_size >> c.scale_level, 8)), fast_threshold_(fast_threshold),
+    radius_(radius), fb_(c.reject_outliers), initial_flow_(c.reject_outliers), async_(c.async),
+    tile_size_(window + 2 * ((1 << c.scale_level) + 2))
+  {
+    mask_ = imread(mask_file, IMREAD_GRAYSCALE);
+  }
+
+  // Makes the calls for a frame: tracking prev_features from the last frame, searching for up
+  // to max_corners new corners away from points (none if max_corners is 0), and, at reduced
+  // resolution, cutting the tiles around the features the frame ends with.  Once the output
+  // vectors are big enough, what LK allocates doesn't depend on how many points it tracks.
+  void frame(const Mat& img, const std::vector<Point2f>& prev_features, const std::vector<Point2f>& points,
+             int max_corners, const std::vector<Point2f>& features, FrameAllocations& allocs)
+  {
+    long before = num_allocations;
+    const Mat* src = &img;
+    if (scale_level_ > 0)
+    {
+      resize(img, small_img_, Size(img.cols >> scale_level_, img.rows >> scale_level_), 0, 0, INTER_AREA);
+      src = &small_img_;
+    }
+    cvtColor(*src, grey_, COLOR_BGR2GRAY);
+    allocs.convert = num_allocations - before;
+
+    before = num_allocations;
+    buildOpticalFlowPyramid(grey_, pyramid_, window_, levels_);
+    allocs.pyramid = num_allocations - before;
+
+    allocs.track = 0;
+    if (!prev_pyramid_.empty())
+      allocs.track += track(img, prev_features, points);
+
+    // The point mask is the tracker's own buffer, only the detector call counts
+    allocs.detection = (max_corners > 0) ? detect(points, max_corners) : 0;
+
+    if (scale_level_ > 0)
+    {
+      before = num_allocations;
+      int rows = std::max(((int)features.size() + TILE_COLS - 1) / TILE_COLS, 1);
+      prev_tiles_.create(rows * tile_size_, TILE_COLS * tile_size_, CV_8UC1);
+      for (int i = 0; i < features.size(); i++)
+        cut_tile(img, features[i], prev_tiles_, i);
+      allocs.track += num_allocations - before;
+    }
+
+    std::swap(pyramid_, prev_pyramid_);
+  }
+
+private:
+  enum { TILE_COLS = 8 };
+
+  Point2f to_scaled(const Point2f& pt) const
+  {
+    float s = 1 << scale_level_;
+    return Point2f((pt.x + 0.5f) / s - 0.5f, (pt.y + 0.5f) / s - 0.5f);
+  }
+
+  long track(const Mat& img, const std::vector<Point2f>& prev_features, const std::vector<Point2f>& points)
+  {
+    TermCriteria criteria(TermCriteria::COUNT+TermCriteria::EPS, 30, 0.01);
+    long before = num_allocations;
+    prev_pts_.resize(prev_features.size());
+    for (int i = 0; i < prev_features.size(); i++)
+      prev_pts_[i] = to_scaled(prev_features[i]);
+    pts_.assign(prev_pts_.begin(), prev_pts_.end());
+    calcOpticalFlowPyrLK(prev_pyramid_, pyramid_, prev_pts_, pts_, status_, err_, window_, levels_, criteria,
+                         initial_flow_ ? OPTFLOW_USE_INITIAL_FLOW : 0);
+    if (fb_)
+    {
+      back_pts_.assign(prev_pts_.begin(), prev_pts_.end());
+      calcOpticalFlowPyrLK(pyramid_, prev_pyramid_, pts_, back_pts_, back_status_, back_err_, window_, levels_,
+                           criteria, OPTFLOW_USE_INITIAL_FLOW);
+    }
+    if (scale_level_ > 0 && !prev_tiles_.empty())
+    {
+      // Full resolution refinement, between last frame's tiles and tiles around this frame's points
+      tiles_.create(prev_tiles_.size(), CV_8UC1);
+      tile_prev_pts_.resize(prev_features.size());
+      tile_pts_.resize(prev_features.size());
+      for (int i = 0; i < prev_features.size(); i++)
+        tile_prev_pts_[i] = tile_pts_[i] = Point2f((i % TILE_COLS) * tile_size_ + tile_size_ / 2,
+                                                   (i / TILE_COLS) * tile_size_ + tile_size_ / 2);
+      for (int i = 0; i < points.size() && i < prev_features.size(); i++)
+        cut_tile(img, points[i], tiles_, i);
+      calcOpticalFlowPyrLK(prev_tiles_, tiles_, tile_prev_pts_, tile_pts_, refine_status_, refine_err_, window_, 0,
+                           criteria, OPTFLOW_USE_INITIAL_FLOW);
+    }
+    return num_allocations - before;
+  }
+
+  void cut_tile(const Mat& img, const Point2f& pt, Mat& tiles, int index)
+  {
+    Rect tile(cvRound(pt.x) - tile_size_/2, cvRound(pt.y) - tile_size_/2, tile_size_, tile_size_);
+    Rect inside = tile & Rect(0, 0, img.cols, img.rows);
+    if (inside.empty() || (index / TILE_COLS + 1) * tile_size_ > tiles.rows)
+      return;
+    Mat dst = tiles(Rect((index % TILE_COLS) * tile_size_, (index / TILE_COLS) * tile_size_, tile_size_, tile_size_));
+    Mat dst_inside = dst(Rect(inside.x - tile.x, inside.y - tile.y, inside.width, inside.height));
+    cvtColor(img(inside), dst_inside, COLOR_BGR2GRAY);
+  }
+
+  long detect(const std::vector<Point2f>& points, int max_corners)
+  {
+    // An asynchronous search runs on the level 0 image of the frame's pyramid
+    const Mat& img = async_ ? pyramid_[0] : grey_;
+    long before;
+    if (detector_ == KLT_Tracker::GFTT)
+    {
+      int cols = (mask_.cols + radius_ - 1) / radius_;
+      int rows = (mask_.rows + radius_ - 1) / radius_;
+      mask_.copyTo(point_mask_);
+      for (int i = 0; i < points.size(); i++)
+      {
+        int col = std::min(std::max((int)(points[i].x / radius_), 0), cols - 1);
+        int row = std::min(std::max((int)(points[i].y / radius_), 0), rows - 1);
+        point_mask_(Rect(col * radius_, row * radius_, radius_, radius_) & Rect(0, 0, mask_.cols, mask_.rows)).setTo(0);
+      }
+      before = num_allocations;
+      if (scale_level_ > 0)
+      {
+        resize(point_mask_, scaled_mask_, img.size(), 0, 0, INTER_NEAREST);
+        goodFeaturesToTrack(img, corners_, max_corners, 0.3, std::max(radius_ >> scale_level_, 1), scaled_mask_, 7);
+      }
+      else
+      {
+        goodFeaturesToTrack(img, corners_, max_corners, 0.3, radius_, point_mask_, 7);
+      }
+      return num_allocations - before;
+    }
+
+    cols_ = (img.cols + cell_size_ - 1) / cell_size_;
+    int rows = (img.rows + cell_size_ - 1) / cell_size_;
+    cell_has_point_.assign(cols_ * rows, 0);
+    for (int i = 0; i < points.size(); i++)
+    {
+      Point2f pt = to_scaled(points[i]);
+      int col = std::min(std::max((int)(pt.x / cell_size_), 0), cols_ - 1);
+      int row = std::min(std::max((int)(pt.y / cell_size_), 0), rows - 1);
+      cell_has_point_[row * cols_ + col] = 1;
+    }
+    empty_cells_.clear();
+    for (int cell = 0; cell < cols_ * rows; cell++)
+    {
+      if (!cell_has_point_[cell])
+        empty_cells_.push_back(cell);
+    }
+    if (cell_corners_.size() < empty_cells_.size())
+      cell_corners_.resize(empty_cells_.size());
+    detect_img_ = &img;
+    before = num_allocations;
+    parallel_for_(Range(0, empty_cells_.size()), [this](const Range& range)
+    {
+      const Mat& img = *detect_img_;
+      for (int k = range.start; k < range.end; k++)
+      {
+        int cell = empty_cells_[k];
+        Rect cell_rect = Rect((cell % cols_) * cell_size_, (cell / cols_) * cell_size_, cell_size_, cell_size_)
+                         & Rect(0, 0, img.cols, img.rows);
+        Rect roi = Rect(cell_rect.x - 3, cell_rect.y - 3, cell_rect.width + 6, cell_rect.height + 6)
+                   & Rect(0, 0, img.cols, img.rows);
+        cell_corners_[k].clear();
+        FAST(img(roi), cell_corners_[k], fast_threshold_, true);
+      }
+    });
+    return num_allocations - before;
+  }
+
+  int levels_;
+  Size window_;
+  int scale_level_;
+  KLT_Tracker::detector_t detector_;
+  int cell_size_;
+  int cols_;
+  int fast_threshold_;
+  int radius_;
+  bool fb_;
+  bool initial_flow_;
+  bool async_;
+  int tile_size_;
+  Mat mask_;
+  Mat point_mask_;
+  Mat scaled_mask_;
+  Mat small_img_;
+  Mat grey_;
+  const Mat* detect_img_;
+  std::vector<Mat> pyramid_, prev_pyramid_;
+  std::vector<Point2f> prev_pts_, pts_, back_pts_, corners_;
+  std::vector<uchar> status_, back_status_, refine_status_;
+  std::vector<float> err_, back_err_, refine_err_;
+  Mat tiles_, prev_tiles_;
+  std::vector<Point2f> tile_prev_pts_, tile_pts_;
+  std::vector<uchar> cell_has_point_;
+  std::vector<int> empty_cells_;
+  std::vector<std::vector<KeyPoint>> cell_corners_;
+};
+
+// Tracks a moving texture, counting every allocation in each frame, and checks that once the
+// buffers settle a frame allocates no more than the OpenCV calls it makes do on their own.
+void KLT_steady_state_allocations(const SteadyStateCase& c)
+{
+  SCOPED_TRACE(c.name);
+
+  // Run OpenCV on this thread only (and on the tracker's worker), so OpenCV's own worker
+  // threads don't show up in the counts
+  cv::setNumThreads(0);
+
+  int num_features = 15;
+  int radius = 30;
+  int levels = 3;
+  int window = 13;
+  int cell_size = 40;
+  int fast_threshold = 20;
+  EdgeMaskFile mask;
+  ASSERT_FALSE(mask.file().empty());
+  KLT_Tracker tracker;
+  tracker.init(num_features, false, radius, Size(320, 240));
+  tracker.set_feature_mask(mask.file());
+  tracker.set_resolution(c.scale_level);
+  tracker.set_pyramid(levels, window);
+  tracker.set_detector(c.detector, cell_size, 2, fast_threshold);
+  if (c.reject_outliers)
+  {
+    tracker.set_camera(Eigen::Vector2d(300, 300), Eigen::Vector2d(160, 120));
+    tracker.set_outlier_rejection(0.5, 0.5);
+  }
+  tracker.set_detection_policy(1, 1.0, c.async);
+  OpenCVCalls opencv(mask.file(), c, levels, window, cell_size, fast_threshold, radius);
+
+  // An asynchronous search is part of the frame that started it, so wait for the worker to
+  // finish it (the tracker's setters all wait for it) before counting the next thing
+  auto load_image = [&](const Mat& img, double t, std::vector<Point2f>& features, std::vector<int>& ids)
+  {
+    if (c.reject_outliers)
+      tracker.load_image(img, t, Eigen::Matrix3d::Identity(), features, ids);
+    else
+      tracker.load_image(img, t, features, ids);
+    if (c.async)
+      tracker.set_detection_policy(1, 1.0, true);
+  };
+
+  MovingTexture texture;
+  Mat img;
+  std::vector<Point2f> features, prev_features, points;
+  std::vector<int> ids;
+  FrameAllocations allocs;
+  texture.frame(0, img);
+  load_image(img, 0.0, features, ids);
+  opencv.frame(img, prev_features, features, 0, features, allocs);
+  ASSERT_GT(features.size(), 5u);
+  int max_id = *std::max_element(ids.begin(), ids.end());
+  if (!c.drop_tracks)
+  {
+    // Don't go looking for features that aren't there
+    num_features = features.size();
+    tracker.set_num_features(num_features);
+  }
+  prev_features = features;
+
+  int num_frames = 40;
+  int warmup_frames = 10;
+  int num_detections = 0;
+  for (int k = 1; k <= num_frames; k++)
+  {
+    texture.frame(k, img);
+
+    long before = num_allocations;
+    load_image(img, 0.033 * k, features, ids);
+    long tracked = num_allocations - before;
+
+    // The points the detector had to stay away from: the ones that survived tracking (the new
+    // corners come after them, with new ids), or all of them for a search started after the frame
+    points.clear();
+    for (int i = 0; i < features.size(); i++)
+    {
+      if (c.async || ids[i] <= max_id)
+        points.push_back(features[i]);
+    }
+    int max_corners = ((int)points.size() < num_features) ? 2 * (num_features - (int)points.size()) : 0;
+    if (!ids.empty())
+      max_id = std::max(max_id, *std::max_element(ids.begin(), ids.end()));
+    opencv.frame(img, prev_features, points, max_corners, features, allocs);
+
+    if (k > warmup_frames)
+    {
+      num_detections += max_corners > 0;
+      EXPECT_LE(tracked, allocs.total()) << "frame " << k << ": " << allocs;
+    }
+
+    // Between frames, the tracker's points are the reported ones, less the dropped tracks
+    prev_features = features;
+    if (c.drop_tracks)
+    {
+      int num_dropped = 0;
+      for (int i = 0; i < 2 && i < ids.size(); i++)
+        num_dropped += tracker.drop_feature(ids[i]);
+      prev_features.erase(prev_features.begin(), prev_features.begin() + num_dropped);
+    }
+  }
+  if (c.drop_tracks)
+    EXPECT_GT(num_detections, (num_frames - warmup_frames) / 2);
+}
+
+void KLT_zero_allocation_test()
+{
+  // Once the buffers have settled, the tracker's own code allocates nothing, whether it only
+  // tracks or also refills the tracks it loses: a frame allocates no more than the OpenCV
+  // calls it makes would on their own
+  KLT_steady_state_allocations({"GFTT", KLT_Tracker::GFTT, false, 0, false, false});
+  KLT_steady_state_allocations({"GFTT, dropping tracks", KLT_Tracker::GFTT, true, 0, false, false});
+  KLT_steady_state_allocations({"GRID_FAST, dropping tracks", KLT_Tracker::GRID_FAST, true, 0, false, false});
+  // At half resolution (with the full resolution refinement), with outlier rejection, and
+  // with the search on the worker thread
+  KLT_steady_state_allocations({"GFTT, dropping tracks, half resolution, outlier rejection, async detection",
+                                KLT_Tracker::GFTT, true, 1, true, true});
+}
+TEST(KLT_Tracker, zero_allocation_test){KLT_zero_allocation_test();}
+
+void KLT_reduced_resolution_test()
+{
+  EdgeMaskFile mask;
+
+  KLT_Tracker tracker;
+  tracker.init(15, false, 30, Size(320, 240));
+  tracker.set_feature_mask(mask.file());
+  tracker.set_pyramid(3, 13);
+  tracker.set_resolution(1);
+  EXPECT_EQ(tracker.get_scale_level(), 1);
+
+  MovingTexture texture;
+  Mat img;
+  std::vector<Point2f> features, first_features;
+  std::vector<int> ids, first_ids;
+  texture.frame(0, img);
+  tracker.load_image(img, 0.0, first_features, first_ids);
+  ASSERT_GT(first_features.size(), 5u);
+
+  // Tracked on the half resolution image, but the points still land on the full resolution truth
+  for (int k = 1; k <= 20; k++)
+  {
+    texture.frame(k, img);
+    tracker.load_image(img, 0.033 * k, features, ids);
+    int num_found = 0;
+    for (int i = 0; i < first_ids.size(); i++)
+    {
+      auto it = std::find(ids.begin(), ids.end(), first_ids[i]);
+      if (it == ids.end())
+        continue;
+      Point2f err = features[it - ids.begin()] - texture.track(k, first_features[i]);
+      EXPECT_LT(std::max(std::abs(err.x), std::abs(err.y)), 0.05) << "frame " << k << " id " << first_ids[i];
+      num_found++;
+    }
+    EXPECT_GT(num_found, first_ids.size() / 2) << "frame " << k;
+  }
+}
+TEST(KLT_Tracker, reduced_resolution_test){KLT_reduced_resolution_test();}
+
+void KLT_resolution_budget_test()
+{
+  KLT_Tracker tracker;
+  tracker.init(15, false, 30, Size(320, 240));
+  tracker.set_pyramid(3, 13);
+  // Nothing fits in the budget, so the scale walks all the way down, one level at a time
+  tracker.set_resolution(2, 1e-6);
+  EXPECT_EQ(tracker.get_scale_level(), 0);
+
+  MovingTexture texture;
+  Mat img;
+  std::vector<Point2f> features;
+  std::vector<int> ids;
+  int prev_level = 0;
+  for (int k = 0; k < 40; k++)
+  {
+    texture.frame(k, img);
+    tracker.load_image(img, 0.033 * k, features, ids);
+    EXPECT_GT(features.size(), 0u) << "frame " << k;
+    EXPECT_LE(tracker.get_scale_level() - prev_level, 1) << "frame " << k;
+    EXPECT_GE(tracker.get_scale_level(), prev_level) << "frame " << k;
+    prev_level = tracker.get_scale_level();
+  }
+  EXPECT_EQ(tracker.get_scale_level(), 2);
+}
+TEST(KLT_Tracker, resolution_budget_test){KLT_resolution_budget_test();}
+
+// Counts the tracks that follow the moving block from one frame to the next
+int KLT_block_tracks(bool reject_outliers)
+{
+  EdgeMaskFile mask;
+
+  KLT_Tracker tracker;
+  tracker.init(40, false, 20, Size(320, 240));
+  tracker.set_feature_mask(mask.file());
+  tracker.set_pyramid(3, 13);
+  tracker.set_camera(Eigen::Vector2d(300, 300), Eigen::Vector2d(160, 120));
+  if (reject_outliers)
+    tracker.set_outlier_rejection(0.5, 0.5);
+
+  MovingTexture texture(320, 240, true);
+  Mat img;
+  std::vector<Point2f> features, prev_features;
+  std::vector<int> ids, prev_ids;
+  int num_block_tracks = 0;
+  for (int k = 0; k < 16; k++)
+  {
+    texture.frame(k, img);
+    // The camera doesn't rotate
+    tracker.load_image(img, 0.033 * k, Eigen::Matrix3d::Identity(), features, ids);
+    for (int i = 0; k > 0 && i < ids.size(); i++)
+    {
+      auto it = std::find(prev_ids.begin(), prev_ids.end(), ids[i]);
+      if (it == prev_ids.end())
+        continue;
+      Point2f d = features[i] - prev_features[it - prev_ids.begin()];
+      if (norm(d - texture.block_motion(k)) < 0.1 && norm(d - texture.motion(k)) > 1.0)
+        num_block_tracks++;
+    }
+    prev_features = features;
+    prev_ids = ids;
+  }
+  return num_block_tracks;
+}
+
+void KLT_outlier_rejection_test()
+{
+  // The block's motion isn't one a translating camera would see, so its tracks go once the
+  // RANSAC is told the rotation
+  EXPECT_GT(KLT_block_tracks(false), 0);
+  EXPECT_EQ(KLT_block_tracks(true), 0);
+}
+TEST(KLT_Tracker, outlier_rejection_test){KLT_outlier_rejection_test();}
+
+// Drops the two oldest tracks after every frame, and returns the frames that got new features
+std::vector<int> KLT_detection_frames(int interval, bool async)
+{
+  KLT_Tracker tracker;
+  tracker.init(15, false, 30, Size(320, 240));
+  tracker.set_pyramid(3, 13);
+  tracker.set_detection_policy(interval, 0.0, async);
+
+  MovingTexture texture;
+  Mat img;
+  std::vector<Point2f> features;
+  std::vector<int> ids;
+  int max_id = -1;
+  std::vector<int> detection_frames;
+  for (int k = 0; k < 20; k++)
+  {
+    texture.frame(k, img);
+    tracker.load_image(img, 0.033 * k, features, ids);
+    EXPECT_FALSE(features.empty()) << "frame " << k;
+    if (!ids.empty() && *std::max_element(ids.begin(), ids.end()) > max_id)
+    {
+      if (k > 0)
+        detection_frames.push_back(k);
+      max_id = *std::max_element(ids.begin(), ids.end());
+    }
+    for (int i = 0; i < 2 && i < ids.size(); i++)
+      tracker.drop_feature(ids[i]);
+  }
+  return detection_frames;
+}
+
+void KLT_detection_policy_test()
+{
+  // Tracks go missing every frame, but the search only runs every 4th, and when it runs on the
+  // worker its corners show up a frame later
+  std::vector<int> sync_frames = KLT_detection_frames(4, false);
+  std::vector<int> async_frames = KLT_detection_frames(4, true);
+  EXPECT_EQ(sync_frames, std::vector<int>({4, 8, 12, 16}));
+  EXPECT_EQ(async_frames, std::vector<int>({5, 9, 13, 17}));
+}
+TEST(KLT_Tracker, detection_policy_test){KLT_detection_policy_test();}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
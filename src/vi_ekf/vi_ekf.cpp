@@ -1,9 +1,20 @@
 #include "vi_ekf.h"
+#include "rts_smoother.h"
 
 namespace vi_ekf
 {
 
-VIEKF::VIEKF(){}
+VIEKF::VIEKF()
+{
+  for (int i = 0; i < TOTAL_LOGS; i++)
+  {
+    log_enabled_[i] = true;
+    log_period_[i] = 0.0;
+    log_last_t_[i] = -INFINITY;
+  }
+  // Full covariance snapshots are large, so they are only written when asked for
+  log_enabled_[LOG_COV] = false;
+}
 
 void VIEKF::init(Matrix<double, xZ,1>& x0, Matrix<double, dxZ,1> &P0, Matrix<double, dxZ,1> &Qx,
                  Matrix<double, dxZ,1> &lambda, uVector &Qu, Vector3d& P0_feat, Vector3d& Qx_feat,
@@ -37,21 +48,31 @@ void VIEKF::init(Matrix<double, xZ,1>& x0, Matrix<double, dxZ,1> &P0, Matrix<dou
   Qu_ = Qu.asDiagonal();
   P0_feat_ = P0_feat.asDiagonal();
   
+  gain_mask_.setOnes();
   Lambda_ = dx_ones_ * lambda_.transpose() + lambda_*dx_ones_.transpose() - lambda_*lambda_.transpose();
   
   len_features_ = 0;
   next_feature_id_ = 0;
   
   current_feature_ids_.clear();
+  feature_slot_end_ = 0;
+  slot_feature_ids_.assign(NUM_FEATURES, -1);
+  feature_slots_.clear();
+  free_slots_.clear();
+  for (int i = 0; i < NUM_FEATURES; i++)
+  {
+    free_slots_.insert(i);
+  }
+  slot_consider_.assign(NUM_FEATURES, 0);
+  slot_updates_.assign(NUM_FEATURES, 0);
+  slot_camera_.assign(NUM_FEATURES, 0);
+  max_estimated_features_ = NUM_FEATURES;
+  max_features_ = NUM_FEATURES;
+  num_consider_features_ = 0;
   
-  // set cam-to-body
-  p_b_c_ = p_b_c;
-  q_b_c_ = Quatd(q_b_c);
-  
-  // set camera intrinsics
-  cam_center_ = cam_center;
-  cam_F_ << focal_len(0), 0, 0,
-            0, focal_len(1), 0;
+  // set the primary camera (any others are added afterwards)
+  cameras_.clear();
+  add_camera(cam_center, focal_len, q_b_c, p_b_c);
   
   use_drag_term_ = use_drag_term;
   partial_update_ = partial_update;
@@ -69,6 +90,9 @@ void VIEKF::init(Matrix<double, xZ,1>& x0, Matrix<double, dxZ,1> &P0, Matrix<dou
   edges_.clear();
   keyframe_reset_callback_ = nullptr;
   
+  if (smoother_)
+    smoother_->clear();
+  
   if (log_directory.compare("~") != 0)
     init_logger(log_directory);
   
@@ -88,16 +112,7 @@ void VIEKF::register_keyframe_reset_callback(std::function<void(void)> cb)
 
 
 VIEKF::~VIEKF()
-{
-  if (log_)
-  {
-    for (std::vector<std::ofstream>::iterator it=log_->begin(); it!=log_->end(); ++it)
-    {
-      (*it) << endl;
-      (*it).close();
-    }
-  }
-}
+{}
 
 void VIEKF::set_imu_bias(const Vector3d& b_g, const Vector3d& b_a)
 {
@@ -129,12 +144,106 @@ const dxVector VIEKF::get_covariance_diagonal() const
 
 
 
+bool VIEKF::bracket_history(const double t, int& ia, int& ib, double& alpha) const
+{
+  // The oldest entry in the circular buffer is just after the head, so binary search
+  // over the logical (oldest to newest) index
+  int lo = 0;
+  int hi = LEN_STATE_HIST - 1;
+  if (t_[i_] < 0 || t > t_[i_])
+    return false;
+  while (hi - lo > 1)
+  {
+    int mid = (lo + hi) / 2;
+    if (t_[(i_ + 1 + mid) % LEN_STATE_HIST] <= t)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  ia = (i_ + 1 + lo) % LEN_STATE_HIST;
+  ib = (i_ + 1 + hi) % LEN_STATE_HIST;
+
+  // Make sure we actually bracketed t (it might be older than the history)
+  if (t_[ia] < 0 || t_[ia] > t || t_[ib] < t)
+    return false;
+
+  double dt = t_[ib] - t_[ia];
+  alpha = (dt > 1e-9) ? (t - t_[ia]) / dt : 0.0;
+  return true;
+}
+
+bool VIEKF::state_at(const double t, xVector& x) const
+{
+  int ia, ib;
+  double alpha;
+  if (!bracket_history(t, ia, ib, alpha))
+    return false;
+
+  const xVector& xa = x_[ia];
+  const xVector& xb = x_[ib];
+
+  // Take the features from the closest state (the features may not line up between the two)
+  x = (alpha < 0.5) ? xa : xb;
+
+  // Interpolate the vehicle states on the manifold
+  x.block<6,1>((int)xPOS, 0) = xa.block<6,1>((int)xPOS, 0) + alpha * (xb.block<6,1>((int)xPOS, 0) - xa.block<6,1>((int)xPOS, 0));
+  Quatd qa(xa.block<4,1>((int)xATT, 0));
+  Quatd qb(xb.block<4,1>((int)xATT, 0));
+  x.block<4,1>((int)xATT, 0) = (qa + alpha * (qb - qa)).elements();
+  x.block<7,1>((int)xB_A, 0) = xa.block<7,1>((int)xB_A, 0) + alpha * (xb.block<7,1>((int)xB_A, 0) - xa.block<7,1>((int)xB_A, 0));
+  return true;
+}
+
+bool VIEKF::pose_at(const double t, Xformd& pose) const
+{
+  int ia, ib;
+  double alpha;
+  if (!bracket_history(t, ia, ib, alpha))
+    return false;
+
+  Vector3d pa = x_[ia].block<3,1>((int)xPOS, 0);
+  Vector3d pb = x_[ib].block<3,1>((int)xPOS, 0);
+  Quatd qa(x_[ia].block<4,1>((int)xATT, 0));
+  Quatd qb(x_[ib].block<4,1>((int)xATT, 0));
+  pose.t() = pa + alpha * (pb - pa);
+  pose.q() = qa + alpha * (qb - qa);
+  return true;
+}
+
+bool VIEKF::pose_at(const double t, Xformd& pose, Matrix6d& cov) const
+{
+  int ia, ib;
+  double alpha;
+  if (!pose_at(t, pose) || !bracket_history(t, ia, ib, alpha))
+    return false;
+
+  const dxMatrix& Pa = P_[ia];
+  const dxMatrix& Pb = P_[ib];
+  cov.block<3,3>(0, 0) = (1.0 - alpha) * Pa.block<3,3>((int)dxPOS, (int)dxPOS) + alpha * Pb.block<3,3>((int)dxPOS, (int)dxPOS);
+  cov.block<3,3>(0, 3) = (1.0 - alpha) * Pa.block<3,3>((int)dxPOS, (int)dxATT) + alpha * Pb.block<3,3>((int)dxPOS, (int)dxATT);
+  cov.block<3,3>(3, 0) = (1.0 - alpha) * Pa.block<3,3>((int)dxATT, (int)dxPOS) + alpha * Pb.block<3,3>((int)dxATT, (int)dxPOS);
+  cov.block<3,3>(3, 3) = (1.0 - alpha) * Pa.block<3,3>((int)dxATT, (int)dxATT) + alpha * Pb.block<3,3>((int)dxATT, (int)dxATT);
+  return true;
+}
+
+bool VIEKF::covariance_at(const double t, dxMatrix& P) const
+{
+  int ia, ib;
+  double alpha;
+  if (!bracket_history(t, ia, ib, alpha))
+    return false;
+
+  P = (1.0 - alpha) * P_[ia] + alpha * P_[ib];
+  return true;
+}
+
 VectorXd VIEKF::get_depths() const
 {
   VectorXd out(len_features_);
   for (int i = 0; i < len_features_; i++)
   {
-    out[i] = 1.0/x_[i_]((int)xZ + 4 + 5*i);
+    int slot = global_to_local_feature_id(current_feature_ids_[i]);
+    out[i] = 1.0/x_[i_]((int)xZ + 4 + 5*slot);
   }
   return out;
 }
@@ -144,7 +253,8 @@ MatrixXd VIEKF::get_zetas() const
   MatrixXd out(3, len_features_);
   for (int i = 0; i < len_features_; i++)
   {
-    Vector4d qzeta = x_[i_].block<4,1>(xZ + 5*i,0);
+    int slot = global_to_local_feature_id(current_feature_ids_[i]);
+    Vector4d qzeta = x_[i_].block<4,1>(xZ + 5*slot,0);
     out.block<3,1>(0,i) = Quatd(qzeta).rota(e_z);
   }
   return out;
@@ -155,7 +265,8 @@ MatrixXd VIEKF::get_qzetas() const
   MatrixXd out(4, len_features_);
   for (int i = 0; i < len_features_; i++)
   {
-    out.block<4,1>(0,i) = x_[i_].block<4,1>(xZ + 5*i,0);
+    int slot = global_to_local_feature_id(current_feature_ids_[i]);
+    out.block<4,1>(0,i) = x_[i_].block<4,1>(xZ + 5*slot,0);
   }
   return out;
 }
@@ -175,10 +286,11 @@ double VIEKF::get_depth(const int id) const
 Vector2d VIEKF::get_feat(const int id) const
 {
   int i = global_to_local_feature_id(id);
+  const camera_t& cam = cameras_[slot_camera_[i]];
   Quatd q_zeta(x_[i_].block<4,1>(xZ+i*5, 0));
   Vector3d zeta = q_zeta.rota(e_z);
   double ezT_zeta = e_z.transpose() * zeta;
-  return cam_F_ * zeta / ezT_zeta + cam_center_;
+  return cam.F * zeta / ezT_zeta + cam.center;
 }
 
 void VIEKF::propagate_state(const uVector &u, const double t, bool save_input)
@@ -195,6 +307,40 @@ void VIEKF::propagate_state(const uVector &u, const double t, bool save_input)
     return;
   }
 
+  int idx[MAX_DX];
+  int n = estimated_index(idx);
+  propagate_step(u, t, idx, n, true);
+}
+
+void VIEKF::propagate_states(const std::pair<double, uVector>* samples, const int n)
+{
+  if (n <= 0)
+    return;
+
+  // Save the inputs with a single insert, newest first as propagate_state leaves them, and
+  // only keep as many as the state history can rewind to
+  typedef std::reverse_iterator<const std::pair<double, uVector>*> rev_it;
+  u_.insert(u_.begin(), rev_it(samples + n), rev_it(samples));
+  if (u_.size() > LEN_STATE_HIST)
+    u_.erase(u_.begin() + LEN_STATE_HIST, u_.end());
+
+  int k = 0;
+  if (std::isnan(start_t_))
+    propagate_state(samples[k++].second, samples[0].first, false);
+
+  // The features can't change until the next measurement, so the estimated rows and whether
+  // log_state has anything to write are worked out once for the whole batch.  Each sample is
+  // still propagated on its own, so the state history is the same as one propagate_state each.
+  int idx[MAX_DX];
+  int len_idx = estimated_index(idx);
+  bool log = log_ && (log_enabled_[LOG_STATE] || log_enabled_[LOG_COV] || log_enabled_[LOG_INPUT]
+                      || log_enabled_[LOG_XDOT] || log_enabled_[LOG_FEATURE_IDS]);
+  for (; k < n; k++)
+    propagate_step(samples[k].second, samples[k].first, idx, len_idx, log);
+}
+
+void VIEKF::propagate_step(const uVector& u, const double t, const int* idx, const int n, const bool log)
+{
   double dt = t - t_[i_];
   if (dt < 1e-6)
     return;
@@ -209,8 +355,10 @@ void VIEKF::propagate_state(const uVector &u, const double t, bool save_input)
 
   // Propagate State and Covariance
   boxplus(x_[i_], dx_*dt, x_[ip]);
+  propagate_covariance(P_[i_], dt, idx, n, P_[ip]);
   A_ = I_big_ + A_*dt;
-  P_[ip] = A_ * P_[i_]* A_.transpose() + G_ * Qu_ * G_.transpose() + Qx_;
+  if (smoother_)
+    smoother_->push_step(t_[i_], x_[i_], P_[i_], t, A_, x_[ip], P_[ip]);
   t_[ip] = t;
   i_ = ip;
 
@@ -222,15 +370,66 @@ void VIEKF::propagate_state(const uVector &u, const double t, bool save_input)
   NAN_CHECK;
   NEGATIVE_DEPTH;
   
-  log_state(t, x_[i_], P_[i_].diagonal(), u, dx_);
+  if (log)
+    log_state(t, x_[i_], P_[i_], u, dx_);
 }
 
-}
-
-
-
-
-
 
+void VIEKF::propagate_covariance(const dxMatrix& P, const double dt, const int* idx, const int n, dxMatrix& P_out)
+{
+  // The core states and the estimated features (idx, from estimated_index) are propagated
+  // together.  Free slots have no rows in A, and the consider features are handled below, so
+  // with D = A*dt over the others,
+  //   (I + D) P (I + D)^T = P + D P + (D P)^T + D P D^T
+  // only needs the products over those rows and columns
+
+  D_.resize(n, n);
+  Pidx_.resize(n, n);
+  for (int r = 0; r < n; r++)
+  {
+    for (int c = 0; c < n; c++)
+    {
+      D_(r, c) = A_(idx[r], idx[c]) * dt;
+      Pidx_(r, c) = P(idx[r], idx[c]);
+    }
+  }
+  DP_.noalias() = D_ * Pidx_;
+  DPD_.noalias() = DP_ * D_.transpose();
 
+  P_out = P;
+  for (int r = 0; r < n; r++)
+  {
+    for (int c = 0; c < n; c++)
+    {
+      P_out(idx[r], idx[c]) += DP_(r, c) + DP_(c, r) + DPD_(r, c);
+    }
+  }
+  P_out += G_ * Qu_ * G_.transpose() + Qx_;
+
+  // A consider feature only depends on the core states and itself, so with F = I + D its own
+  // block and its cross-covariance with the core states come out the same as if it were
+  // estimated, at a fixed cost per feature
+  //   P_xc <- F_xx (P_xx F_cx^T + P_xc F_cc^T)
+  //   P_cc <- F_cx (P_xx F_cx^T + P_xc F_cc^T) + F_cc (P_cx F_cx^T + P_cc F_cc^T)
+  if (num_consider_features_ == 0)
+    return;
+  Matrix<double, dxZ, dxZ> F_xx = Matrix<double, dxZ, dxZ>::Identity() + A_.topLeftCorner<dxZ, dxZ>() * dt;
+  for (int i = 0; i < feature_slot_end_; i++)
+  {
+    if (!slot_active(i) || !slot_consider_[i])
+      continue;
+    int dxC = dxZ + 3*i;
+    Matrix<double, 3, dxZ> F_cx = A_.block<3, dxZ>(dxC, 0) * dt;
+    Matrix3d F_cc = I_3x3 + A_.block<3, 3>(dxC, dxC) * dt;
+    Matrix<double, dxZ, 3> PFt_x = P.topLeftCorner<dxZ, dxZ>() * F_cx.transpose() + P.block<dxZ, 3>(0, dxC) * F_cc.transpose();
+    Matrix3d PFt_c = P.block<3, dxZ>(dxC, 0) * F_cx.transpose() + P.block<3, 3>(dxC, dxC) * F_cc.transpose();
+    Matrix<double, 3, 6> G_c = G_.block<3, 6>(dxC, 0);
+    Matrix<double, dxZ, 3> P_xc = F_xx * PFt_x + G_.topRows<dxZ>() * Qu_ * G_c.transpose();
+    P_out.block<dxZ, 3>(0, dxC) = P_xc;
+    P_out.block<3, dxZ>(dxC, 0) = P_xc.transpose();
+    P_out.block<3, 3>(dxC, dxC) = F_cx * PFt_x + F_cc * PFt_c + G_c * Qu_ * G_c.transpose() + Qx_.block<3, 3>(dxC, dxC);
+    decouple_consider_feature(P_out, i);
+  }
+}
 
+}
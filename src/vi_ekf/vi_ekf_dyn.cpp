@@ -79,57 +79,127 @@ void VIEKF::dynamics(const xVector& x, const uVector &u, bool state, bool jac)
   }
   
   // Camera Dynamics
-  Vector3d vel_c_i = q_b_c_.rotp(vel + omega.cross(p_b_c_));
-  Vector3d omega_c_i = q_b_c_.rotp(omega);
-  
+  for (auto cam = cameras_.begin(); cam != cameras_.end(); cam++)
+  {
+    cam->vel_c = cam->R_b_c * (vel + omega.cross(cam->p_b_c));
+    cam->omega_c = cam->R_b_c * omega;
+  }
+  bool one_camera = (cameras_.size() == 1);
   
-  Quatd q_zeta;
-  double rho;
-  Vector3d zeta;
-  Matrix<double, 3, 2> T_z;
-  Matrix3d skew_zeta;
-  Matrix3d skew_vel_c = skew(vel_c_i);
-  Matrix3d skew_p_b_c = skew(p_b_c_);
-  Matrix3d R_b_c = q_b_c_.R();
-  int xZETA_i, xRHO_i, dxZETA_i, dxRHO_i;
-  for (int i = 0; i < len_features_; i++)
+  if (use_simd_dynamics_)
   {
-    xZETA_i = (int)xZ+i*5;
-    xRHO_i = (int)xZ+5*i+4;
-    dxZETA_i = (int)dxZ + i*3;
-    dxRHO_i = (int)dxZ + i*3+2;
-    
-    q_zeta = (x.block<4,1>(xZETA_i, 0));
-    rho = x(xRHO_i);
-    zeta = q_zeta.rota(e_z);
-    T_z = T_zeta(q_zeta);
-    skew_zeta = skew(zeta);
-    
-    double rho2 = rho*rho;
-
-    // Feature Dynamics
-    if (state)
+    // Compute all the features at once, then scatter the blocks into dx_, A_ and G_
+    feat_soa_.load(x, (int)xZ, feature_slot_end_);
+    if (!one_camera)
     {
-      dx_.block<2,1>(dxZETA_i,0) = T_z.transpose() * (omega_c_i + rho * zeta.cross(vel_c_i));
-      dx_(dxRHO_i) = rho2 * zeta.dot(vel_c_i);
+      for (int i = 0; i < feat_soa_.padded_len(); i++)
+      {
+        const camera_t& cam = cameras_[(i < feature_slot_end_) ? slot_camera_[i] : 0];
+        feat_soa_.load_camera(i, cam.omega_c, cam.vel_c, cam.R_b_c, cam.p_b_c);
+      }
     }
-    
-    // Feature Jacobian
-    if (jac)
+    for_each_feature_range([&](int begin, int end)
     {
-      A_.block<2, 3>(dxZETA_i, (int)dxVEL) = rho * T_z.transpose() * skew_zeta * R_b_c;
-      A_.block<2, 3>(dxZETA_i, (int)dxB_G) = T_z.transpose() * (rho * skew_zeta * R_b_c * skew_p_b_c - R_b_c);
-      A_.block<2, 2>(dxZETA_i, dxZETA_i) = -T_z.transpose() * (skew(omega_c_i + rho * zeta.cross(vel_c_i)) + (rho * skew_vel_c * skew_zeta)) * T_z;
-      A_.block<2, 1>(dxZETA_i, dxRHO_i) = T_z.transpose() * zeta.cross(vel_c_i);
-      A_.block<1, 3>(dxRHO_i, (int)dxVEL) = rho2 * zeta.transpose() * R_b_c;
-      A_.block<1, 3>(dxRHO_i, (int)dxB_G) = rho2 * zeta.transpose() * R_b_c * skew_p_b_c;
-      A_.block<1, 2>(dxRHO_i, dxZETA_i) = rho2 * vel_c_i.transpose() * skew_zeta * T_z;
-      A_(dxRHO_i, dxRHO_i) = 2 * rho * zeta.transpose() * vel_c_i;
+      if (one_camera)
+        feat_soa_.dynamics(cameras_[0].omega_c, cameras_[0].vel_c, cameras_[0].R_b_c, cameras_[0].p_b_c, state, jac, begin, end);
+      else
+        feat_soa_.dynamics(state, jac, begin, end);
+      for (int i = begin; i < end; i++)
+      {
+        if (!slot_active(i))
+          continue;
+        int dxZETA_i = (int)dxZ + i*3;
+        int dxRHO_i = (int)dxZ + i*3+2;
+        if (state)
+        {
+          dx_(dxZETA_i) = feat_soa_.dzeta[0][i];
+          dx_(dxZETA_i+1) = feat_soa_.dzeta[1][i];
+          dx_(dxRHO_i) = feat_soa_.drho[i];
+        }
+        if (jac)
+        {
+          for (int r = 0; r < 2; r++)
+          {
+            for (int c = 0; c < 3; c++)
+            {
+              A_(dxZETA_i+r, (int)dxVEL+c) = feat_soa_.A_zeta_vel[3*r+c][i];
+              A_(dxZETA_i+r, (int)dxB_G+c) = feat_soa_.A_zeta_bg[3*r+c][i];
+              G_(dxZETA_i+r, (int)uG+c) = feat_soa_.A_zeta_bg[3*r+c][i];
+            }
+            A_(dxZETA_i+r, dxZETA_i) = feat_soa_.A_zeta_zeta[2*r][i];
+            A_(dxZETA_i+r, dxZETA_i+1) = feat_soa_.A_zeta_zeta[2*r+1][i];
+            A_(dxZETA_i+r, dxRHO_i) = feat_soa_.A_zeta_rho[r][i];
+            A_(dxRHO_i, dxZETA_i+r) = feat_soa_.A_rho_zeta[r][i];
+          }
+          for (int c = 0; c < 3; c++)
+          {
+            A_(dxRHO_i, (int)dxVEL+c) = feat_soa_.A_rho_vel[c][i];
+            A_(dxRHO_i, (int)dxB_G+c) = feat_soa_.A_rho_bg[c][i];
+            G_(dxRHO_i, (int)uG+c) = feat_soa_.A_rho_bg[c][i];
+          }
+          A_(dxRHO_i, dxRHO_i) = feat_soa_.A_rho_rho[i];
+        }
+      }
+    });
+    return;
+  }
+  
+  for_each_feature_range([&](int begin, int end)
+  {
+    Matrix3d skew_vel_c;
+    Quatd q_zeta;
+    double rho;
+    Vector3d zeta;
+    Matrix<double, 3, 2> T_z;
+    Matrix3d skew_zeta;
+    int xZETA_i, xRHO_i, dxZETA_i, dxRHO_i;
+    for (int i = begin; i < end; i++)
+    {
+      if (!slot_active(i))
+        continue;
+      const camera_t& cam = cameras_[slot_camera_[i]];
+      const Vector3d& vel_c_i = cam.vel_c;
+      const Vector3d& omega_c_i = cam.omega_c;
+      const Matrix3d& R_b_c = cam.R_b_c;
+      const Matrix3d& skew_p_b_c = cam.skew_p_b_c;
+      xZETA_i = (int)xZ+i*5;
+      xRHO_i = (int)xZ+5*i+4;
+      dxZETA_i = (int)dxZ + i*3;
+      dxRHO_i = (int)dxZ + i*3+2;
+      
+      q_zeta = (x.block<4,1>(xZETA_i, 0));
+      rho = x(xRHO_i);
+      zeta = q_zeta.rota(e_z);
+      T_z = T_zeta(q_zeta);
+      skew_zeta = skew(zeta);
       
-      // Feature Input Jacobian
-      G_.block<2, 3>(dxZETA_i, (int)uG) = T_z.transpose() * (rho*skew_zeta * R_b_c*skew_p_b_c - R_b_c);
-      G_.block<1, 3>(dxRHO_i, (int)uG) = rho2*zeta.transpose() * R_b_c * skew_p_b_c;
+      double rho2 = rho*rho;
+      
+      // Feature Dynamics
+      if (state)
+      {
+        dx_.block<2,1>(dxZETA_i,0) = T_z.transpose() * (omega_c_i + rho * zeta.cross(vel_c_i));
+        dx_(dxRHO_i) = rho2 * zeta.dot(vel_c_i);
+      }
+      
+      // Feature Jacobian (consider features get one too, only their gain is masked)
+      if (jac)
+      {
+        skew_vel_c = skew(vel_c_i);
+        A_.block<2, 3>(dxZETA_i, (int)dxVEL) = rho * T_z.transpose() * skew_zeta * R_b_c;
+        A_.block<2, 3>(dxZETA_i, (int)dxB_G) = T_z.transpose() * (rho * skew_zeta * R_b_c * skew_p_b_c - R_b_c);
+        A_.block<2, 2>(dxZETA_i, dxZETA_i) = -T_z.transpose() * (skew(omega_c_i + rho * zeta.cross(vel_c_i)) + (rho * skew_vel_c * skew_zeta)) * T_z;
+        A_.block<2, 1>(dxZETA_i, dxRHO_i) = T_z.transpose() * zeta.cross(vel_c_i);
+        A_.block<1, 3>(dxRHO_i, (int)dxVEL) = rho2 * zeta.transpose() * R_b_c;
+        A_.block<1, 3>(dxRHO_i, (int)dxB_G) = rho2 * zeta.transpose() * R_b_c * skew_p_b_c;
+        A_.block<1, 2>(dxRHO_i, dxZETA_i) = rho2 * vel_c_i.transpose() * skew_zeta * T_z;
+        A_(dxRHO_i, dxRHO_i) = 2 * rho * zeta.transpose() * vel_c_i;
+        
+        // Feature Input Jacobian
+        G_.block<2, 3>(dxZETA_i, (int)uG) = T_z.transpose() * (rho*skew_zeta * R_b_c*skew_p_b_c - R_b_c);
+        G_.block<1, 3>(dxRHO_i, (int)uG) = rho2*zeta.transpose() * R_b_c * skew_p_b_c;
+      }
     }
-  }
+  });
 }
 }
@@ -0,0 +1,96 @@
+#include "vi_ekf.h"
+#include "feat_jac_gen.h"
+
+#include <algorithm>
+
+namespace vi_ekf
+{
+
+void FeatureSoA::dynamics(const Vector3d &omega_c, const Vector3d &vel_c, const Matrix3d &R_b_c,
+                          const Vector3d &p_b_c, const bool state, const bool jac, const int begin, const int end)
+{
+  // Broadcast the camera velocities and extrinsics into every lane
+  const simd_t om[3] = {omega_c(0), omega_c(1), omega_c(2)};
+  const simd_t vc[3] = {vel_c(0), vel_c(1), vel_c(2)};
+  const simd_t p[3] = {p_b_c(0), p_b_c(1), p_b_c(2)};
+  simd_t R[9];
+  for (int r = 0; r < 3; r++)
+  {
+    for (int c = 0; c < 3; c++)
+    {
+      R[3*r+c] = simd_t(R_b_c(r, c));
+    }
+  }
+
+  int stop = std::min(end, padded_len());
+  for (int i = begin; i < stop; i += simd_t::SIZE)
+  {
+    dynamics_lanes(i, om, vc, R, p, state, jac);
+  }
+}
+
+void FeatureSoA::dynamics(const bool state, const bool jac, const int begin, const int end)
+{
+  int stop = std::min(end, padded_len());
+  for (int i = begin; i < stop; i += simd_t::SIZE)
+  {
+    simd_t om[3], vc[3], p[3], R[9];
+    for (int k = 0; k < 3; k++)
+    {
+      om[k] = simd_t::load(cam_omega[k] + i);
+      vc[k] = simd_t::load(cam_vel[k] + i);
+      p[k] = simd_t::load(cam_p[k] + i);
+    }
+    for (int k = 0; k < 9; k++)
+    {
+      R[k] = simd_t::load(cam_R[k] + i);
+    }
+    dynamics_lanes(i, om, vc, R, p, state, jac);
+  }
+}
+
+void FeatureSoA::dynamics_lanes(const int i, const simd_t *om, const simd_t *vc, const simd_t *R, const simd_t *p,
+                                const bool state, const bool jac)
+{
+  simd_t q[4] = {simd_t::load(qw + i), simd_t::load(qx + i), simd_t::load(qy + i), simd_t::load(qz + i)};
+  simd_t r = simd_t::load(rho + i);
+
+  // Feature Dynamics
+  if (state)
+  {
+    simd_t dz[2], dr[1];
+    gen::feat_dynamics(q, r, om, vc, dz, dr);
+    dz[0].store(dzeta[0] + i);
+    dz[1].store(dzeta[1] + i);
+    dr[0].store(drho + i);
+  }
+
+  // Feature Jacobian
+  if (jac)
+  {
+    simd_t zv[6], zb[6], zz[4], zr[2], rv[3], rb[3], rz[2], rr[1];
+    gen::feat_jacobian(q, r, om, vc, R, p, zv, zb, zz, zr, rv, rb, rz, rr);
+    for (int k = 0; k < 6; k++)
+    {
+      zv[k].store(A_zeta_vel[k] + i);
+      zb[k].store(A_zeta_bg[k] + i);
+    }
+    for (int k = 0; k < 4; k++)
+    {
+      zz[k].store(A_zeta_zeta[k] + i);
+    }
+    for (int k = 0; k < 3; k++)
+    {
+      rv[k].store(A_rho_vel[k] + i);
+      rb[k].store(A_rho_bg[k] + i);
+    }
+    for (int k = 0; k < 2; k++)
+    {
+      zr[k].store(A_zeta_rho[k] + i);
+      rz[k].store(A_rho_zeta[k] + i);
+    }
+    rr[0].store(A_rho_rho + i);
+  }
+}
+
+}
@@ -5,8 +5,8 @@ namespace vi_ekf
 
 bool VIEKF::NaNsInTheHouse() const
 {
-  int x_max = xZ + len_features_ *5;
-  int dx_max = dxZ + len_features_*3;
+  int x_max = xZ + feature_slot_end_ *5;
+  int dx_max = dxZ + feature_slot_end_*3;
   if( ( (x_[i_].topRows(x_max)).array() != (x_[i_].topRows(x_max)).array()).any()
       || ((P_[i_].topLeftCorner(dx_max,dx_max)).array() != (P_[i_].topLeftCorner(dx_max,dx_max)).array()).any() )
   {
@@ -28,8 +28,10 @@ bool VIEKF::BlowingUp() const
 
 bool VIEKF::NegativeDepth() const
 {
-  for (int i = 0; i < len_features_; i++)
+  for (int i = 0; i < feature_slot_end_; i++)
   {
+    if (!slot_active(i))
+      continue;
     int xRHO_i = (int)xZ+5*i+4;
     if (x_[i_](xRHO_i,0) < 0)
       return true;
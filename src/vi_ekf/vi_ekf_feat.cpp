@@ -3,18 +3,21 @@
 namespace vi_ekf 
 {
 
-bool VIEKF::init_feature(const Vector2d& l, const int id, const double depth)
+bool VIEKF::init_feature(const Vector2d& l, const int id, const double depth, const int cam)
 {
   // If we already have a full set of features, we can't do anything about this new one
-  if (len_features_ >= NUM_FEATURES)
+  if (len_features_ >= NUM_FEATURES || len_features_ >= max_features_)
     return false;
+  if (cam < 0 || cam >= (int)cameras_.size())
+    return false;
+  const camera_t& camera = cameras_[cam];
   
   // Adjust lambdas to be with respect to image center
-  Vector2d l_centered = l - cam_center_;
+  Vector2d l_centered = l - camera.center;
   
   // Calculate Quaternion to Feature
   Vector3d zeta;
-  zeta << l_centered(0), l_centered(1)*(cam_F_(1,1)/cam_F_(0,0)), cam_F_(0,0);
+  zeta << l_centered(0), l_centered(1)*camera.aspect, camera.F(0,0);
   zeta.normalize();
   Vector4d qzeta = Quatd::from_two_unit_vectors(e_z, zeta).elements();
   
@@ -25,21 +28,34 @@ bool VIEKF::init_feature(const Vector2d& l, const int id, const double depth)
     init_depth = 2.0 * min_depth_;
   }
   
-  // Increment feature counters
-  current_feature_ids_.push_back(next_feature_id_);
-  next_feature_id_ += 1;
+  // Take the lowest free slot, and increment feature counters.  The feature keeps the id it
+  // was given (so several trackers can hand out ids from disjoint ranges), or gets the next
+  // unused one if it wasn't given one
+  int global_id = (id >= 0) ? id : next_feature_id_;
+  int slot = *free_slots_.begin();
+  free_slots_.erase(free_slots_.begin());
+  slot_feature_ids_[slot] = global_id;
+  feature_slots_[global_id] = slot;
+  feature_slot_end_ = std::max(feature_slot_end_, slot + 1);
+  current_feature_ids_.push_back(global_id);
+  next_feature_id_ = std::max(next_feature_id_, global_id + 1);
   len_features_ += 1;
+  slot_updates_[slot] = 0;
+  slot_consider_[slot] = 0;
+  slot_camera_[slot] = cam;
+  if (len_features_ - num_consider_features_ > max_estimated_features_)
+    set_slot_consider(slot, true);
   
   //  Initialize the state vector
-  int x_max = xZ + 5*len_features_;
-  x_[i_].block<4,1>(x_max - 5, 0) = qzeta;
-  x_[i_](x_max - 1 ) = 1.0/init_depth;
+  int xZETA_i = xZ + 5*slot;
+  x_[i_].block<4,1>(xZETA_i, 0) = qzeta;
+  x_[i_](xZETA_i + 4) = 1.0/init_depth;
   
   // Zero out the cross-covariance and reset the uncertainty on this new feature
-  int dx_max = dxZ+3*len_features_;
-  P_[i_].block(dx_max-3, 0, 3, dx_max-3).setZero();
-  P_[i_].block(0, dx_max-3, dx_max-3, 3).setZero();
-  P_[i_].block<3,3>(dx_max-3, dx_max-3) = P0_feat_;
+  int dxZETA_i = dxZ + 3*slot;
+  P_[i_].middleRows<3>(dxZETA_i).setZero();
+  P_[i_].middleCols<3>(dxZETA_i).setZero();
+  P_[i_].block<3,3>(dxZETA_i, dxZETA_i) = P0_feat_;
   
   NAN_CHECK;
   
@@ -49,25 +65,24 @@ bool VIEKF::init_feature(const Vector2d& l, const int id, const double depth)
 
 void VIEKF::clear_feature(const int id)
 {
-  int local_feature_id = global_to_local_feature_id(id);
-  int xZETA_i = xZ + 5 * local_feature_id;
-  int dxZETA_i = dxZ + 3 * local_feature_id;
-  current_feature_ids_.erase(current_feature_ids_.begin() + local_feature_id);
+  int slot = global_to_local_feature_id(id);
+  if (slot < 0)
+    return;
+  int xZETA_i = xZ + 5 * slot;
+  int dxZETA_i = dxZ + 3 * slot;
+  current_feature_ids_.erase(std::find(current_feature_ids_.begin(), current_feature_ids_.end(), id));
+  feature_slots_.erase(id);
+  slot_feature_ids_[slot] = -1;
+  free_slots_.insert(slot);
+  set_slot_consider(slot, false);
   len_features_ -= 1;
-  int dx_max = dxZ+3*len_features_;
-
-  // Remove the right portions of state and covariance and shift everything to the upper-left corner of the matrix
-  if (local_feature_id < len_features_)
-  {
-    x_[i_].block(xZETA_i, 0, (x_[i_].rows() - (xZETA_i+5)), 1) = x_[i_].bottomRows(x_[i_].rows() - (xZETA_i + 5));
-    P_[i_].block(dxZETA_i, 0, (P_[i_].rows() - (dxZETA_i+3)), P_[i_].cols()) = P_[i_].bottomRows(P_[i_].rows() - (dxZETA_i+3));
-    P_[i_].block(0, dxZETA_i, P_[i_].rows(), (P_[i_].cols() - (dxZETA_i+3))) = P_[i_].rightCols(P_[i_].cols() - (dxZETA_i+3));
-  }
+  while (feature_slot_end_ > 0 && !slot_active(feature_slot_end_ - 1))
+    feature_slot_end_--;
 
-  // Clean up the rest of the matrix
-  x_[i_].bottomRows(x_[i_].rows() - (xZ+5*len_features_)).setZero();
-  P_[i_].rightCols(P_[i_].cols() - dx_max).setZero();
-  P_[i_].bottomRows(P_[i_].rows() - dx_max).setZero();
+  // Only this feature's block is cleared, leave a valid (identity) quaternion in the free slot
+  x_[i_].segment<5>(xZETA_i) << 1.0, 0.0, 0.0, 0.0, 0.0;
+  P_[i_].middleRows<3>(dxZETA_i).setZero();
+  P_[i_].middleCols<3>(dxZETA_i).setZero();
 
   NAN_CHECK;
 }
@@ -78,43 +93,47 @@ const std::vector<int> &VIEKF::tracked_features() const
 }
 
 
-void VIEKF::keep_only_features(const vector<int> features)
+int VIEKF::get_feature_camera(const int id) const
+{
+  int slot = global_to_local_feature_id(id);
+  return (slot < 0) ? -1 : slot_camera_[slot];
+}
+
+
+void VIEKF::keep_only_features(const vector<int> features, const int cam)
 {
   std::vector<int> features_to_remove;
   int num_overlapping_features = 0;
+  std::set<int> keep(features.begin(), features.end());
+  std::set<int> keyframe(keyframe_features_.begin(), keyframe_features_.end());
   for (int local_id = 0; local_id < current_feature_ids_.size(); local_id++)
   {
-    // See if we should keep this feature
-    bool keep_feature = false;
-    for (int i = 0; i < features.size(); i++)
+    // See if we should keep this feature (other cameras' features are left alone)
+    int id = current_feature_ids_[local_id];
+    if (cam >= 0 && slot_camera_[global_to_local_feature_id(id)] != cam)
+      continue;
+    else if (keep.count(id) == 0)
     {
-      if (current_feature_ids_[local_id] == features[i])
-      {
-        keep_feature = true;
-        if (keyframe_reset_)
-        {
-          // See if it overlaps with our keyframe features
-          for (int j = 0; j < keyframe_features_.size(); j++)
-          {
-            if (keyframe_features_[j] == features[i])
-            {
-              num_overlapping_features++;
-              break;
-            }
-          }
-        }
-        break;
-      }
+      features_to_remove.push_back(id);
     }
-    if (!keep_feature)
+    else if (keyframe_reset_ && keyframe.count(id) > 0)
     {
-      features_to_remove.push_back(current_feature_ids_[local_id]);
+      // It overlaps with our keyframe features
+      num_overlapping_features++;
     }
   }
   for (int i = 0; i < features_to_remove.size(); i++)
   {
     clear_feature(features_to_remove[i]);
   }
+  balance_consider_features();
+  
+  // Keyframes are judged on the primary camera's features
+  if (cam > 0)
+  {
+    NAN_CHECK;
+    return;
+  }
   
   if (keyframe_reset_ && keyframe_features_.size() > 0 
       && (double)num_overlapping_features / (double)keyframe_features_.size() < keyframe_overlap_threshold_)
@@ -141,4 +160,117 @@ void VIEKF::keep_only_features(const vector<int> features)
   NAN_CHECK;
 }
 
+void VIEKF::set_max_estimated_features(const int max_estimated)
+{
+  max_estimated_features_ = std::min(std::max(max_estimated, 0), NUM_FEATURES);
+  balance_consider_features();
+}
+
+bool VIEKF::promote_feature(const int id)
+{
+  int slot = global_to_local_feature_id(id);
+  if (slot < 0 || !slot_consider_[slot])
+    return false;
+  set_slot_consider(slot, false);
+  return true;
+}
+
+bool VIEKF::demote_feature(const int id)
+{
+  int slot = global_to_local_feature_id(id);
+  if (slot < 0 || slot_consider_[slot])
+    return false;
+  set_slot_consider(slot, true);
+  return true;
+}
+
+bool VIEKF::is_consider_feature(const int id) const
+{
+  int slot = global_to_local_feature_id(id);
+  return slot >= 0 && slot_consider_[slot];
+}
+
+void VIEKF::set_slot_consider(const int slot, const bool consider)
+{
+  if (slot_consider_[slot] == consider)
+    return;
+  slot_consider_[slot] = consider;
+  num_consider_features_ += consider ? 1 : -1;
+  
+  // Consider states get no gain, and the partial update weights follow
+  gain_mask_.segment<3>(dxZ + 3*slot).setConstant(consider ? 0.0 : 1.0);
+  dxVector lambda = lambda_.cwiseProduct(gain_mask_);
+  Lambda_ = dx_ones_ * lambda.transpose() + lambda*dx_ones_.transpose() - lambda*lambda.transpose();
+  
+  // A demoted feature loses its cross-covariance with the other features.  A promoted one
+  // starts out uncorrelated with them, and picks that up again from the updates.
+  if (consider)
+    decouple_consider_feature(P_[i_], slot);
+}
+
+int VIEKF::estimated_index(int* idx) const
+{
+  int n = 0;
+  for (int i = 0; i < dxZ; i++)
+  {
+    idx[n++] = i;
+  }
+  for (int i = 0; i < feature_slot_end_; i++)
+  {
+    if (slot_active(i) && !slot_consider_[i])
+    {
+      idx[n++] = dxZ + 3*i;
+      idx[n++] = dxZ + 3*i + 1;
+      idx[n++] = dxZ + 3*i + 2;
+    }
+  }
+  return n;
+}
+
+void VIEKF::decouple_consider_feature(dxMatrix& P, const int slot) const
+{
+  int dxC = dxZ + 3*slot;
+  Matrix<double, dxZ, 3> P_xc = P.block<dxZ, 3>(0, dxC);
+  Matrix3d P_cc = P.block<3, 3>(dxC, dxC);
+  P.middleRows<3>(dxC).setZero();
+  P.middleCols<3>(dxC).setZero();
+  P.block<dxZ, 3>(0, dxC) = P_xc;
+  P.block<3, dxZ>(dxC, 0) = P_xc.transpose();
+  P.block<3, 3>(dxC, dxC) = P_cc;
+}
+
+void VIEKF::balance_consider_features()
+{
+  // Swap features between the estimated and consider sets so the estimated set holds the most
+  // observed features.  A consider feature has to beat the worst estimated feature by a margin
+  // so features don't flip back and forth every frame.
+  static const int hysteresis = 5;
+  while (true)
+  {
+    int worst = -1, best = -1;
+    for (int i = 0; i < feature_slot_end_; i++)
+    {
+      if (!slot_active(i))
+        continue;
+      if (!slot_consider_[i] && (worst < 0 || slot_updates_[i] < slot_updates_[worst]))
+        worst = i;
+      else if (slot_consider_[i] && (best < 0 || slot_updates_[i] > slot_updates_[best]))
+        best = i;
+    }
+    
+    int num_estimated = len_features_ - num_consider_features_;
+    if (num_estimated > max_estimated_features_ && worst >= 0)
+      set_slot_consider(worst, true);
+    else if (num_estimated < max_estimated_features_ && best >= 0)
+      set_slot_consider(best, false);
+    else if (worst >= 0 && best >= 0 && slot_updates_[best] > slot_updates_[worst] + hysteresis)
+    {
+      set_slot_consider(worst, true);
+      set_slot_consider(best, false);
+    }
+    else
+      break;
+  }
+}
+
 }
@@ -90,11 +90,14 @@ void VIEKF::boxplus(const xVector& x, const dxVector& dx, xVector& out) const
   out.block<6,1>((int)xPOS, 0) = x.block<6,1>((int)xPOS, 0) + dx.block<6,1>((int)dxPOS, 0);
   out.block<4,1>((int)xATT, 0) = (Quatd(x.block<4,1>((int)xATT, 0)) + dx.block<3,1>((int)dxATT, 0)).elements();
   out.block<7,1>((int)xB_A, 0) = x.block<7,1>((int)xB_A, 0) + dx.block<7,1>((int)dxB_A, 0);
-  for (int i = 0; i < len_features_; i++)
+  for_each_feature_range([&](int begin, int end)
   {
-    out.block<4,1>(xZ+i*5,0) = q_feat_boxplus(Quatd(x.block<4,1>(xZ+i*5,0)), dx.block<2,1>(dxZ+3*i,0)).elements();
-    out(xZ+i*5+4) = x(xZ+i*5+4) + dx(dxZ+3*i+2);
-  }
+    for (int i = begin; i < end; i++)
+    {
+      out.block<4,1>(xZ+i*5,0) = q_feat_boxplus(Quatd(x.block<4,1>(xZ+i*5,0)), dx.block<2,1>(dxZ+3*i,0)).elements();
+      out(xZ+i*5+4) = x(xZ+i*5+4) + dx(dxZ+3*i+2);
+    }
+  });
 }
 
 void VIEKF::boxminus(const xVector &x1, const xVector &x2, dxVector &out) const
@@ -103,20 +106,87 @@ void VIEKF::boxminus(const xVector &x1, const xVector &x2, dxVector &out) const
   out.block<3,1>((int)dxATT, 0) = (Quatd(x1.block<4,1>((int)xATT, 0)) - Quatd(x2.block<4,1>((int)xATT, 0)));
   out.block<7,1>((int)dxB_A, 0) = x1.block<7,1>((int)xB_A, 0) - x2.block<7,1>((int)xB_A, 0);
   
-  for (int i = 0; i < len_features_; i++)
+  for_each_feature_range([&](int begin, int end)
   {
-    out.block<2,1>(dxZ+i*3,0) = q_feat_boxminus(Quatd(x1.block<4,1>(xZ+i*5,0)), Quatd(x2.block<4,1>(xZ+i*5,0)));
-    out(dxZ+i*3+2) = x1(xZ+i*5+4) - x2(xZ+i*5+4);
-  }
+    for (int i = begin; i < end; i++)
+    {
+      out.block<2,1>(dxZ+i*3,0) = q_feat_boxminus(Quatd(x1.block<4,1>(xZ+i*5,0)), Quatd(x2.block<4,1>(xZ+i*5,0)));
+      out(dxZ+i*3+2) = x1(xZ+i*5+4) - x2(xZ+i*5+4);
+    }
+  });
 }
 
 
+void VIEKF::set_num_threads(const int num_threads, const int feature_threshold)
+{
+  parallel_feature_threshold_ = feature_threshold;
+  if (num_threads > 1)
+    pool_.reset(new WorkerPool(num_threads));
+  else
+    pool_.reset();
+}
+
+
+void VIEKF::set_camera_extrinsics(const Vector4d& q_b_c, const Vector3d& p_b_c, const int cam)
+{
+  cameras_[cam].q_b_c = Quatd(q_b_c);
+  cameras_[cam].p_b_c = p_b_c;
+  update_calibration_cache();
+}
+
+int VIEKF::add_camera(const Vector2d& cam_center, const Vector2d& focal_len, const Vector4d& q_b_c, const Vector3d& p_b_c)
+{
+  camera_t cam;
+  cam.center = cam_center;
+  cam.F << focal_len(0), 0, 0,
+           0, focal_len(1), 0;
+  cam.q_b_c = Quatd(q_b_c);
+  cam.p_b_c = p_b_c;
+  cam.omega_c.setZero();
+  cam.vel_c.setZero();
+  cameras_.push_back(cam);
+  update_calibration_cache();
+  return cameras_.size() - 1;
+}
+
+void VIEKF::update_calibration_cache()
+{
+  for (auto cam = cameras_.begin(); cam != cameras_.end(); cam++)
+  {
+    // Camera extrinsics used in the feature dynamics
+    cam->R_b_c = cam->q_b_c.R();
+    cam->skew_p_b_c = skew(cam->p_b_c);
+    
+    // Camera intrinsics used to initialize features
+    cam->aspect = cam->F(1,1) / cam->F(0,0);
+  }
+  
+  // Rotation between ECEF and NED at the origin of the local frame (identity until the
+  // origin has been set, since there is no direction to normalize before then)
+  if (T_e_I_.t_.norm() <= 0.0)
+  {
+    R_e_I_.setIdentity();
+    return;
+  }
+  Vector3d ZECEF, YECEF, ZNEDI, YNEDI;
+  ZECEF << 0,0,1;
+  YECEF << 0,1,0;
+  ZNEDI = -1*(T_e_I_.t_)/(sqrt(T_e_I_.t_.transpose()*T_e_I_.t_)); //normalize
+  YNEDI = skew(ZECEF)*(-ZNEDI);
+  Quatd q1, q2, qinit;
+  q1.from_two_unit_vectors(ZNEDI,ZECEF);
+  q2.from_two_unit_vectors(YNEDI,YECEF);
+  qinit = q1.otimes(q2);
+  qinit.normalize();
+  R_e_I_ = qinit.R();
+}
+
 int VIEKF::global_to_local_feature_id(const int global_id) const
 {
-  int dist = std::distance(current_feature_ids_.begin(), std::find(current_feature_ids_.begin(), current_feature_ids_.end(), global_id));
-  if (dist < current_feature_ids_.size())
+  auto it = feature_slots_.find(global_id);
+  if (it != feature_slots_.end())
   {
-    return dist;
+    return it->second;
   }
   else
   {
@@ -130,8 +200,10 @@ void VIEKF::fix_depth()
   // Apply an Inequality Constraint per
   // "Avoiding Negative Depth in Inverse Depth Bearing-Only SLAM"
   // by Parsley and Julier
-  for (int i = 0; i < len_features_; i++)
+  for (int i = 0; i < feature_slot_end_; i++)
   {
+    if (!slot_active(i))
+      continue;
     int xRHO_i = xZ + 5*i + 4;
     int dxRHO_i = dxZ + 3*i + 2;
     if (x_[i_](xRHO_i, 0) != x_[i_](xRHO_i, 0))
@@ -1,4 +1,5 @@
 #include "vi_ekf.h"
+#include "rts_smoother.h"
 
 namespace vi_ekf
 {
@@ -151,6 +152,10 @@ void VIEKF::keyframe_reset()
   
   NAN_CHECK;
   
+  // The smoother can't smooth across the jump in the state
+  if (smoother_)
+    smoother_->clear();
+  
   // call callback
   if (keyframe_reset_callback_ != nullptr)
     keyframe_reset_callback_();
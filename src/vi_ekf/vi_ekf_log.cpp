@@ -1,117 +1,315 @@
 #include "vi_ekf.h"
 
+#include <sstream>
+
 namespace vi_ekf
 {
 
-void VIEKF::log_state(const double t, const xVector& x, const dxVector& P, const uVector& u, const dxVector& dx)
+static const char* log_channel_names[] = {"STATE", "FEATURE_IDS", "INPUT", "XDOT", "GLOBAL", "COV"};
+
+static std::string log_channel_name(const int channel)
+{
+  if (channel < VIEKF::TOTAL_MEAS)
+    return measurement_names[channel];
+  else if (channel - VIEKF::TOTAL_MEAS < 6)
+    return log_channel_names[channel - VIEKF::TOTAL_MEAS];
+  return "";
+}
+
+bool VIEKF::log_due(const int channel, const double t)
+{
+  if (!log_enabled_[channel])
+    return false;
+  // Small slack so a rate that divides the input rate isn't skipped by rounding.  Rows at the
+  // time that was just logged are still due, so every feature in an image gets logged.
+  if (log_period_[channel] > 0.0 && t > log_last_t_[channel] && t - log_last_t_[channel] < log_period_[channel] - 1e-6)
+    return false;
+  log_last_t_[channel] = t;
+  return true;
+}
+
+bool VIEKF::set_log_channel(const std::string &name, const bool enabled, const double rate_hz)
 {
-  if (log_)
+  bool found = false;
+  for (int i = 0; i < TOTAL_LOGS; i++)
   {
-    (*log_)[LOG_STATE].write((char*)&t, sizeof(double));
-    (*log_)[LOG_STATE].write((char*)x.data(), sizeof(double) * x.rows());
-    (*log_)[LOG_STATE].write((char*)P.data(), sizeof(double) * P.rows());
+    if (name == "ALL" || name == log_channel_name(i))
+    {
+      log_enabled_[i] = enabled;
+      log_period_[i] = (rate_hz > 0.0) ? 1.0 / rate_hz : 0.0;
+      log_last_t_[i] = -INFINITY;
+      found = true;
+    }
+  }
+  return found;
+}
 
-    (*log_)[LOG_INPUT].write((char*)&t, sizeof(double));
-    (*log_)[LOG_INPUT].write((char*)u.data(), sizeof(double) * u.rows());
+bool VIEKF::set_log_policy(const std::string &policy)
+{
+  // Entries are "<channel> on", "<channel> off" or "<channel> <rate in Hz>"
+  std::string spec = policy;
+  std::replace(spec.begin(), spec.end(), ',', '\n');
+  std::replace(spec.begin(), spec.end(), ';', '\n');
+  std::stringstream ss(spec);
+  std::string entry;
+  bool ok = true;
+  while (std::getline(ss, entry))
+  {
+    std::stringstream es(entry);
+    std::string name, setting;
+    if (!(es >> name))
+      continue;
+    if (!(es >> setting))
+      setting = "on";
+    if (setting == "on" || setting == "off")
+      ok &= set_log_channel(name, setting == "on");
+    else
+    {
+      char* end;
+      double rate = strtod(setting.c_str(), &end);
+      if (*end != '\0' || rate < 0.0)
+        ok = false;
+      else
+        ok &= set_log_channel(name, true, rate);
+    }
+  }
+  return ok;
+}
 
-    (*log_)[LOG_XDOT].write((char*)&t, sizeof(double));
-    (*log_)[LOG_XDOT].write((char*)dx.data(), sizeof(double) * dx.rows());
+void VIEKF::log_state(const double t, const xVector& x, const dxMatrix& P, const uVector& u, const dxVector& dx)
+{
+  if (!log_)
+    return;
 
-    (*log_)[LOG_FEATURE_IDS].write((char*)&t, sizeof(double));
+  if (log_due(LOG_STATE, t))
+  {
+    dxVector Pdiag = P.diagonal();
+    log_->begin(LOG_STATE, sizeof(double) * (1 + x.rows() + Pdiag.rows()));
+    log_->append(&t, sizeof(double));
+    log_->append(x.data(), sizeof(double) * x.rows());
+    log_->append(Pdiag.data(), sizeof(double) * Pdiag.rows());
+    log_->commit();
+  }
+
+  if (log_due(LOG_COV, t))
+  {
+    // The row-major upper triangle of P, which (P being symmetric) is its lower triangle
+    // column by column, so each column's piece is contiguous.  The writer thread compresses it.
+    const int n = P.rows();
+    log_->begin(LOG_COV, sizeof(double) * (1 + n * (n + 1) / 2));
+    log_->append(&t, sizeof(double));
+    for (int j = 0; j < n; j++)
+      log_->append(P.data() + j * n + j, sizeof(double) * (n - j));
+    log_->commit();
+  }
+
+  if (log_due(LOG_INPUT, t))
+  {
+    log_->begin(LOG_INPUT, sizeof(double) * (1 + u.rows()));
+    log_->append(&t, sizeof(double));
+    log_->append(u.data(), sizeof(double) * u.rows());
+    log_->commit();
+  }
+
+  if (log_due(LOG_XDOT, t))
+  {
+    log_->begin(LOG_XDOT, sizeof(double) * (1 + dx.rows()));
+    log_->append(&t, sizeof(double));
+    log_->append(dx.data(), sizeof(double) * dx.rows());
+    log_->commit();
+  }
+
+  if (log_due(LOG_FEATURE_IDS, t))
+  {
+    double ids[NUM_FEATURES + 1];
+    ids[0] = t;
     for (int i = 0; i < NUM_FEATURES; i++)
     {
-      double idd = -1.0;
-      if (i < len_features_)
-        idd = (double)current_feature_ids_[i];
-      (*log_)[LOG_FEATURE_IDS].write((char*)&idd, sizeof(double));
+      ids[i+1] = -1.0;
+      if (i < feature_slot_end_)
+        ids[i+1] = (double)slot_feature_ids_[i];
     }
+    log_->write(LOG_FEATURE_IDS, ids, sizeof(ids));
   }
 }
 
 void VIEKF::log_global_position(const Xformd &truth_global_transform) //Vector3d pos, const Vector4d att)
 { 
-  if (log_)
+  double t = t_[i_] - start_t_;
+  if (log_ && log_due(LOG_GLOBAL, t))
   {
     Xformd global_pose = get_global_pose();
 
-    double t = t_[i_] - start_t_;
-    (*log_)[LOG_GLOBAL].write((char*)&t, sizeof(double));
-    (*log_)[LOG_GLOBAL].write((char*)truth_global_transform.q_.arr_.data(), sizeof(double) * 4);
-    (*log_)[LOG_GLOBAL].write((char*)truth_global_transform.t_.data(), sizeof(double) * 3);
-    (*log_)[LOG_GLOBAL].write((char*)global_pose.q_.arr_.data(), sizeof(double) * 4);
-    (*log_)[LOG_GLOBAL].write((char*)global_pose.t_.data(), sizeof(double) * 3);
+    log_->begin(LOG_GLOBAL, sizeof(double) * 15);
+    log_->append(&t, sizeof(double));
+    log_->append(truth_global_transform.q_.arr_.data(), sizeof(double) * 4);
+    log_->append(truth_global_transform.t_.data(), sizeof(double) * 3);
+    log_->append(global_pose.q_.arr_.data(), sizeof(double) * 4);
+    log_->append(global_pose.t_.data(), sizeof(double) * 3);
+    log_->commit();
   }
 }
 
-void VIEKF::log_measurement(const measurement_type_t type, const double t, const int dim, const MatrixXd& z, const MatrixXd& zhat, const bool active, const int id)
+void VIEKF::log_measurement(const measurement_type_t type, const double t, const int dim, const zVector& z, const zVector& zhat, const bool active, const int id)
 {
-  if (log_ != NULL)
+  if (log_ && log_due(type, t))
   {
-    (*log_)[type].write((char*)&t, sizeof(double));
-    (*log_)[type].write((char*)z.data(), sizeof(double) * dim);
-    (*log_)[type].write((char*)zhat.data(), sizeof(double) * dim);
-    double ac = 1.0 * active;
-    (*log_)[type].write((char*)&ac, sizeof(double));
-    if (type == FEAT || type == QZETA || type == DEPTH || type == INV_DEPTH || type == PIXEL_VEL)
+    // Fixed-width rows: the measurement and its estimate are zero-padded to the largest dimension
+    static const int max_dim = zVector::RowsAtCompileTime;
+    double row[4 + 2*max_dim] = {0};
+    row[0] = t;
+    row[1] = dim;
+    for (int i = 0; i < dim && i < max_dim; i++)
     {
-      double idd = 1.0 * id;
-      (*log_)[type].write((char*)&idd, sizeof(double));
+      row[2 + i] = z(i);
+      row[2 + max_dim + i] = zhat(i);
     }
+    row[2 + 2*max_dim] = 1.0 * active;
+    row[3 + 2*max_dim] = 1.0 * id;
+    log_->write(type, row, sizeof(row));
   }
 }
 
 void VIEKF::disable_logger()
 {
-  for (auto i = log_->begin(); i != log_->end(); i++)
+  // The logger drains everything already queued before it shuts down
+  log_.reset();
+}
+
+void VIEKF::set_log_buffer(const size_t bytes, const bool block_on_overflow, const size_t segment_bytes)
+{
+  log_buffer_bytes_ = bytes;
+  log_overflow_policy_ = block_on_overflow ? AsyncLogger::BLOCK : AsyncLogger::DROP;
+  log_segment_bytes_ = segment_bytes;
+}
+
+LogSchema VIEKF::log_schema() const
+{
+  static const char* x_names[] = {"p_x", "p_y", "p_z", "v_x", "v_y", "v_z", "q_w", "q_x", "q_y", "q_z",
+                                  "b_ax", "b_ay", "b_az", "b_gx", "b_gy", "b_gz", "mu"};
+  static const char* x_units[] = {"m", "m", "m", "m/s", "m/s", "m/s", "", "", "", "",
+                                  "m/s^2", "m/s^2", "m/s^2", "rad/s", "rad/s", "rad/s", "1/s"};
+  static const char* dx_names[] = {"p_x", "p_y", "p_z", "v_x", "v_y", "v_z", "th_x", "th_y", "th_z",
+                                   "b_ax", "b_ay", "b_az", "b_gx", "b_gy", "b_gz", "mu"};
+  static const char* dx_units[] = {"m", "m", "m", "m/s", "m/s", "m/s", "rad", "rad", "rad",
+                                   "m/s^2", "m/s^2", "m/s^2", "rad/s", "rad/s", "rad/s", "1/s"};
+  static const char* feat_x_names[] = {"q_w", "q_x", "q_y", "q_z", "rho"};
+  static const char* feat_x_units[] = {"", "", "", "", "1/m"};
+  static const char* feat_dx_names[] = {"zeta_a", "zeta_b", "rho"};
+  static const char* feat_dx_units[] = {"rad", "rad", "1/m"};
+
+  LogSchema schema;
+  schema.capacity = NUM_FEATURES;
+
+  LogChannel& state = schema.add_channel(LOG_STATE, log_channel_name(LOG_STATE));
+  for (int i = 0; i < xZ; i++)
+    state.add_column(x_names[i], x_units[i]);
+  for (int i = 0; i < NUM_FEATURES; i++)
+    for (int j = 0; j < 5; j++)
+      state.add_column("f" + std::to_string(i) + "_" + feat_x_names[j], feat_x_units[j]);
+  for (int i = 0; i < dxZ; i++)
+    state.add_column(std::string("P_") + dx_names[i], dx_units[i][0] ? std::string(dx_units[i]) + "^2" : "");
+  for (int i = 0; i < NUM_FEATURES; i++)
+    for (int j = 0; j < 3; j++)
+      state.add_column("P_f" + std::to_string(i) + "_" + feat_dx_names[j], std::string(feat_dx_units[j]) + "^2");
+
+  LogChannel& cov = schema.add_channel(LOG_COV, log_channel_name(LOG_COV), true);
+  for (int i = 0; i < dxZ; i++)
+    cov.add_column(dx_names[i], dx_units[i]);
+  for (int i = 0; i < NUM_FEATURES; i++)
+    for (int j = 0; j < 3; j++)
+      cov.add_column("f" + std::to_string(i) + "_" + feat_dx_names[j], feat_dx_units[j]);
+
+  LogChannel& ids = schema.add_channel(LOG_FEATURE_IDS, log_channel_name(LOG_FEATURE_IDS));
+  for (int i = 0; i < NUM_FEATURES; i++)
+    ids.add_column("slot" + std::to_string(i));
+
+  LogChannel& input = schema.add_channel(LOG_INPUT, log_channel_name(LOG_INPUT));
+  input.add_column("a_x", "m/s^2");
+  input.add_column("a_y", "m/s^2");
+  input.add_column("a_z", "m/s^2");
+  input.add_column("w_x", "rad/s");
+  input.add_column("w_y", "rad/s");
+  input.add_column("w_z", "rad/s");
+
+  LogChannel& xdot = schema.add_channel(LOG_XDOT, log_channel_name(LOG_XDOT));
+  for (int i = 0; i < dxZ; i++)
+    xdot.add_column(std::string("d_") + dx_names[i], dx_units[i][0] ? std::string(dx_units[i]) + "/s" : "1/s");
+  for (int i = 0; i < NUM_FEATURES; i++)
+    for (int j = 0; j < 3; j++)
+      xdot.add_column("d_f" + std::to_string(i) + "_" + feat_dx_names[j], std::string(feat_dx_units[j]) + "/s");
+
+  LogChannel& global = schema.add_channel(LOG_GLOBAL, log_channel_name(LOG_GLOBAL));
+  const char* pose_names[] = {"q_w", "q_x", "q_y", "q_z", "p_x", "p_y", "p_z"};
+  const char* pose_units[] = {"", "", "", "", "m", "m", "m"};
+  for (int i = 0; i < 7; i++)
+    global.add_column(std::string("truth_") + pose_names[i], pose_units[i]);
+  for (int i = 0; i < 7; i++)
+    global.add_column(std::string("est_") + pose_names[i], pose_units[i]);
+
+  static const int max_dim = zVector::RowsAtCompileTime;
+  for (int type = 0; type < TOTAL_MEAS; type++)
   {
-    i->close();
+    std::string unit;
+    switch (type)
+    {
+    case ACC: unit = "m/s^2"; break;
+    case ALT: case POS: case GPS: case DEPTH: unit = "m"; break;
+    case VEL: unit = "m/s"; break;
+    case FEAT: unit = "px"; break;
+    case PIXEL_VEL: unit = "px/s"; break;
+    case INV_DEPTH: unit = "1/m"; break;
+    }
+    LogChannel& meas = schema.add_channel(type, log_channel_name(type));
+    meas.add_column("dim");
+    for (int i = 0; i < max_dim; i++)
+      meas.add_column("z" + std::to_string(i), (type == GPS && i >= 3) ? "m/s" : unit);
+    for (int i = 0; i < max_dim; i++)
+      meas.add_column("zhat" + std::to_string(i), (type == GPS && i >= 3) ? "m/s" : unit);
+    meas.add_column("active");
+    meas.add_column("id");
   }
-  delete log_;
-  log_ = NULL;
+  return schema;
 }
 
 void VIEKF::init_logger(string root_filename, string prefix)
 {
-  log_ = new std::vector<std::ofstream>;
-  (*log_).resize(TOTAL_LOGS);
-
   // Make the directory
   int result = system(("mkdir -p " + root_filename).c_str());
   (void)result;
 
-  // A logger for the results of propagation
-  for (int i = 0; i < TOTAL_MEAS; i++)
+  // Save configuration
+  LogSchema schema = log_schema();
+  std::stringstream conf;
+  conf << "Test Num: " << root_filename << "\n";
+  conf << "x0" << x_[i_].block<(int)xZ, 1>(0,0).transpose() << "\n";
+  conf << "P0: " << P_[i_].diagonal().block<(int)xZ, 1>(0,0).transpose() << "\n";
+  conf << "P0_feat: " << P0_feat_.diagonal().transpose() << "\n";
+  conf << "Qx: " << Qx_.diagonal().block<(int)dxZ, 1>(0,0).transpose() << "\n";
+  conf << "Qx_feat: " << Qx_.diagonal().block<3, 1>((int)dxZ,0).transpose() << "\n";
+  conf << "Qu: " << Qu_.diagonal().transpose() << "\n";
+  for (int c = 0; c < cameras_.size(); c++)
   {
-    (*log_)[i].open(root_filename + "/" + measurement_names[i] + ".bin",  std::ofstream::out | std::ofstream::trunc);
+    std::string suffix = (c > 0) ? "_" + std::to_string(c) : "";
+    conf << "q_b_c" << suffix << ": " << cameras_[c].q_b_c.arr_.transpose() << "\n";
+    conf << "p_b_c" << suffix << ": " << cameras_[c].p_b_c.transpose() << "\n";
   }
-  (*log_)[LOG_STATE].open(root_filename + "/" + prefix +"prop.bin", std::ofstream::out | std::ofstream::trunc);
-  (*log_)[LOG_FEATURE_IDS].open(root_filename + "/" + prefix +"feat_id.bin", std::ofstream::out | std::ofstream::trunc);
-  (*log_)[LOG_CONF].open(root_filename + "/" + prefix +"conf.txt", std::ofstream::out | std::ofstream::trunc);
-  (*log_)[LOG_INPUT].open(root_filename + "/" + prefix +"input.bin", std::ofstream::out | std::ofstream::trunc);
-  (*log_)[LOG_XDOT].open(root_filename + "/" + prefix +"xdot.bin", std::ofstream::out | std::ofstream::trunc);
-  (*log_)[LOG_KF].open(root_filename + "/" + prefix +"kf.bin", std::ofstream::out | std::ofstream::trunc);
-  (*log_)[LOG_DEBUG].open(root_filename + "/" + prefix +"debug.txt", std::ofstream::out | std::ofstream::trunc);
+  conf << "lambda: " << lambda_.block<(int)dxZ,1>(0,0).transpose() << "\n";
+  conf << "lambda_feat: " << lambda_.block<3,1>((int)dxZ,0).transpose() << "\n";
+  conf << "partial_update: " << partial_update_ << "\n";
+  conf << "keyframe reset: " << keyframe_reset_ << "\n";
+  conf << "Using Drag Term: " << use_drag_term_ << "\n";
+  conf << "keyframe overlap: " << keyframe_overlap_threshold_ << "\n";
+  conf << "num features: " << NUM_FEATURES << "\n";
+  conf << "min_depth: " << min_depth_ << "\n";
+  std::string line;
+  while (std::getline(conf, line))
+    schema.notes.push_back(line);
 
-  // Save configuration
-  (*log_)[LOG_CONF] << "Test Num: " << root_filename << "\n";
-  (*log_)[LOG_CONF] << "x0" << x_[i_].block<(int)xZ, 1>(0,0).transpose() << "\n";
-  (*log_)[LOG_CONF] << "P0: " << P_[i_].diagonal().block<(int)xZ, 1>(0,0).transpose() << "\n";
-  (*log_)[LOG_CONF] << "P0_feat: " << P0_feat_.diagonal().transpose() << "\n";
-  (*log_)[LOG_CONF] << "Qx: " << Qx_.diagonal().block<(int)dxZ, 1>(0,0).transpose() << "\n";
-  (*log_)[LOG_CONF] << "Qx_feat: " << Qx_.diagonal().block<3, 1>((int)dxZ,0).transpose() << "\n";
-  (*log_)[LOG_CONF] << "Qu: " << Qu_.diagonal().transpose() << "\n";
-  (*log_)[LOG_CONF] << "q_b_c: " << q_b_c_.arr_.transpose() << "\n";
-  (*log_)[LOG_CONF] << "p_b_c: " << p_b_c_.transpose() << "\n";
-  (*log_)[LOG_CONF] << "lambda: " << lambda_.block<(int)dxZ,1>(0,0).transpose() << "\n";
-  (*log_)[LOG_CONF] << "lambda_feat: " << lambda_.block<3,1>((int)dxZ,0).transpose() << "\n";
-  (*log_)[LOG_CONF] << "partial_update: " << partial_update_ << "\n";
-  (*log_)[LOG_CONF] << "keyframe reset: " << keyframe_reset_ << "\n";
-  (*log_)[LOG_CONF] << "Using Drag Term: " << use_drag_term_ << "\n";
-  (*log_)[LOG_CONF] << "keyframe overlap: " << keyframe_overlap_threshold_ << "\n";
-  (*log_)[LOG_CONF] << "num features: " << NUM_FEATURES << "\n";
-  (*log_)[LOG_CONF] << "min_depth: " << min_depth_ << std::endl;
+  // All of the channels go into one self-describing log, split into segments log_0000.vlog, ...
+  std::unique_ptr<LogSink> writer(new ColumnarLogWriter(root_filename + "/" + prefix + "log", schema, log_segment_bytes_,
+                                                        256, log_keyframe_interval_));
+  log_.reset(new AsyncLogger(std::move(writer), log_buffer_bytes_, log_overflow_policy_));
 }
 
 }
-
-
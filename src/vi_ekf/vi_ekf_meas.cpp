@@ -1,4 +1,5 @@
 #include "vi_ekf.h"
+#include "feat_jac_gen.h"
 
 namespace vi_ekf
 {
@@ -108,7 +109,7 @@ void VIEKF::handle_measurements(std::vector<int>* gated_feature_ids)
 
 
 VIEKF::meas_result_t VIEKF::add_measurement(const double t, const VectorXd& z, const measurement_type_t& meas_type,
-                                            const MatrixXd& R, bool active, const int id, const double depth)
+                                            const MatrixXd& R, bool active, const int id, const double depth, const int cam)
 {
   if (t < start_t_)
     return MEAS_INVALID;
@@ -119,9 +120,9 @@ VIEKF::meas_result_t VIEKF::add_measurement(const double t, const VectorXd& z, c
   // If this is a new feature, initialize it
   if (meas_type == FEAT && id >= 0)
   {
-    if (std::find(current_feature_ids_.begin(), current_feature_ids_.end(), id) == current_feature_ids_.end())
+    if (feature_slots_.find(id) == feature_slots_.end())
     {
-      init_feature(z, id, depth);
+      init_feature(z, id, depth, cam);
       return MEAS_NEW_FEATURE; // Don't do a measurement update this time
     }
   }
@@ -177,7 +178,12 @@ VIEKF::meas_result_t VIEKF::update(measurement_t& meas)
 {
   meas.handled = true;
   NAN_CHECK;
-  
+
+  // The feature may have lost its slot since this measurement was queued
+  if ((meas.type == FEAT || meas.type == DEPTH || meas.type == QZETA || meas.type == INV_DEPTH)
+      && global_to_local_feature_id(meas.id) < 0)
+    return MEAS_INVALID;
+
   zhat_.setZero();
   H_.setZero();
   K_.setZero();
@@ -209,7 +215,11 @@ VIEKF::meas_result_t VIEKF::update(measurement_t& meas)
   //  Perform Covariance Gating Check on Residual
   if (meas.active)
   {
-    auto innov =  (H * P_[i_] * H.transpose() + R).inverse();
+    // P H^T is the only product with the full covariance the update needs
+    auto PHt = PHt_.leftCols(meas.rdim);
+    PHt.noalias() = P_[i_] * H.transpose();
+    Matrix<double, Dynamic, Dynamic, 0, 3, 3> S = H * PHt + R;
+    Matrix<double, Dynamic, Dynamic, 0, 3, 3> innov = S.inverse();
 
     double mahal = res.transpose() * innov * res;
     if (mahal > 9.0)
@@ -218,7 +228,14 @@ VIEKF::meas_result_t VIEKF::update(measurement_t& meas)
       return MEAS_GATED;
     }
 
-    K = P_[i_] * H.transpose() * innov;
+    // Schmidt update: the gain is only computed for the core states and the estimated
+    // features, the consider states get none
+    int idx[MAX_DX];
+    int n = estimated_index(idx);
+    for (int r = 0; r < n; r++)
+    {
+      K.row(idx[r]).noalias() = PHt.row(idx[r]) * innov;
+    }
     NAN_CHECK;
     
     //    CHECK_MAT_FOR_NANS(H_);
@@ -226,24 +243,39 @@ VIEKF::meas_result_t VIEKF::update(measurement_t& meas)
     
     if (NO_NANS(K_) && NO_NANS(H_))
     {
+      // The Joseph form (I - K H) P (I - K H)^T + K R K^T, expanded to
+      //   P - K (P H^T)^T - (P H^T) K^T + K S K^T
+      // so it only needs P H^T (use A for the change, it is the right size)
+      A_.noalias() = K * S * K.transpose();
+      A_.noalias() -= K * PHt.transpose();
+      A_.noalias() -= PHt * K.transpose();
       if (partial_update_)
       {
         // Apply Fixed Gain Partial update per
         // "Partial-Update Schmidt-Kalman Filter" by Brink
         // Modified to operate inline and on the manifold
-        boxplus(x_[i_], lambda_.asDiagonal() * K * residual.topRows(meas.rdim), xp_);
+        boxplus(x_[i_], lambda_.asDiagonal() * K * res, xp_);
         x_[i_] = xp_;
-        A_ = (I_big_ - K * H);
-        P_[i_] += (Lambda_).cwiseProduct(A_*P_[i_]*A_.transpose() + K * R * K.transpose() - P_[i_]);
-
+        P_[i_] += Lambda_.cwiseProduct(A_);
       }
       else
       {
-        boxplus(x_[i_], K * residual.topRows(meas.rdim), xp_);
+        boxplus(x_[i_], K * res, xp_);
         x_[i_] = xp_;
-        A_ = (I_big_ - K * H);
-        P_[i_] = A_*P_[i_]*A_.transpose() + K * R * K.transpose();
+        P_[i_] += A_;
       }
+      
+      // The consider features keep their own block, and drop the cross-covariance with the
+      // estimated features the update gave them
+      for (int i = 0; num_consider_features_ > 0 && i < feature_slot_end_; i++)
+      {
+        if (slot_active(i) && slot_consider_[i])
+          decouple_consider_feature(P_[i_], i);
+      }
+      
+      // Keep track of how well-observed each feature is
+      if (meas.type == FEAT)
+        slot_updates_[global_to_local_feature_id(meas.id)]++;
     }
     NAN_CHECK;
   }
@@ -334,16 +366,18 @@ void VIEKF::h_qzeta(const xVector& x, zVector& h, hMatrix &H, const int id) cons
 void VIEKF::h_feat(const xVector& x, zVector& h, hMatrix& H, const int id) const
 {
   int i = global_to_local_feature_id(id);
-  Quatd q_zeta(x.block<4,1>(xZ+i*5, 0));
-  Vector3d zeta = q_zeta.rota(e_z);
-  Matrix3d sk_zeta = skew(zeta);
-  double ezT_zeta = e_z.transpose() * zeta;
-  MatrixXd T_z = T_zeta(q_zeta);
+  const camera_t& cam = cameras_[slot_camera_[i]];
+  
+  // h = cam_F * zeta / (e_z^T * zeta) + cam_center (see scripts/gen_jacobians.py)
+  const double f[2] = {cam.F(0,0), cam.F(1,1)};
+  const double c[2] = {cam.center(0), cam.center(1)};
+  double h_pix[2], H_zeta[4];
+  gen::feat_measurement(x.data() + xZ+i*5, f, c, h_pix, H_zeta);
   
-  h.topRows(2) = cam_F_ * zeta / ezT_zeta + cam_center_;
+  h.topRows(2) << h_pix[0], h_pix[1];
   
   H.setZero();
-  H.block<2,2>(0,dxZ+i*3) = (1.0 / ezT_zeta) * cam_F_ * (I_3x3 - (zeta * e_z.transpose()) / ezT_zeta) * sk_zeta * T_z;
+  H.block<2,2>(0,dxZ+i*3) << H_zeta[0], H_zeta[1], H_zeta[2], H_zeta[3];
 }
 
 void VIEKF::h_depth(const xVector& x, zVector& h, hMatrix& H, const int id) const
@@ -372,36 +406,19 @@ void VIEKF::h_gps(const xVector &x, zVector &h, hMatrix &H, const int id) const
   /// HAYDEN - PUT THE MEASUREMENT MODEL HERE [p_B/E^E; v_B/E^E]
   h.setZero();
   H.setZero();
-  // define ZNED in ECEF frame
-  // define ZECEF in ECEF frame
-  // convert unit vector transform to quaternion
-  Xformd Pinit = T_e_I_;
-  Vector3d ZECEF;
-  Vector3d YECEF;
-  Vector3d ZNEDI;
-  Vector3d YNEDI;
-  Quatd q1;
-  Quatd q2;
-  Quatd qinit;
+  // The ECEF to NED rotation (R_e_I_) only depends on T_e_I_, so it is cached
   Quatd qb;
-  ZECEF << 0,0,1;
-  YECEF << 0,1,0;
-  ZNEDI = -1*(Pinit.t_)/(sqrt(Pinit.t_.transpose()*Pinit.t_)); //normalize
-  YNEDI = skew(ZECEF)*(-ZNEDI);
-  q1.from_two_unit_vectors(ZNEDI,ZECEF);
-  q2.from_two_unit_vectors(YNEDI,YECEF);
-  qinit = q1.otimes(q2);
-  qinit.normalize();
   qb = x.block<4,1>((int)xATT, 0);
   qb.normalize();
+  Matrix3d R_e_b = R_e_I_*qb.R();
   // set top left block of H to qinit.R
-  H.block<3,3>(0,(int)dxPOS) = qinit.R();
+  H.block<3,3>(0,(int)dxPOS) = R_e_I_;
   // set bottom center block of H to qinit.R*qb.R (qb is data input quaternion)
-  H.block<3,3>(3,(int)dxVEL) = qinit.R()*qb.R();
+  H.block<3,3>(3,(int)dxVEL) = R_e_b;
   // set bottom right block of H to qinit.R*qb.R*skew(vb) (where vb is the obtained velocity)
-  H.block<3,3>(3,(int)dxATT) = qinit.R()*qb.R()*skew(x.block<3,1>((int)xVEL,0));
-  h.topRows(3) = qinit.R()*x.block<3,1>((int)xPOS,0)+Pinit.t_;
-  h.bottomRows(3) = qinit.R()*qb.R()*x.block<3,1>((int)xVEL,0);
+  H.block<3,3>(3,(int)dxATT) = R_e_b*skew(x.block<3,1>((int)xVEL,0));
+  h.topRows(3) = R_e_I_*x.block<3,1>((int)xPOS,0)+T_e_I_.t_;
+  h.bottomRows(3) = R_e_b*x.block<3,1>((int)xVEL,0);
 }
 
 
@@ -0,0 +1,31 @@
+#include "vi_ekf.h"
+#include "rts_smoother.h"
+
+namespace vi_ekf
+{
+
+void VIEKF::enable_smoother(const double lag, const double period)
+{
+  smoother_.reset(new RTSSmoother(lag, period));
+}
+
+void VIEKF::disable_smoother()
+{
+  smoother_.reset();
+}
+
+bool VIEKF::get_smoothed_state(const double t, Matrix<double, xZ, 1> &x, Matrix<double, dxZ, dxZ> &P) const
+{
+  if (!smoother_)
+    return false;
+  return smoother_->get_state(t, x, P);
+}
+
+bool VIEKF::get_smoothed_pose(const double t, Xformd &pose, Matrix6d &cov) const
+{
+  if (!smoother_)
+    return false;
+  return smoother_->get_pose(t, pose, cov);
+}
+
+}
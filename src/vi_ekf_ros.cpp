@@ -1,5 +1,6 @@
 #include "vi_ekf_ros.h"
 #include "eigen_helpers.h"
+#include "rts_smoother.h"
 
 VIEKF_ROS::VIEKF_ROS() :
   nh_private_("~"),
@@ -10,11 +11,11 @@ VIEKF_ROS::VIEKF_ROS() :
   transform_sub_ = nh_.subscribe("truth/transform", 10, &VIEKF_ROS::transform_truth_callback, this);
   odom_truth_sub_ = nh_.subscribe("multirotor/truth/NED", 10, &VIEKF_ROS::odom_truth_callback, this);
   gps_sub_ = nh_.subscribe("gps", 10, &VIEKF_ROS::gps_callback, this);
+  log_policy_sub_ = nh_private_.subscribe("log_policy", 10, &VIEKF_ROS::log_policy_callback, this);
 
   odometry_pub_ = nh_.advertise<nav_msgs::Odometry>("odom", 1);
 //  bias_pub_ = nh_.advertise<sensor_msgs::Imu>("imu/bias", 1);
   
-  image_sub_ = it_.subscribe("color", 10, &VIEKF_ROS::color_image_callback, this);
   depth_sub_ = it_.subscribe("depth", 10, &VIEKF_ROS::depth_image_callback, this);
 //  output_pub_ = it_.advertise("tracked", 1);
 //  cov_img_pub_ = it_.advertise("covariance", 1);
@@ -80,20 +81,150 @@ VIEKF_ROS::VIEKF_ROS() :
   
   P0feat(2,0) = 1.0/(16.0 * min_depth_ * min_depth_);
   
+  // Log records are buffered and written by a background thread, when the buffer is full
+  // they are either dropped (and counted) or the filter waits for the writer.  The log is
+  // split into preallocated segment files of log_segment_mb each.  Covariance snapshots
+  // (the COV channel) get a full keyframe every log_cov_keyframe_interval snapshots.
+  int log_buffer_kb, log_segment_mb, log_cov_keyframe_interval;
+  bool log_block_on_overflow;
+  nh_private_.param<int>("log_buffer_kb", log_buffer_kb, 8192);
+  nh_private_.param<bool>("log_block_on_overflow", log_block_on_overflow, false);
+  nh_private_.param<int>("log_segment_mb", log_segment_mb, 64);
+  nh_private_.param<int>("log_cov_keyframe_interval", log_cov_keyframe_interval, 20);
+  ekf_.set_log_buffer((size_t)log_buffer_kb * 1024, log_block_on_overflow, (size_t)log_segment_mb << 20);
+  ekf_.set_cov_log_keyframe_interval(log_cov_keyframe_interval);
+  
   ekf_.init(x0, P0diag, Qxdiag, lambda, Qudiag, P0feat, Qxfeat, lambdafeat,
             cam_center, focal_len, q_b_c, p_b_c, min_depth_, log_directory, 
             use_drag_term_, partial_update, keyframe_reset, keyframe_overlap, cov_prop_skips);
   ekf_.register_keyframe_reset_callback(std::bind(&VIEKF_ROS::keyframe_reset_callback, this));
   
+  // Which log channels to write, and how often (e.g. "XDOT off, STATE 50"), this can also
+  // be changed while running by publishing to ~log_policy
+  std::string log_policy;
+  nh_private_.param<std::string>("log_policy", log_policy, "");
+  if (!ekf_.set_log_policy(log_policy))
+    ROS_WARN("could not parse log_policy \"%s\"", log_policy.c_str());
+  
+  // Split the per-feature work across threads when tracking lots of features
+  int filter_threads, parallel_feature_threshold;
+  nh_private_.param<int>("filter_threads", filter_threads, 1);
+  nh_private_.param<int>("parallel_feature_threshold", parallel_feature_threshold, 30);
+  ekf_.set_num_threads(filter_threads, parallel_feature_threshold);
+  
+  // Features beyond this many are carried as Schmidt consider states
+  int max_estimated_features;
+  nh_private_.param<int>("max_estimated_features", max_estimated_features, NUM_FEATURES);
+  ekf_.set_max_estimated_features(max_estimated_features);
+  
+  // Optional fixed-lag smoother (disabled when the lag is zero)
+  double smoother_lag, smoother_period;
+  nh_private_.param<double>("smoother_lag", smoother_lag, 0.0);
+  nh_private_.param<double>("smoother_period", smoother_period, 0.1);
+  ROS_WARN_COND(smoother_lag > 0.0 && smoother_period <= 0.0, "smoother_period must be positive (got %f), smoothing every %f s instead",
+                smoother_period, RTSSmoother::MIN_PERIOD);
+  if (smoother_lag > 0.0)
+    ekf_.enable_smoother(smoother_lag, smoother_period);
+  
   is_flying_ = false; // Start out not flying
   ekf_.set_drag_term(false); // Start out not using the drag term
   
-  klt_tracker_.init(num_features_, false, feature_radius, cv::Size(image_size(0,0), image_size(1,0)));
-  if (!feature_mask.empty())
+  // Tracker settings shared by all the cameras
+  int klt_pyramid_levels, klt_window_size;
+  nh_private_.param<int>("klt_pyramid_levels", klt_pyramid_levels, 3);
+  nh_private_.param<int>("klt_window_size", klt_window_size, 21);
+  
+  // Start each feature's search where the gyros say the rotation since the last image moved it
+  nh_private_.param<bool>("klt_gyro_prediction", klt_gyro_prediction_, false);
+  last_imu_t_ = 0.0;
+  
+  // Drop the tracks that fail a forward-backward LK check, or that a gyro-aided RANSAC finds
+  // off the epipolar geometry, before they get to the filter (thresholds in pixels, 0 disables)
+  double klt_fb_threshold, klt_ransac_threshold;
+  nh_private_.param<double>("klt_fb_threshold", klt_fb_threshold, 0.0);
+  nh_private_.param<double>("klt_ransac_threshold", klt_ransac_threshold, 0.0);
+  klt_use_gyros_ = klt_gyro_prediction_ || klt_ransac_threshold > 0.0;
+  
+  // Track on images downscaled by up to 2^klt_max_scale_level (refined at full resolution), at
+  // that scale, or only as far down as it takes to keep the tracker within klt_time_budget_ms
+  int klt_max_scale_level;
+  double klt_time_budget_ms;
+  nh_private_.param<int>("klt_max_scale_level", klt_max_scale_level, 0);
+  nh_private_.param<double>("klt_time_budget_ms", klt_time_budget_ms, 0.0);
+  
+  // New features come from goodFeaturesToTrack ("gftt") or from FAST in the empty cells of a grid ("grid_fast")
+  std::string feature_detector;
+  int detect_cell_size, corners_per_cell, fast_threshold;
+  nh_private_.param<std::string>("feature_detector", feature_detector, "gftt");
+  nh_private_.param<int>("detect_cell_size", detect_cell_size, 80);
+  nh_private_.param<int>("corners_per_cell", corners_per_cell, 2);
+  nh_private_.param<int>("fast_threshold", fast_threshold, 20);
+  ROS_WARN_COND(feature_detector != "gftt" && feature_detector != "grid_fast", "unknown feature_detector \"%s\", using gftt", feature_detector.c_str());
+  
+  // Look for new features every detect_interval frames, or sooner below detect_fill_threshold
+  // of num_features, optionally on a worker thread that runs while the filter updates
+  int detect_interval;
+  double detect_fill_threshold;
+  bool async_detection;
+  nh_private_.param<int>("detect_interval", detect_interval, 1);
+  nh_private_.param<double>("detect_fill_threshold", detect_fill_threshold, 1.0);
+  nh_private_.param<bool>("async_detection", async_detection, false);
+  
+  // Camera 0 uses the parameters above and the "color" topic, camera k has its own
+  // calibration under camera<k>/ and tracks images from "camera<k>/color".  The features
+  // are split evenly between the cameras, the first ones taking the remainder.
+  int num_cameras;
+  nh_private_.param<int>("num_cameras", num_cameras, 1);
+  num_cameras = std::max(num_cameras, 1);
+  for (int k = 0; k < num_cameras; k++)
   {
-    klt_tracker_.set_feature_mask(feature_mask);
+    Vector2d k_cam_center = cam_center, k_focal_len = focal_len;
+    Vector4d k_q_b_c = q_b_c;
+    Vector3d k_p_b_c = p_b_c;
+    Vector2i k_image_size = image_size;
+    std::string k_feature_mask = feature_mask;
+    std::string prefix = "camera" + to_string(k) + "/";
+    if (k > 0)
+    {
+      importMatrixFromParamServer(nh_private_, k_cam_center, prefix + "cam_center");
+      importMatrixFromParamServer(nh_private_, k_focal_len, prefix + "focal_len");
+      importMatrixFromParamServer(nh_private_, k_q_b_c, prefix + "q_b_c");
+      importMatrixFromParamServer(nh_private_, k_p_b_c, prefix + "p_b_c");
+      importMatrixFromParamServer(nh_private_, k_image_size, prefix + "image_size");
+      nh_private_.param<std::string>(prefix + "feature_mask", k_feature_mask, "");
+      ekf_.add_camera(k_cam_center, k_focal_len, k_q_b_c, k_p_b_c);
+    }
+    
+    camera_tracker_t* camera = new camera_tracker_t;
+    cameras_.emplace_back(camera);
+    camera->index = k;
+    int features_per_camera = num_features_ / num_cameras + (k < num_features_ % num_cameras);
+    camera->tracker.init(features_per_camera, false, feature_radius, cv::Size(k_image_size(0,0), k_image_size(1,0)));
+    camera->tracker.set_pyramid(klt_pyramid_levels, klt_window_size);
+    camera->tracker.set_camera(k_focal_len, k_cam_center);
+    camera->tracker.set_resolution(klt_max_scale_level, klt_time_budget_ms);
+    camera->tracker.set_outlier_rejection(klt_fb_threshold, klt_ransac_threshold);
+    camera->tracker.set_gyro_prediction(klt_gyro_prediction_);
+    camera->tracker.set_detector((feature_detector == "grid_fast") ? KLT_Tracker::GRID_FAST : KLT_Tracker::GFTT,
+                                 detect_cell_size, corners_per_cell, fast_threshold);
+    camera->tracker.set_detection_policy(detect_interval, detect_fill_threshold, async_detection);
+    if (!k_feature_mask.empty())
+      camera->tracker.set_feature_mask(k_feature_mask);
+    camera->R_b_c = Quatd(k_q_b_c).R();
+    camera->rotation.setIdentity();
+    camera->num_features = -1;
+    camera->image_sub = it_.subscribe((k == 0) ? "color" : prefix + "color", 10,
+                                      boost::bind(&VIEKF_ROS::image_callback, this, _1, k));
   }
   
+  // Scale the number of tracked features to keep the per-frame time near the budget (0 disables)
+  double feature_time_budget_ms;
+  int min_features;
+  nh_private_.param<double>("feature_time_budget_ms", feature_time_budget_ms, 0.0);
+  nh_private_.param<int>("min_features", min_features, 5);
+  feature_budget_ = vi_ekf::FeatureBudget(min_features, num_features_, feature_time_budget_ms);
+  imu_time_ms_ = 0.0;
+  
   // Initialize keyframe variables
   kf_att_ = Quatd::Identity();
   kf_pos_.setZero();
@@ -142,12 +273,51 @@ VIEKF_ROS::VIEKF_ROS() :
   
   odom_msg_.header.frame_id = "body";
   
+  // Track each image on the callback thread while a filter thread applies the previous
+  // one's measurements, with up to pipeline_depth tracked frames waiting in between
+  int pipeline_depth;
+  nh_private_.param<bool>("pipeline_tracking", pipeline_tracking_, false);
+  nh_private_.param<int>("pipeline_depth", pipeline_depth, 2);
+  pipeline_depth_ = std::max(pipeline_depth, 1);
+  stop_filter_thread_ = false;
+  if (pipeline_tracking_)
+    filter_thread_ = std::thread(&VIEKF_ROS::filter_thread, this);
+  
+  // With more than one camera, each tracker gets its own thread so the cameras are tracked in parallel
+  stop_tracker_threads_ = false;
+  if (cameras_.size() > 1)
+  {
+    for (auto it = cameras_.begin(); it != cameras_.end(); it++)
+      (*it)->thread = std::thread(&VIEKF_ROS::tracker_thread, this, it->get());
+  }
+  
   if (record_video_)
     video_.open(log_directory + "video.avi", cv::VideoWriter::fourcc('M','J','P','G'), 30, cv::Size(image_size(0,0),image_size(1,0)), true);
 }
 
 VIEKF_ROS::~VIEKF_ROS()
-{}
+{
+  stop_tracker_threads_ = true;
+  for (auto it = cameras_.begin(); it != cameras_.end(); it++)
+  {
+    camera_tracker_t& camera = **it;
+    if (!camera.thread.joinable())
+      continue;
+    camera.image_mtx.lock();
+    camera.image_mtx.unlock();
+    camera.image_cv.notify_all();
+    camera.thread.join();
+  }
+  
+  if (filter_thread_.joinable())
+  {
+    frame_mtx_.lock();
+    stop_filter_thread_ = true;
+    frame_mtx_.unlock();
+    frame_cv_.notify_all();
+    filter_thread_.join();
+  }
+}
 
 void VIEKF_ROS::imu_callback(const sensor_msgs::ImuConstPtr &msg)
 {
@@ -170,13 +340,30 @@ void VIEKF_ROS::imu_callback(const sensor_msgs::ImuConstPtr &msg)
     imu_ = u_;
     imu_init_ = true;
     start_time_ = msg->header.stamp;
+    last_imu_t_ = 0.0;
     return;
   }
   double t = (msg->header.stamp - start_time_).toSec();
   
   // Propagate filter
   ekf_mtx_.lock();
+  auto start = std::chrono::steady_clock::now();
   ekf_.propagate_state(imu_, t);
+  imu_time_ms_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  
+  // Integrate the bias-corrected gyros in each camera's frame (a static point's bearing turns
+  // by exp(-[omega_c dt]x) each step)
+  if (klt_use_gyros_ && t > last_imu_t_)
+  {
+    Vector3d omega = u_.segment<3>(3) - ekf_.get_state().segment<3>(vi_ekf::VIEKF::xB_G);
+    for (auto it = cameras_.begin(); it != cameras_.end(); it++)
+    {
+      Vector3d phi = (*it)->R_b_c * omega * (t - last_imu_t_);
+      if (phi.norm() > 1e-12)
+        (*it)->rotation = AngleAxisd(-phi.norm(), phi.normalized()).toRotationMatrix() * (*it)->rotation;
+    }
+  }
+  last_imu_t_ = t;
   ekf_mtx_.unlock();
 
   
@@ -201,21 +388,23 @@ void VIEKF_ROS::imu_callback(const sensor_msgs::ImuConstPtr &msg)
   ekf_mtx_.lock();
   if (use_imu_att_)
     ekf_.add_measurement(t, z_att_, vi_ekf::VIEKF::ATT, att_R_, (use_truth_) ? true : use_imu_att_);
+  // Publish from one copy of the state, the filter thread can update it at any time
+  Matrix<double, vi_ekf::VIEKF::xZ, 1> x = ekf_.get_state().topRows(vi_ekf::VIEKF::xZ);
   ekf_mtx_.unlock();
 
   if (odometry_pub_.getNumSubscribers() > 0)
   {
     odom_msg_.header.stamp = msg->header.stamp;
-    odom_msg_.pose.pose.position.x = ekf_.get_state()(vi_ekf::VIEKF::xPOS,0);
-    odom_msg_.pose.pose.position.y = ekf_.get_state()(vi_ekf::VIEKF::xPOS+1,0);
-    odom_msg_.pose.pose.position.z = ekf_.get_state()(vi_ekf::VIEKF::xPOS+2,0);
-    odom_msg_.pose.pose.orientation.w = ekf_.get_state()(vi_ekf::VIEKF::xATT,0);
-    odom_msg_.pose.pose.orientation.x = ekf_.get_state()(vi_ekf::VIEKF::xATT+1,0);
-    odom_msg_.pose.pose.orientation.y = ekf_.get_state()(vi_ekf::VIEKF::xATT+2,0);
-    odom_msg_.pose.pose.orientation.z = ekf_.get_state()(vi_ekf::VIEKF::xATT+3,0);
-    odom_msg_.twist.twist.linear.x = ekf_.get_state()(vi_ekf::VIEKF::xVEL,0);
-    odom_msg_.twist.twist.linear.y = ekf_.get_state()(vi_ekf::VIEKF::xVEL+1,0);
-    odom_msg_.twist.twist.linear.z = ekf_.get_state()(vi_ekf::VIEKF::xVEL+2,0);
+    odom_msg_.pose.pose.position.x = x(vi_ekf::VIEKF::xPOS,0);
+    odom_msg_.pose.pose.position.y = x(vi_ekf::VIEKF::xPOS+1,0);
+    odom_msg_.pose.pose.position.z = x(vi_ekf::VIEKF::xPOS+2,0);
+    odom_msg_.pose.pose.orientation.w = x(vi_ekf::VIEKF::xATT,0);
+    odom_msg_.pose.pose.orientation.x = x(vi_ekf::VIEKF::xATT+1,0);
+    odom_msg_.pose.pose.orientation.y = x(vi_ekf::VIEKF::xATT+2,0);
+    odom_msg_.pose.pose.orientation.z = x(vi_ekf::VIEKF::xATT+3,0);
+    odom_msg_.twist.twist.linear.x = x(vi_ekf::VIEKF::xVEL,0);
+    odom_msg_.twist.twist.linear.y = x(vi_ekf::VIEKF::xVEL+1,0);
+    odom_msg_.twist.twist.linear.z = x(vi_ekf::VIEKF::xVEL+2,0);
     odom_msg_.twist.twist.angular.x = imu_(3);
     odom_msg_.twist.twist.angular.y = imu_(4);
     odom_msg_.twist.twist.angular.z = imu_(5);
@@ -225,20 +414,30 @@ void VIEKF_ROS::imu_callback(const sensor_msgs::ImuConstPtr &msg)
   if (bias_pub_.getNumSubscribers() > 0)
   {
     bias_msg_.header = msg->header;
-    bias_msg_.linear_acceleration.x = ekf_.get_state()(vi_ekf::VIEKF::xB_A, 0);
-    bias_msg_.linear_acceleration.y = ekf_.get_state()(vi_ekf::VIEKF::xB_A+1, 0);
-    bias_msg_.linear_acceleration.z = ekf_.get_state()(vi_ekf::VIEKF::xB_A+2, 0);
-    bias_msg_.angular_velocity.x = ekf_.get_state()(vi_ekf::VIEKF::xB_G, 0);
-    bias_msg_.angular_velocity.y = ekf_.get_state()(vi_ekf::VIEKF::xB_G+1, 0);
-    bias_msg_.angular_velocity.z = ekf_.get_state()(vi_ekf::VIEKF::xB_G+2, 0);
+    bias_msg_.linear_acceleration.x = x(vi_ekf::VIEKF::xB_A, 0);
+    bias_msg_.linear_acceleration.y = x(vi_ekf::VIEKF::xB_A+1, 0);
+    bias_msg_.linear_acceleration.z = x(vi_ekf::VIEKF::xB_A+2, 0);
+    bias_msg_.angular_velocity.x = x(vi_ekf::VIEKF::xB_G, 0);
+    bias_msg_.angular_velocity.y = x(vi_ekf::VIEKF::xB_G+1, 0);
+    bias_msg_.angular_velocity.z = x(vi_ekf::VIEKF::xB_G+2, 0);
     bias_pub_.publish(bias_msg_);
   }
 
 }
 
+void VIEKF_ROS::log_policy_callback(const std_msgs::StringConstPtr &msg)
+{
+  ekf_mtx_.lock();
+  bool ok = ekf_.set_log_policy(msg->data);
+  ekf_mtx_.unlock();
+  if (!ok)
+    ROS_WARN("could not parse log_policy \"%s\"", msg->data.c_str());
+}
+
 void VIEKF_ROS::keyframe_reset_callback()
 {
-  
+  // Called by the filter from inside keyframe_reset (on whichever thread runs the update), so
+  // ekf_mtx_ is already held, which also guards truth_* and kf_*
   kf_pos_ = truth_pos_;
   kf_pos_(2) = 0.0; // always at the ground
   
@@ -257,13 +456,53 @@ void VIEKF_ROS::keyframe_reset_callback()
 }
 
 void VIEKF_ROS::color_image_callback(const sensor_msgs::ImageConstPtr &msg)
+{
+  image_callback(msg, 0);
+}
+
+void VIEKF_ROS::image_callback(const sensor_msgs::ImageConstPtr &msg, const int cam)
 {
   if (!imu_init_)
     return;
   
+  camera_tracker_t& camera = *cameras_[cam];
+  if (!camera.thread.joinable())
+  {
+    track_image(msg, camera);
+    return;
+  }
+  
+  // Hand the image to the camera's tracking thread, replacing one it hasn't got to yet
+  camera.image_mtx.lock();
+  camera.pending_image = msg;
+  camera.image_mtx.unlock();
+  camera.image_cv.notify_one();
+}
+
+void VIEKF_ROS::tracker_thread(camera_tracker_t *camera)
+{
+  while (true)
+  {
+    std::unique_lock<std::mutex> lock(camera->image_mtx);
+    camera->image_cv.wait(lock, [this, camera]{ return camera->pending_image || stop_tracker_threads_; });
+    if (stop_tracker_threads_)
+      return;
+    sensor_msgs::ImageConstPtr msg = camera->pending_image;
+    camera->pending_image.reset();
+    lock.unlock();
+    
+    track_image(msg, *camera);
+  }
+}
+
+void VIEKF_ROS::track_image(const sensor_msgs::ImageConstPtr &msg, camera_tracker_t &camera)
+{
+  auto frame_start = std::chrono::steady_clock::now();
+  cv_bridge::CvImageConstPtr cv_ptr;
   try
   {
-    cv_ptr_ = cv_bridge::toCvCopy(msg, sensor_msgs::image_encodings::BGR8);
+    // Shares the message's buffer when it is already BGR, the tracker only reads it
+    cv_ptr = cv_bridge::toCvShare(msg, sensor_msgs::image_encodings::BGR8);
   }
   catch (cv_bridge::Exception& e)
   {
@@ -271,52 +510,160 @@ void VIEKF_ROS::color_image_callback(const sensor_msgs::ImageConstPtr &msg)
     return;
   }
   
+  const cv::Mat* img = &cv_ptr->image;
   if (invert_image_)
-    cv::flip(cv_ptr_->image, img_, -1);
-  else
-    cv_ptr_->image.copyTo(img_);
+  {
+    cv::flip(cv_ptr->image, camera.img, -1);
+    img = &camera.img;
+  }
   
+  // Apply the feature drops and budget changes that came back from the filter stage
+  tracker_feedback_mtx_.lock();
+  for (auto it = camera.drops.begin(); it != camera.drops.end(); it++)
+  {
+    camera.tracker.drop_feature(*it);
+  }
+  camera.drops.clear();
+  if (camera.num_features >= 0)
+    camera.tracker.set_num_features(camera.num_features);
+  camera.num_features = -1;
+  tracker_feedback_mtx_.unlock();
   
   // Track Features in Image
-  klt_tracker_.load_image(img_, msg->header.stamp.toSec(), features_, ids_);
-  
-  ekf_mtx_.lock();
-  // Propagate the covariance
-//  ekf_.propagate_Image();
-  // Set which features we are keeping
-  ekf_.keep_only_features(ids_);
-  ekf_mtx_.unlock();
-
-  double t = (msg->header.stamp - start_time_).toSec();
-  
-  for (int i = 0; i < features_.size(); i++)
+  if (klt_use_gyros_)
+  {
+    ekf_mtx_.lock();
+    Matrix3d R_c2_c1 = camera.rotation;
+    camera.rotation.setIdentity();
+    ekf_mtx_.unlock();
+    camera.tracker.load_image(*img, msg->header.stamp.toSec(), R_c2_c1, camera.features, camera.ids);
+  }
+  else
+    camera.tracker.load_image(*img, msg->header.stamp.toSec(), camera.features, camera.ids);
+  
+  tracked_frame_t frame;
+  frame.t = (msg->header.stamp - start_time_).toSec();
+  frame.cam = camera.index;
+  frame.features = camera.features;
+  frame.ids.resize(camera.ids.size());
+  for (int i = 0; i < camera.ids.size(); i++)
   {
-    int x = round(features_[i].x);
-    int y = round(features_[i].y);
+    frame.ids[i] = filter_id(camera.ids[i], camera.index);
+  }
+  frame.depths.assign(camera.features.size(), NAN);
+  // The depth image is registered to the first camera
+  depth_mtx_.lock();
+  frame.got_depth = got_depth_ && camera.index == 0;
+  for (int i = 0; i < camera.features.size() && camera.index == 0; i++)
+  {
+    int x = round(camera.features[i].x);
+    int y = round(camera.features[i].y);
     // The depth image encodes depth in mm
     float depth = depth_image_.at<float>(y, x) * 1e-3;
     if (depth > 1e3)
       depth = NAN;
     else if (depth < min_depth_)
       depth = NAN;
+    frame.depths[i] = depth;
+  }
+  depth_mtx_.unlock();
+  frame.track_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_start).count();
+  
+  if (!pipeline_tracking_)
+  {
+    update_features(frame);
+    return;
+  }
+  
+  // Hand the frame to the filter thread, waiting for room if it is behind
+  std::unique_lock<std::mutex> lock(frame_mtx_);
+  frame_cv_.wait(lock, [this]{ return frame_queue_.size() < pipeline_depth_ || stop_filter_thread_; });
+  frame_queue_.push_back(std::move(frame));
+  lock.unlock();
+  frame_cv_.notify_all();
+}
+
+void VIEKF_ROS::filter_thread()
+{
+  while (true)
+  {
+    std::unique_lock<std::mutex> lock(frame_mtx_);
+    frame_cv_.wait(lock, [this]{ return !frame_queue_.empty() || stop_filter_thread_; });
+    if (frame_queue_.empty())
+      return;
+    tracked_frame_t frame = std::move(frame_queue_.front());
+    frame_queue_.pop_front();
+    lock.unlock();
+    frame_cv_.notify_all();
     
-    z_feat_ << features_[i].x, features_[i].y;
-    z_depth_ << depth;
+    update_features(frame);
+  }
+}
+
+void VIEKF_ROS::update_features(const tracked_frame_t &frame)
+{
+  auto update_start = std::chrono::steady_clock::now();
+  
+  ekf_mtx_.lock();
+  // Propagate the covariance
+//  ekf_.propagate_Image();
+  // Set which of this camera's features we are keeping
+  ekf_.keep_only_features(frame.ids, frame.cam);
+  ekf_mtx_.unlock();
+
+  double t = frame.t;
+  
+  // (local, since the cameras' threads can be in here at the same time)
+  Vector2d z_feat;
+  Matrix1d z_depth;
+  for (int i = 0; i < frame.features.size(); i++)
+  {
+    float depth = frame.depths[i];
+    z_feat << frame.features[i].x, frame.features[i].y;
+    z_depth << depth;
     ekf_mtx_.lock();
-    int result = ekf_.add_measurement(t, z_feat_, vi_ekf::VIEKF::FEAT, feat_R_, use_features_, ids_[i], (use_depth_) ? depth : NAN);
-    if (result == vi_ekf::VIEKF::MEAS_SUCCESS && got_depth_ && !(depth != depth))
-        ekf_.add_measurement(t, z_depth_, vi_ekf::VIEKF::DEPTH, depth_R_, use_depth_, ids_[i]);    
+    int result = ekf_.add_measurement(t, z_feat, vi_ekf::VIEKF::FEAT, feat_R_, use_features_, frame.ids[i], (use_depth_) ? depth : NAN, frame.cam);
+    if (result == vi_ekf::VIEKF::MEAS_SUCCESS && frame.got_depth && !(depth != depth))
+        ekf_.add_measurement(t, z_depth, vi_ekf::VIEKF::DEPTH, depth_R_, use_depth_, frame.ids[i]);    
     ekf_mtx_.unlock();   
   }
 
   ekf_mtx_.lock();
   std::vector<int> gated_ids;
   ekf_.handle_measurements(&gated_ids);
-  for (auto it = gated_ids.begin(); it != gated_ids.end(); it++)
+  
+  // Charge this frame (both stages), and the IMU propagation since the last one, against the feature budget
+  int num_features = 0;
+  if (feature_budget_.enabled())
   {
-    klt_tracker_.drop_feature(*it);
+    double frame_ms = frame.track_ms + std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - update_start).count();
+    int prev_num_features = feature_budget_.num_features();
+    num_features = feature_budget_.update(frame_ms + imu_time_ms_);
+    if (num_features != prev_num_features)
+      ekf_.set_max_features(num_features);
+    else
+      num_features = 0;
   }
+  imu_time_ms_ = 0.0;
+  
+  uint64_t dropped = ekf_.get_log_dropped_records();
   ekf_mtx_.unlock();
+  if (dropped > 0)
+    ROS_WARN_THROTTLE(5.0, "log buffer overflowed, %lu records dropped", (unsigned long)dropped);
+  
+  // The trackers pick these up before their next image (the gated features can belong to any camera)
+  tracker_feedback_mtx_.lock();
+  int num_cameras = cameras_.size();
+  for (auto it = gated_ids.begin(); it != gated_ids.end(); it++)
+  {
+    cameras_[*it % num_cameras]->drops.push_back(*it / num_cameras);
+  }
+  if (num_features > 0)
+  {
+    for (int k = 0; k < num_cameras; k++)
+      cameras_[k]->num_features = num_features / num_cameras + (k < num_features % num_cameras);
+  }
+  tracker_feedback_mtx_.unlock();
     
 //    // Draw depth and position of tracked features
 //    z_feat_ = ekf_.get_feat(ids_[i]);
@@ -345,11 +692,13 @@ void VIEKF_ROS::depth_image_callback(const sensor_msgs::ImageConstPtr &msg)
     ROS_FATAL("cv_bridge exception: %s", e.what());
     return;
   }
+  depth_mtx_.lock();
   if (invert_image_)
     cv::flip(cv_ptr->image, depth_image_, ROTATE_180);
   else
     cv_ptr->image.copyTo(depth_image_);
   got_depth_ = true;
+  depth_mtx_.unlock();
 }
 
 void VIEKF_ROS::pose_truth_callback(const geometry_msgs::PoseStampedConstPtr &msg)
@@ -385,6 +734,10 @@ void VIEKF_ROS::truth_callback(Vector3d& z_pos, Vector4d& z_att, ros::Time time)
   z_pos = q_I_truth_.rotp(z_pos);
   z_att.block<3,1>(1,0) = q_I_truth_.rotp(z_att.block<3,1>(1,0));
   
+  // The filter state, the truth and the keyframe (kf_*, set by keyframe_reset_callback on the
+  // filter thread) are all shared, so this all happens under ekf_mtx_
+  ekf_mtx_.lock();
+  
   // Make sure that the truth quaternion is the right sign (for plotting)
   if (sign(z_att(0,0)) != sign(ekf_.get_state()(vi_ekf::VIEKF::xATT, 0)))
   {
@@ -399,7 +752,6 @@ void VIEKF_ROS::truth_callback(Vector3d& z_pos, Vector4d& z_att, ros::Time time)
     truth_att_ = Quatd(z_att);
     
     // Initialize the EKF to the origin in the Vicon frame, but then immediately keyframe reset to start at origin
-    ekf_mtx_.lock();
     Matrix<double, vi_ekf::VIEKF::xZ, 1> x0 = ekf_.get_state().topRows(vi_ekf::VIEKF::xZ);
     x0.block<3,1>((int)vi_ekf::VIEKF::xPOS,0) = z_pos;
     x0.block<4,1>((int)vi_ekf::VIEKF::xATT,0) = z_att;
@@ -442,9 +794,7 @@ void VIEKF_ROS::truth_callback(Vector3d& z_pos, Vector4d& z_att, ros::Time time)
   
   global_transform_.t() = z_pos;
   global_transform_.q() = truth_att_;
-  ekf_mtx_.lock();
   ekf_.log_global_position(global_transform_);
-  ekf_mtx_.unlock();
   
   // Convert truth measurement into current node frame
   z_pos = kf_att_.rotp(z_pos - kf_pos_); // position offset, rotated into keyframe
@@ -454,24 +804,19 @@ void VIEKF_ROS::truth_callback(Vector3d& z_pos, Vector4d& z_att, ros::Time time)
 
   double t = (time - start_time_).toSec();
   
-  ekf_mtx_.lock();
   ekf_.add_measurement(t, z_pos, vi_ekf::VIEKF::POS, pos_R_, truth_active);
   ekf_.add_measurement(t, z_att, vi_ekf::VIEKF::ATT, att_R_, truth_active);
   ekf_.handle_measurements();
-  ekf_mtx_.unlock();
 
   // Apply a zero-velocity update if we haven't started flying (helps accelerometer and gyro biases converge)
   if (!is_flying_)
   {
-    ekf_mtx_.lock();
     Vector3d meas = Vector3d::Zero();
     Matrix3d R = Matrix3d::Identity() * 1e-8;
     ekf_.add_measurement(t, meas, vi_ekf::VIEKF::VEL, R, true);
-    ekf_mtx_.unlock();
   }
   
   // Perform Altitude Measurement
-  ekf_mtx_.lock();
   ekf_.add_measurement(t, z_alt_, vi_ekf::VIEKF::ALT, alt_R_, !truth_active);
   ekf_mtx_.unlock();
 }
@@ -510,12 +855,12 @@ void VIEKF_ROS::gps_callback(const inertial_sense::GPSConstPtr &msg)
     Matrix6d gps_R_ = Matrix6d::Zero();
 
     z_gps_ << msg->posEcef.x, msg->posEcef.y, msg->posEcef.z, msg->velEcef.x, msg->velEcef.y, msg->velEcef.z;
+    double t = (msg->header.stamp - start_time_).toSec();
+    ekf_mtx_.lock();
     Rbe = Quatd(ekf_.get_state().segment<4>(vi_ekf::VIEKF::ATT)).R();
     hvAcc.block<3,3>(0,0) << pow(msg->hAcc,2), 0, 0, 0, pow(msg->hAcc,2), 0, 0, 0, pow(msg->vAcc,2);
     gps_R_.block<3,3>(0,0) = Rbe*hvAcc;
     gps_R_.block<3,3>(3,3) << pow(msg->sAcc,2), 0, 0, 0, pow(msg->sAcc,2), 0, 0, 0, pow(msg->sAcc,2);
-    double t = (msg->header.stamp - start_time_).toSec();
-    ekf_mtx_.lock();
     ekf_.add_measurement(t, z_gps_, vi_ekf::VIEKF::GPS, gps_R_, !use_gps_);
     ekf_mtx_.unlock();
 }
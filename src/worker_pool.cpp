@@ -0,0 +1,94 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+
+namespace vi_ekf
+{
+
+WorkerPool::WorkerPool(const int num_threads) :
+  fn_(nullptr),
+  generation_(0),
+  pending_(0),
+  stop_(false)
+{
+  int num_workers = (num_threads > 1) ? num_threads - 1 : 0;
+  chunks_.resize(num_workers);
+  for (int i = 0; i < num_workers; i++)
+  {
+    threads_.emplace_back(&WorkerPool::work, this, i);
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stop_ = true;
+  }
+  start_cv_.notify_all();
+  for (auto it = threads_.begin(); it != threads_.end(); it++)
+  {
+    it->join();
+  }
+}
+
+void WorkerPool::parallel_for(const int begin, const int end, const int grain, const std::function<void(int, int)> &fn)
+{
+  int n = num_threads();
+  int len = end - begin;
+  if (n == 1 || len <= grain)
+  {
+    fn(begin, end);
+    return;
+  }
+
+  // Chunk size, rounded up to a multiple of the grain
+  int chunk = (len + n - 1) / n;
+  chunk = ((chunk + grain - 1) / grain) * grain;
+
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (int i = 0; i < (int)threads_.size(); i++)
+    {
+      int chunk_begin = std::min(begin + (i+1) * chunk, end);
+      int chunk_end = std::min(chunk_begin + chunk, end);
+      chunks_[i] = std::make_pair(chunk_begin, chunk_end);
+    }
+    fn_ = &fn;
+    pending_ = threads_.size();
+    generation_++;
+  }
+  start_cv_.notify_all();
+
+  // Do our share of the work while we wait
+  fn(begin, std::min(begin + chunk, end));
+
+  std::unique_lock<std::mutex> lock(mtx_);
+  done_cv_.wait(lock, [this]{ return pending_ == 0; });
+  fn_ = nullptr;
+}
+
+void WorkerPool::work(const int id)
+{
+  int seen_generation = 0;
+  std::unique_lock<std::mutex> lock(mtx_);
+  while (true)
+  {
+    start_cv_.wait(lock, [&]{ return stop_ || generation_ != seen_generation; });
+    if (stop_)
+      return;
+    seen_generation = generation_;
+    std::pair<int, int> chunk = chunks_[id];
+    const std::function<void(int, int)>* fn = fn_;
+
+    lock.unlock();
+    if (chunk.first < chunk.second)
+      (*fn)(chunk.first, chunk.second);
+    lock.lock();
+
+    if (--pending_ == 0)
+      done_cv_.notify_one();
+  }
+}
+
+}